@@ -0,0 +1,677 @@
+/*
+  HTTP load generator for the web server
+
+  Replays the request mix the web UI generates against a running
+  web_server: static assets, ajax/sysinfo.json polls and
+  ajax/command.json posts of mavlink_message() and get_param_list(),
+  sent as multipart forms like the browser sends them.
+
+  Each of the -c workers loops over the mix for the given duration.
+  With -k the workers ask for keep-alive and reuse a connection when
+  the server allows it.
+
+  Results are written as JSON: throughput, error counts by kind,
+  latency percentiles and a latency histogram per request type.
+
+  Example:
+    bench/httpload -H 127.0.0.1 -p 8080 -c 8 -d 10 -k -o result.json
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#define LOAD_TIMEOUT_MS 5000
+#define LOAD_BOUNDARY "----apwebload"
+
+enum load_type {
+    LOAD_STATIC,
+    LOAD_SYSINFO,
+    LOAD_MESSAGE,
+    LOAD_PARAMS,
+    LOAD_NUM_TYPES
+};
+
+static const char *type_names[LOAD_NUM_TYPES] = {
+    "static",
+    "sysinfo",
+    "message",
+    "params",
+};
+
+// assets a browser loads for the status page
+static const char *static_paths[] = {
+    "/index.html",
+    "/status.html",
+    "/css/styles.css",
+    "/js/config.js",
+    "/js/cors.js",
+    "/js/mavlink.js",
+    "/js/smoothie.min.js",
+    "/js/charts.js",
+};
+#define NUM_STATIC_PATHS (sizeof(static_paths)/sizeof(static_paths[0]))
+
+// upper bounds of the histogram buckets in usec, the last is open
+static const uint32_t hist_bounds[] = {
+    100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000,
+    100000, 200000, 500000, 1000000, 2000000, 5000000,
+};
+#define NUM_HIST_BUCKETS (sizeof(hist_bounds)/sizeof(hist_bounds[0]) + 1)
+
+enum load_error {
+    LOAD_ERR_CONNECT,
+    LOAD_ERR_IO,
+    LOAD_ERR_STATUS,
+    LOAD_NUM_ERRORS
+};
+
+static const char *error_names[LOAD_NUM_ERRORS] = {
+    "connect",
+    "io",
+    "status",
+};
+
+static struct {
+    const char *host;
+    uint16_t port;
+    unsigned concurrency;
+    double duration;
+    bool keepalive;
+    const char *output;
+    const char *messages;
+    const char *param_prefix;
+    unsigned weights[LOAD_NUM_TYPES];
+    unsigned total_weight;
+} opts = {
+    .host = "127.0.0.1",
+    .port = 80,
+    .concurrency = 4,
+    .duration = 10,
+    .messages = "ATTITUDE,VFR_HUD,GPS_RAW_INT,SYS_STATUS,HEARTBEAT",
+    .param_prefix = "INS_,COMPASS_",
+};
+
+struct type_stats {
+    uint32_t requests;
+    uint32_t errors[LOAD_NUM_ERRORS];
+    uint64_t bytes;
+    uint32_t hist[NUM_HIST_BUCKETS];
+    // latencies of successful requests in usec
+    uint32_t *latency_us;
+    uint32_t num_latency;
+    uint32_t max_latency;
+};
+
+struct worker {
+    pthread_t thread_id;
+    unsigned index;
+    int fd;
+    uint32_t connections;
+    uint32_t reused;
+    struct type_stats stats[LOAD_NUM_TYPES];
+};
+
+static struct sockaddr_in server_addr;
+static uint64_t end_us;
+static char *request_text[LOAD_NUM_TYPES][NUM_STATIC_PATHS];
+static size_t request_len[LOAD_NUM_TYPES][NUM_STATIC_PATHS];
+
+/*
+  get the current time in microseconds
+ */
+static uint64_t time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+  build a request once, so workers only have to send it
+ */
+static void build_request(enum load_type type, unsigned i, const char *path, const char *command)
+{
+    char *text = NULL;
+    int len;
+    const char *conn = opts.keepalive ? "keep-alive" : "close";
+    const char *version = opts.keepalive ? "1.1" : "1.0";
+    if (command == NULL) {
+        len = asprintf(&text,
+                       "GET %s HTTP/%s\r\nHost: %s:%u\r\nConnection: %s\r\n\r\n",
+                       path, version, opts.host, opts.port, conn);
+    } else {
+        char *body = NULL;
+        int body_len = asprintf(&body,
+                                "--" LOAD_BOUNDARY "\r\n"
+                                "Content-Disposition: form-data; name=\"command1\"\r\n\r\n"
+                                "%s\r\n"
+                                "--" LOAD_BOUNDARY "--\r\n", command);
+        if (body_len < 0) {
+            exit(1);
+        }
+        len = asprintf(&text,
+                       "POST %s HTTP/%s\r\nHost: %s:%u\r\nConnection: %s\r\n"
+                       "Content-Type: multipart/form-data; boundary=" LOAD_BOUNDARY "\r\n"
+                       "Content-Length: %d\r\n\r\n%s",
+                       path, version, opts.host, opts.port, conn, body_len, body);
+        free(body);
+    }
+    if (len < 0) {
+        exit(1);
+    }
+    request_text[type][i] = text;
+    request_len[type][i] = len;
+}
+
+/*
+  build all the requests in the mix
+ */
+static void build_requests(void)
+{
+    char *command = NULL;
+    unsigned i;
+    for (i=0; i<NUM_STATIC_PATHS; i++) {
+        build_request(LOAD_STATIC, i, static_paths[i], NULL);
+    }
+    build_request(LOAD_SYSINFO, 0, "/ajax/sysinfo.json", NULL);
+    if (asprintf(&command, "mavlink_message(%s)", opts.messages) < 0) {
+        exit(1);
+    }
+    build_request(LOAD_MESSAGE, 0, "/ajax/command.json", command);
+    free(command);
+    if (asprintf(&command, "get_param_list(%s)", opts.param_prefix) < 0) {
+        exit(1);
+    }
+    build_request(LOAD_PARAMS, 0, "/ajax/command.json", command);
+    free(command);
+}
+
+/*
+  pick the type of a request from the weighted mix
+ */
+static enum load_type request_type(uint32_t n)
+{
+    unsigned slot = n % opts.total_weight;
+    enum load_type t;
+    for (t=0; t<LOAD_NUM_TYPES; t++) {
+        if (slot < opts.weights[t]) {
+            return t;
+        }
+        slot -= opts.weights[t];
+    }
+    return LOAD_STATIC;
+}
+
+/*
+  parse a mix like static:4,sysinfo:2
+ */
+static bool parse_mix(const char *arg)
+{
+    char *s = strdup(arg);
+    char *saveptr = NULL;
+    char *tok;
+    memset(opts.weights, 0, sizeof(opts.weights));
+    opts.total_weight = 0;
+    for (tok = strtok_r(s, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+        char *colon = strchr(tok, ':');
+        unsigned weight = 1;
+        if (colon != NULL) {
+            *colon = 0;
+            weight = atoi(colon+1);
+        }
+        enum load_type t;
+        for (t=0; t<LOAD_NUM_TYPES; t++) {
+            if (strcmp(tok, type_names[t]) == 0) {
+                break;
+            }
+        }
+        if (t == LOAD_NUM_TYPES) {
+            printf("Unknown request type %s\n", tok);
+            free(s);
+            return false;
+        }
+        opts.weights[t] += weight;
+        opts.total_weight += weight;
+    }
+    free(s);
+    return opts.total_weight > 0;
+}
+
+/*
+  open a connection to the server
+ */
+static int load_connect(void)
+{
+    int one = 1;
+    struct timeval tv = { LOAD_TIMEOUT_MS / 1000, (LOAD_TIMEOUT_MS % 1000) * 1000 };
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+  send a whole buffer
+ */
+static bool send_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+/*
+  read a response, returning the number of bytes read or -1 on error.
+  Sets *status to the http status and *reusable if the connection can
+  be used for another request
+ */
+static ssize_t read_response(int fd, int *status, bool *reusable)
+{
+    char buf[16384];
+    size_t have = 0;
+    char *body = NULL;
+    ssize_t n;
+
+    // read the headers
+    while (body == NULL) {
+        if (have == sizeof(buf) - 1) {
+            return -1;
+        }
+        n = recv(fd, &buf[have], sizeof(buf) - 1 - have, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        have += n;
+        buf[have] = 0;
+        body = strstr(buf, "\r\n\r\n");
+    }
+    body += 4;
+
+    unsigned major, minor;
+    if (sscanf(buf, "HTTP/%u.%u %d", &major, &minor, status) != 3) {
+        return -1;
+    }
+    ssize_t content_length = -1;
+    bool close_conn = (major == 1 && minor == 0);
+    char *line;
+    for (line = strstr(buf, "\r\n"); line != NULL && line+2 < body; line = strstr(line+2, "\r\n")) {
+        const char *h = line + 2;
+        if (strncasecmp(h, "Content-Length:", 15) == 0) {
+            content_length = atol(h + 15);
+        } else if (strncasecmp(h, "Connection:", 11) == 0) {
+            const char *v = h + 11;
+            while (*v == ' ') {
+                v++;
+            }
+            close_conn = (strncasecmp(v, "keep-alive", 10) != 0);
+        }
+    }
+
+    ssize_t total = have;
+    ssize_t body_have = have - (body - buf);
+    while (content_length == -1 || body_have < content_length) {
+        n = recv(fd, buf, sizeof(buf), 0);
+        if (n == 0 && content_length == -1) {
+            // body ends when the server closes
+            break;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        total += n;
+        body_have += n;
+    }
+    *reusable = !close_conn && content_length != -1;
+    return total;
+}
+
+/*
+  record one request
+ */
+static void record(struct type_stats *st, uint32_t latency, ssize_t bytes, int error)
+{
+    st->requests++;
+    if (error != -1) {
+        st->errors[error]++;
+        return;
+    }
+    st->bytes += bytes;
+    unsigned b;
+    for (b=0; b<NUM_HIST_BUCKETS-1; b++) {
+        if (latency <= hist_bounds[b]) {
+            break;
+        }
+    }
+    st->hist[b]++;
+    if (st->num_latency == st->max_latency) {
+        st->max_latency = st->max_latency ? st->max_latency * 2 : 4096;
+        st->latency_us = realloc(st->latency_us, st->max_latency * sizeof(uint32_t));
+        if (st->latency_us == NULL) {
+            exit(1);
+        }
+    }
+    st->latency_us[st->num_latency++] = latency;
+}
+
+/*
+  worker thread: send requests until the end time
+ */
+static void *worker_thread(void *arg)
+{
+    struct worker *w = arg;
+    uint32_t n = w->index;
+    uint32_t static_n = w->index;
+
+    w->fd = -1;
+    while (time_us() < end_us) {
+        enum load_type type = request_type(n++);
+        unsigned i = 0;
+        if (type == LOAD_STATIC) {
+            i = static_n++ % NUM_STATIC_PATHS;
+        }
+        struct type_stats *st = &w->stats[type];
+        uint64_t start = time_us();
+        bool reused = (w->fd != -1);
+        if (w->fd == -1) {
+            w->fd = load_connect();
+            if (w->fd == -1) {
+                record(st, 0, 0, LOAD_ERR_CONNECT);
+                usleep(10000);
+                continue;
+            }
+            w->connections++;
+        }
+        int status = 0;
+        bool reusable = false;
+        ssize_t bytes = -1;
+        if (send_all(w->fd, request_text[type][i], request_len[type][i])) {
+            bytes = read_response(w->fd, &status, &reusable);
+        }
+        if (bytes == -1 && reused) {
+            // the server closed an idle connection, try once more on a new one
+            close(w->fd);
+            w->fd = load_connect();
+            reused = false;
+            if (w->fd == -1) {
+                record(st, 0, 0, LOAD_ERR_CONNECT);
+                continue;
+            }
+            w->connections++;
+            if (send_all(w->fd, request_text[type][i], request_len[type][i])) {
+                bytes = read_response(w->fd, &status, &reusable);
+            }
+        }
+        uint32_t latency = time_us() - start;
+        if (reused) {
+            w->reused++;
+        }
+        if (bytes == -1) {
+            record(st, latency, 0, LOAD_ERR_IO);
+            reusable = false;
+        } else if (status < 200 || status > 299) {
+            record(st, latency, bytes, LOAD_ERR_STATUS);
+        } else {
+            record(st, latency, bytes, -1);
+        }
+        if (!reusable) {
+            close(w->fd);
+            w->fd = -1;
+        }
+    }
+    if (w->fd != -1) {
+        close(w->fd);
+    }
+    return NULL;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t v1 = *(const uint32_t *)a;
+    uint32_t v2 = *(const uint32_t *)b;
+    return v1 < v2 ? -1 : v1 > v2 ? 1 : 0;
+}
+
+/*
+  get a percentile from sorted latencies
+ */
+static uint32_t percentile(const struct type_stats *st, double pct)
+{
+    if (st->num_latency == 0) {
+        return 0;
+    }
+    uint32_t i = (uint32_t)(pct * 0.01 * (st->num_latency - 1) + 0.5);
+    return st->latency_us[i];
+}
+
+/*
+  add one worker's stats into the totals
+ */
+static void merge_stats(struct type_stats *total, const struct type_stats *st)
+{
+    unsigned i;
+    total->requests += st->requests;
+    total->bytes += st->bytes;
+    for (i=0; i<LOAD_NUM_ERRORS; i++) {
+        total->errors[i] += st->errors[i];
+    }
+    for (i=0; i<NUM_HIST_BUCKETS; i++) {
+        total->hist[i] += st->hist[i];
+    }
+    if (st->num_latency > 0) {
+        total->latency_us = realloc(total->latency_us, (total->num_latency + st->num_latency) * sizeof(uint32_t));
+        if (total->latency_us == NULL) {
+            exit(1);
+        }
+        memcpy(&total->latency_us[total->num_latency], st->latency_us, st->num_latency * sizeof(uint32_t));
+        total->num_latency += st->num_latency;
+    }
+}
+
+/*
+  write the stats for one request type as json
+ */
+static void print_stats(FILE *f, const char *name, struct type_stats *st, double secs, bool last)
+{
+    unsigned i;
+    uint32_t errors = 0;
+    uint64_t sum = 0;
+
+    qsort(st->latency_us, st->num_latency, sizeof(uint32_t), compare_u32);
+    for (i=0; i<LOAD_NUM_ERRORS; i++) {
+        errors += st->errors[i];
+    }
+    for (i=0; i<st->num_latency; i++) {
+        sum += st->latency_us[i];
+    }
+    fprintf(f, "    \"%s\" : {\n", name);
+    fprintf(f, "      \"requests\" : %u,\n", st->requests);
+    fprintf(f, "      \"rps\" : %.1f,\n", st->requests / secs);
+    fprintf(f, "      \"bytes\" : %llu,\n", (unsigned long long)st->bytes);
+    fprintf(f, "      \"errors\" : { ");
+    for (i=0; i<LOAD_NUM_ERRORS; i++) {
+        fprintf(f, "\"%s\" : %u, ", error_names[i], st->errors[i]);
+    }
+    fprintf(f, "\"total\" : %u },\n", errors);
+    fprintf(f, "      \"error_rate\" : %.6f,\n", st->requests ? errors / (double)st->requests : 0);
+    fprintf(f, "      \"latency_us\" : { \"min\" : %u, \"mean\" : %.0f, \"p50\" : %u, \"p90\" : %u, \"p99\" : %u, \"p999\" : %u, \"max\" : %u },\n",
+            st->num_latency ? st->latency_us[0] : 0,
+            st->num_latency ? sum / (double)st->num_latency : 0,
+            percentile(st, 50), percentile(st, 90), percentile(st, 99), percentile(st, 99.9),
+            st->num_latency ? st->latency_us[st->num_latency-1] : 0);
+    fprintf(f, "      \"histogram\" : [ ");
+    for (i=0; i<NUM_HIST_BUCKETS; i++) {
+        if (i < NUM_HIST_BUCKETS-1) {
+            fprintf(f, "[%u, %u], ", hist_bounds[i], st->hist[i]);
+        } else {
+            fprintf(f, "[null, %u] ]\n", st->hist[i]);
+        }
+    }
+    fprintf(f, "    }%s\n", last ? "" : ",");
+}
+
+static void usage(void)
+{
+    printf("Usage: httpload [options]\n");
+    printf("  -H HOST   server address (default 127.0.0.1)\n");
+    printf("  -p PORT   server port (default 80)\n");
+    printf("  -c N      concurrent connections (default 4)\n");
+    printf("  -d SECS   duration (default 10)\n");
+    printf("  -k        use keep-alive and reuse connections\n");
+    printf("  -m MIX    request mix, e.g. static:4,sysinfo:4,message:4,params:1\n");
+    printf("  -M LIST   message types for mavlink_message()\n");
+    printf("  -P LIST   prefixes for get_param_list()\n");
+    printf("  -o FILE   write the json result to FILE instead of stdout\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    unsigned i, t;
+
+    parse_mix("static:2,sysinfo:4,message:4,params:1");
+
+    while ((opt=getopt(argc, argv, "H:p:c:d:km:M:P:o:h")) != -1) {
+        switch (opt) {
+        case 'H':
+            opts.host = optarg;
+            break;
+        case 'p':
+            opts.port = atoi(optarg);
+            break;
+        case 'c':
+            opts.concurrency = atoi(optarg);
+            break;
+        case 'd':
+            opts.duration = atof(optarg);
+            break;
+        case 'k':
+            opts.keepalive = true;
+            break;
+        case 'm':
+            if (!parse_mix(optarg)) {
+                exit(1);
+            }
+            break;
+        case 'M':
+            opts.messages = optarg;
+            break;
+        case 'P':
+            opts.param_prefix = optarg;
+            break;
+        case 'o':
+            opts.output = optarg;
+            break;
+        case 'h':
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (opts.concurrency == 0) {
+        usage();
+        exit(1);
+    }
+
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res = NULL;
+    if (getaddrinfo(opts.host, NULL, &hints, &res) != 0 || res == NULL) {
+        printf("Unknown host %s\n", opts.host);
+        exit(1);
+    }
+    memcpy(&server_addr, res->ai_addr, sizeof(server_addr));
+    server_addr.sin_port = htons(opts.port);
+    freeaddrinfo(res);
+
+    signal(SIGPIPE, SIG_IGN);
+    build_requests();
+
+    struct worker *workers = calloc(opts.concurrency, sizeof(struct worker));
+    if (workers == NULL) {
+        exit(1);
+    }
+    uint64_t start_us = time_us();
+    end_us = start_us + (uint64_t)(opts.duration * 1.0e6);
+    for (i=0; i<opts.concurrency; i++) {
+        workers[i].index = i;
+        if (pthread_create(&workers[i].thread_id, NULL, worker_thread, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    struct type_stats totals[LOAD_NUM_TYPES];
+    struct type_stats all;
+    uint32_t connections = 0, reused = 0;
+    memset(totals, 0, sizeof(totals));
+    memset(&all, 0, sizeof(all));
+    for (i=0; i<opts.concurrency; i++) {
+        pthread_join(workers[i].thread_id, NULL);
+        connections += workers[i].connections;
+        reused += workers[i].reused;
+        for (t=0; t<LOAD_NUM_TYPES; t++) {
+            merge_stats(&totals[t], &workers[i].stats[t]);
+            merge_stats(&all, &workers[i].stats[t]);
+            free(workers[i].stats[t].latency_us);
+        }
+    }
+    double secs = (time_us() - start_us) * 1.0e-6;
+
+    FILE *f = stdout;
+    if (opts.output != NULL) {
+        f = fopen(opts.output, "w");
+        if (f == NULL) {
+            perror(opts.output);
+            exit(1);
+        }
+    }
+    fprintf(f, "{\n");
+    fprintf(f, "  \"config\" : { \"host\" : \"%s\", \"port\" : %u, \"concurrency\" : %u, \"duration\" : %.1f, \"keepalive\" : %s },\n",
+            opts.host, opts.port, opts.concurrency, secs, opts.keepalive ? "true" : "false");
+    fprintf(f, "  \"connections\" : %u,\n", connections);
+    fprintf(f, "  \"reused\" : %u,\n", reused);
+    fprintf(f, "  \"types\" : {\n");
+    for (t=0; t<LOAD_NUM_TYPES; t++) {
+        print_stats(f, type_names[t], &totals[t], secs, false);
+    }
+    print_stats(f, "total", &all, secs, true);
+    fprintf(f, "  }\n}\n");
+    if (f != stdout) {
+        fclose(f);
+    }
+
+    uint32_t errors = 0;
+    for (i=0; i<LOAD_NUM_ERRORS; i++) {
+        errors += all.errors[i];
+    }
+    return errors > 0 ? 2 : 0;
+}
@@ -0,0 +1,656 @@
+/*
+  MAVLink flood benchmark for the web server routing path
+
+  Starts web_server with a pty (or a udp-in port) standing in for the
+  flight controller and a udp-out address pointing back at us, then
+  sends a configurable mix of telemetry at a fixed rate. Every frame
+  carries a sequence number in its timestamp field, so frames coming
+  back out of the server can be matched to the time they were sent.
+
+  Reports sustained send and forward rates, loss and forwarding latency
+  percentiles.
+
+  Example:
+    bench/mavflood -S ./web_server -r 5000 -d 10 -m attitude:4,raw_imu:1
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "generated/mavlink/ardupilotmega/mavlink.h"
+
+#define FLOOD_SYSID 1
+#define FLOOD_COMPID 1
+// sequence used while waiting for the server to come up
+#define FLOOD_WARMUP_ID 0xFFFFFFFFU
+// cap on frames in as-fast-as-possible mode
+#define FLOOD_MAX_FRAMES (16*1024*1024)
+
+/*
+  message types we can send. Each one has a timestamp field we can use
+  to carry the sequence number
+ */
+enum flood_type {
+    FLOOD_ATTITUDE,
+    FLOOD_GLOBAL_POSITION_INT,
+    FLOOD_RAW_IMU,
+    FLOOD_SCALED_PRESSURE,
+    FLOOD_SERVO_OUTPUT_RAW,
+    FLOOD_RC_CHANNELS,
+    FLOOD_NUM_TYPES
+};
+
+static const char *type_names[FLOOD_NUM_TYPES] = {
+    "attitude",
+    "global_position_int",
+    "raw_imu",
+    "scaled_pressure",
+    "servo_output_raw",
+    "rc_channels",
+};
+
+static struct {
+    const char *server;
+    const char *extra_args;
+    bool use_udp;
+    uint16_t udp_in_port;
+    double rate;
+    double duration;
+    bool verbose;
+    unsigned weights[FLOOD_NUM_TYPES];
+    unsigned total_weight;
+} opts = {
+    .server = "./web_server",
+    .udp_in_port = 14651,
+    .rate = 1000,
+    .duration = 10,
+};
+
+static int fc_fd = -1;
+static struct sockaddr_in fc_addr;
+static int out_fd = -1;
+static pid_t server_pid = -1;
+
+// time each frame was sent, in usec from the start. Zero if not sent
+static uint32_t *sent_us;
+static uint32_t *latency_us;
+static uint32_t max_frames;
+static uint32_t num_sent;
+static uint32_t num_blocked;
+static bool sender_done;
+static uint64_t start_us;
+static uint64_t send_end_us;
+
+/*
+  get the current time in microseconds
+ */
+static uint64_t time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+  build a frame of a given type carrying a sequence number
+ */
+static uint16_t build_frame(enum flood_type type, uint32_t id, uint8_t *buf)
+{
+    mavlink_message_t msg;
+    switch (type) {
+    case FLOOD_ATTITUDE: {
+        mavlink_attitude_t p = { .time_boot_ms = id, .roll = 0.1, .pitch = 0.2, .yaw = 0.3 };
+        mavlink_msg_attitude_encode(FLOOD_SYSID, FLOOD_COMPID, &msg, &p);
+        break;
+    }
+    case FLOOD_GLOBAL_POSITION_INT: {
+        mavlink_global_position_int_t p = { .time_boot_ms = id, .lat = -353632610, .lon = 1491652300, .alt = 584000 };
+        mavlink_msg_global_position_int_encode(FLOOD_SYSID, FLOOD_COMPID, &msg, &p);
+        break;
+    }
+    case FLOOD_RAW_IMU: {
+        mavlink_raw_imu_t p = { .time_usec = id, .zacc = -1000 };
+        mavlink_msg_raw_imu_encode(FLOOD_SYSID, FLOOD_COMPID, &msg, &p);
+        break;
+    }
+    case FLOOD_SCALED_PRESSURE: {
+        mavlink_scaled_pressure_t p = { .time_boot_ms = id, .press_abs = 1013.25, .temperature = 2500 };
+        mavlink_msg_scaled_pressure_encode(FLOOD_SYSID, FLOOD_COMPID, &msg, &p);
+        break;
+    }
+    case FLOOD_SERVO_OUTPUT_RAW: {
+        mavlink_servo_output_raw_t p = { .time_usec = id, .servo1_raw = 1500, .servo2_raw = 1500 };
+        mavlink_msg_servo_output_raw_encode(FLOOD_SYSID, FLOOD_COMPID, &msg, &p);
+        break;
+    }
+    case FLOOD_RC_CHANNELS:
+    default: {
+        mavlink_rc_channels_t p = { .time_boot_ms = id, .chancount = 4, .chan1_raw = 1500 };
+        mavlink_msg_rc_channels_encode(FLOOD_SYSID, FLOOD_COMPID, &msg, &p);
+        break;
+    }
+    }
+    return mavlink_msg_to_send_buffer(buf, &msg);
+}
+
+/*
+  get the sequence number back out of a forwarded frame, returning
+  false for frames we did not send
+ */
+static bool frame_id(const mavlink_message_t *msg, uint32_t *id)
+{
+    if (msg->sysid != FLOOD_SYSID) {
+        return false;
+    }
+    switch (msg->msgid) {
+    case MAVLINK_MSG_ID_ATTITUDE:
+        *id = mavlink_msg_attitude_get_time_boot_ms(msg);
+        return true;
+    case MAVLINK_MSG_ID_GLOBAL_POSITION_INT:
+        *id = mavlink_msg_global_position_int_get_time_boot_ms(msg);
+        return true;
+    case MAVLINK_MSG_ID_RAW_IMU:
+        *id = (uint32_t)mavlink_msg_raw_imu_get_time_usec(msg);
+        return true;
+    case MAVLINK_MSG_ID_SCALED_PRESSURE:
+        *id = mavlink_msg_scaled_pressure_get_time_boot_ms(msg);
+        return true;
+    case MAVLINK_MSG_ID_SERVO_OUTPUT_RAW:
+        *id = mavlink_msg_servo_output_raw_get_time_usec(msg);
+        return true;
+    case MAVLINK_MSG_ID_RC_CHANNELS:
+        *id = mavlink_msg_rc_channels_get_time_boot_ms(msg);
+        return true;
+    }
+    return false;
+}
+
+/*
+  pick the type of a frame from the weighted mix
+ */
+static enum flood_type frame_type(uint32_t id)
+{
+    unsigned slot = id % opts.total_weight;
+    enum flood_type t;
+    for (t=0; t<FLOOD_NUM_TYPES; t++) {
+        if (slot < opts.weights[t]) {
+            return t;
+        }
+        slot -= opts.weights[t];
+    }
+    return FLOOD_ATTITUDE;
+}
+
+/*
+  parse a mix like attitude:4,raw_imu:1
+ */
+static bool parse_mix(const char *arg)
+{
+    char *s = strdup(arg);
+    char *saveptr = NULL;
+    char *tok;
+    memset(opts.weights, 0, sizeof(opts.weights));
+    opts.total_weight = 0;
+    for (tok = strtok_r(s, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+        char *colon = strchr(tok, ':');
+        unsigned weight = 1;
+        if (colon != NULL) {
+            *colon = 0;
+            weight = atoi(colon+1);
+        }
+        enum flood_type t;
+        for (t=0; t<FLOOD_NUM_TYPES; t++) {
+            if (strcmp(tok, type_names[t]) == 0) {
+                break;
+            }
+        }
+        if (t == FLOOD_NUM_TYPES) {
+            printf("Unknown message type %s\n", tok);
+            free(s);
+            return false;
+        }
+        opts.weights[t] += weight;
+        opts.total_weight += weight;
+    }
+    free(s);
+    return opts.total_weight > 0;
+}
+
+/*
+  send a frame to the server. If the server is not keeping up, the
+  frame is dropped when sending at a fixed rate, like a real uart, and
+  waited for in as-fast-as-possible mode
+ */
+static bool send_frame(const uint8_t *buf, uint16_t len)
+{
+    if (opts.use_udp) {
+        ssize_t n = sendto(fc_fd, buf, len, opts.rate > 0?MSG_DONTWAIT:0,
+                           (struct sockaddr *)&fc_addr, sizeof(fc_addr));
+        return n == len;
+    }
+    uint16_t ofs = 0;
+    while (ofs < len) {
+        ssize_t n = write(fc_fd, &buf[ofs], len - ofs);
+        if (n > 0) {
+            ofs += n;
+            continue;
+        }
+        if (n == -1 && errno != EAGAIN && errno != EINTR) {
+            return false;
+        }
+        if (ofs == 0 && opts.rate > 0) {
+            return false;
+        }
+        // never leave half a frame in the pty
+        struct pollfd pfd = { fc_fd, POLLOUT, 0 };
+        poll(&pfd, 1, 100);
+    }
+    return true;
+}
+
+/*
+  discard anything the server sends to the fc
+ */
+static void drain_fc(void)
+{
+    uint8_t buf[1024];
+    if (opts.use_udp) {
+        while (recv(fc_fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) ;
+    } else {
+        while (read(fc_fd, buf, sizeof(buf)) > 0) ;
+    }
+}
+
+/*
+  sender thread: send frames at the requested rate
+ */
+static void *sender_thread(void *arg)
+{
+    uint8_t buf[MAVLINK_MAX_PACKET_LEN];
+    uint32_t id;
+
+    for (id=0; id<max_frames; id++) {
+        uint64_t now = time_us();
+        if (opts.rate > 0) {
+            uint64_t due = start_us + (uint64_t)(id * 1.0e6 / opts.rate);
+            if (due > now + 50) {
+                struct timespec ts = { (due / 1000000), (due % 1000000) * 1000 };
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+                now = time_us();
+            }
+        } else if (now - start_us > opts.duration * 1.0e6) {
+            break;
+        }
+        if ((id & 0xFF) == 0) {
+            drain_fc();
+        }
+        uint16_t len = build_frame(frame_type(id), id, buf);
+        // record the time first, the reply can beat us back
+        uint32_t t = (uint32_t)(time_us() - start_us) + 1;
+        __atomic_store_n(&sent_us[id], t, __ATOMIC_RELEASE);
+        if (!send_frame(buf, len)) {
+            __atomic_store_n(&sent_us[id], 0, __ATOMIC_RELEASE);
+            num_blocked++;
+        }
+    }
+    num_sent = id - num_blocked;
+    send_end_us = time_us();
+    __atomic_store_n(&sender_done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*
+  read frames forwarded by the server, calling fn for each of ours
+ */
+static void receive_frames(int timeout_ms, void (*fn)(uint32_t id, uint64_t now))
+{
+    static mavlink_status_t status;
+    static mavlink_message_t msg;
+    uint8_t buf[2048];
+    struct pollfd pfd = { out_fd, POLLIN, 0 };
+
+    if (poll(&pfd, 1, timeout_ms) <= 0) {
+        return;
+    }
+    while (true) {
+        ssize_t n = recv(out_fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n <= 0) {
+            break;
+        }
+        uint64_t now = time_us();
+        ssize_t i;
+        for (i=0; i<n; i++) {
+            uint32_t id;
+            if (mavlink_parse_char(MAVLINK_COMM_0, buf[i], &msg, &status) &&
+                frame_id(&msg, &id)) {
+                fn(id, now);
+            }
+        }
+    }
+}
+
+static uint32_t num_received;
+static uint32_t num_unexpected;
+static bool warm;
+
+/*
+  record the latency of a forwarded frame
+ */
+static void got_frame(uint32_t id, uint64_t now)
+{
+    if (id >= max_frames) {
+        return;
+    }
+    uint32_t t = __atomic_exchange_n(&sent_us[id], 0, __ATOMIC_ACQ_REL);
+    if (t == 0) {
+        // duplicate, or never sent
+        num_unexpected++;
+        return;
+    }
+    latency_us[num_received++] = (uint32_t)(now - start_us) - (t - 1);
+}
+
+/*
+  note that the server is forwarding
+ */
+static void got_warmup(uint32_t id, uint64_t now)
+{
+    if (id == FLOOD_WARMUP_ID) {
+        warm = true;
+    }
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t v1 = *(const uint32_t *)a;
+    uint32_t v2 = *(const uint32_t *)b;
+    return v1 < v2 ? -1 : v1 > v2 ? 1 : 0;
+}
+
+/*
+  get a percentile from the sorted latencies
+ */
+static uint32_t percentile(double pct)
+{
+    if (num_received == 0) {
+        return 0;
+    }
+    uint32_t i = (uint32_t)(pct * 0.01 * (num_received - 1) + 0.5);
+    return latency_us[i];
+}
+
+/*
+  start the server, with its fc link pointing at us
+ */
+static bool start_server(const char *fc_path, uint16_t out_port)
+{
+    char *argv[64];
+    char fc_arg[16], out_arg[32];
+    int argc = 0;
+    char *extra = opts.extra_args ? strdup(opts.extra_args) : NULL;
+
+    argv[argc++] = (char *)opts.server;
+    if (opts.use_udp) {
+        snprintf(fc_arg, sizeof(fc_arg), "%u", opts.udp_in_port);
+        argv[argc++] = "-f";
+        argv[argc++] = fc_arg;
+    } else {
+        argv[argc++] = "-s";
+        argv[argc++] = (char *)fc_path;
+    }
+    snprintf(out_arg, sizeof(out_arg), "127.0.0.1:%u", out_port);
+    argv[argc++] = "-O";
+    argv[argc++] = out_arg;
+    if (extra != NULL) {
+        char *saveptr = NULL;
+        char *tok;
+        for (tok = strtok_r(extra, " ", &saveptr); tok && argc < 62; tok = strtok_r(NULL, " ", &saveptr)) {
+            argv[argc++] = tok;
+        }
+    }
+    argv[argc] = NULL;
+
+    server_pid = fork();
+    if (server_pid == -1) {
+        perror("fork");
+        return false;
+    }
+    if (server_pid == 0) {
+        if (!opts.verbose) {
+            int fd = open("/dev/null", O_WRONLY);
+            dup2(fd, 1);
+        }
+        execv(opts.server, argv);
+        perror(opts.server);
+        _exit(1);
+    }
+    return true;
+}
+
+/*
+  open the pty that stands in for the fc serial port
+ */
+static bool open_pty(char *path, size_t path_len)
+{
+    struct termios t;
+    fc_fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fc_fd == -1 || grantpt(fc_fd) != 0 || unlockpt(fc_fd) != 0) {
+        perror("pty");
+        return false;
+    }
+    tcgetattr(fc_fd, &t);
+    cfmakeraw(&t);
+    tcsetattr(fc_fd, TCSANOW, &t);
+    if (ptsname_r(fc_fd, path, path_len) != 0) {
+        perror("ptsname");
+        return false;
+    }
+    return true;
+}
+
+/*
+  open the socket used to send to the server's udp-in port
+ */
+static bool open_udp_in(void)
+{
+    fc_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fc_fd == -1) {
+        perror("socket");
+        return false;
+    }
+    memset(&fc_addr, 0, sizeof(fc_addr));
+    fc_addr.sin_family = AF_INET;
+    fc_addr.sin_port = htons(opts.udp_in_port);
+    fc_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return true;
+}
+
+/*
+  open the socket the server forwards to, returning its port
+ */
+static uint16_t open_udp_out(void)
+{
+    struct sockaddr_in sock;
+    socklen_t len = sizeof(sock);
+    int bufsize = 8*1024*1024;
+
+    out_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (out_fd == -1) {
+        perror("socket");
+        return 0;
+    }
+    setsockopt(out_fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    memset(&sock, 0, sizeof(sock));
+    sock.sin_family = AF_INET;
+    sock.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(out_fd, (struct sockaddr *)&sock, sizeof(sock)) != 0 ||
+        getsockname(out_fd, (struct sockaddr *)&sock, &len) != 0) {
+        perror("bind");
+        return 0;
+    }
+    return ntohs(sock.sin_port);
+}
+
+/*
+  send frames until the server starts forwarding them
+ */
+static bool wait_for_server(void)
+{
+    uint8_t buf[MAVLINK_MAX_PACKET_LEN];
+    uint64_t start = time_us();
+    while (!warm && time_us() - start < 10*1000000ULL) {
+        uint16_t len = build_frame(FLOOD_ATTITUDE, FLOOD_WARMUP_ID, buf);
+        send_frame(buf, len);
+        drain_fc();
+        receive_frames(100, got_warmup);
+    }
+    // let the tail of the warmup go through
+    uint64_t end = time_us() + 200000;
+    while (time_us() < end) {
+        drain_fc();
+        receive_frames(50, got_warmup);
+    }
+    return warm;
+}
+
+static void usage(void)
+{
+    printf("Usage: mavflood [options]\n");
+    printf("  -S PATH   web_server binary (default ./web_server)\n");
+    printf("  -u        send over udp-in instead of a pty\n");
+    printf("  -P PORT   udp-in port for -u (default 14651)\n");
+    printf("  -r RATE   frames per second, 0 for as fast as possible (default 1000)\n");
+    printf("  -d SECS   duration (default 10)\n");
+    printf("  -m MIX    message mix, e.g. attitude:4,raw_imu:1\n");
+    printf("  -A ARGS   extra web_server arguments\n");
+    printf("  -v        show web_server output\n");
+    printf("Types:");
+    enum flood_type t;
+    for (t=0; t<FLOOD_NUM_TYPES; t++) {
+        printf(" %s", type_names[t]);
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    char fc_path[64] = "";
+    pthread_t thread_id;
+
+    parse_mix("attitude:4,global_position_int:2,raw_imu:2,scaled_pressure:1,servo_output_raw:1,rc_channels:1");
+
+    while ((opt=getopt(argc, argv, "S:uP:r:d:m:A:vh")) != -1) {
+        switch (opt) {
+        case 'S':
+            opts.server = optarg;
+            break;
+        case 'u':
+            opts.use_udp = true;
+            break;
+        case 'P':
+            opts.udp_in_port = atoi(optarg);
+            break;
+        case 'r':
+            opts.rate = atof(optarg);
+            break;
+        case 'd':
+            opts.duration = atof(optarg);
+            break;
+        case 'm':
+            if (!parse_mix(optarg)) {
+                exit(1);
+            }
+            break;
+        case 'A':
+            opts.extra_args = optarg;
+            break;
+        case 'v':
+            opts.verbose = true;
+            break;
+        case 'h':
+        default:
+            usage();
+            exit(1);
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (opts.rate > 0) {
+        max_frames = (uint32_t)(opts.rate * opts.duration);
+    } else {
+        max_frames = FLOOD_MAX_FRAMES;
+    }
+    sent_us = calloc(max_frames, sizeof(uint32_t));
+    latency_us = calloc(max_frames, sizeof(uint32_t));
+    if (max_frames == 0 || sent_us == NULL || latency_us == NULL) {
+        printf("Bad rate or duration\n");
+        exit(1);
+    }
+
+    uint16_t out_port = open_udp_out();
+    if (out_port == 0) {
+        exit(1);
+    }
+    if (opts.use_udp ? !open_udp_in() : !open_pty(fc_path, sizeof(fc_path))) {
+        exit(1);
+    }
+    if (!start_server(fc_path, out_port)) {
+        exit(1);
+    }
+    if (!wait_for_server()) {
+        printf("web_server is not forwarding frames\n");
+        kill(server_pid, SIGTERM);
+        exit(1);
+    }
+
+    start_us = time_us();
+    if (pthread_create(&thread_id, NULL, sender_thread, NULL) != 0) {
+        perror("pthread_create");
+        kill(server_pid, SIGTERM);
+        exit(1);
+    }
+
+    // receive until a second after the last frame was sent
+    while (!__atomic_load_n(&sender_done, __ATOMIC_ACQUIRE) ||
+           time_us() - send_end_us < 1000000) {
+        receive_frames(100, got_frame);
+    }
+    pthread_join(thread_id, NULL);
+
+    kill(server_pid, SIGTERM);
+    waitpid(server_pid, NULL, 0);
+
+    double send_secs = (send_end_us - start_us) * 1.0e-6;
+    uint32_t lost = num_sent > num_received ? num_sent - num_received : 0;
+    qsort(latency_us, num_received, sizeof(uint32_t), compare_u32);
+
+    printf("link        %s\n", opts.use_udp ? "udp" : "pty");
+    printf("rate        %s\n", opts.rate > 0 ? "fixed" : "max");
+    printf("sent        %u frames %.0f/s\n", num_sent, num_sent / send_secs);
+    printf("blocked     %u frames\n", num_blocked);
+    printf("forwarded   %u frames %.0f/s\n", num_received, num_received / send_secs);
+    printf("lost        %u frames %.3f%%\n", lost, num_sent ? lost * 100.0 / num_sent : 0);
+    printf("unexpected  %u frames\n", num_unexpected);
+    printf("latency us  p50 %u p90 %u p99 %u p99.9 %u max %u\n",
+           percentile(50), percentile(90), percentile(99), percentile(99.9),
+           num_received ? latency_us[num_received-1] : 0);
+
+    return lost > 0 ? 2 : 0;
+}
@@ -0,0 +1,415 @@
+/*
+  microbenchmarks for the template, CGI and JSON hot paths
+
+  Links against the server objects, with web_server.c built with its
+  main() renamed. Output goes to an in-memory sock_buf
+  (add_content_length set, so nothing is written to a fd), and CGI
+  input is read from a memfd holding a canned request body.
+
+  malloc, calloc, realloc and free are interposed so allocations made
+  inside libtalloc are counted as well.
+
+  Results are printed one line per benchmark in the Go benchmark
+  format, so two runs can be compared with benchstat:
+
+    BenchmarkJsonAttitude  2000000  512 ns/op  96 B/op  3 allocs/op  210 out-B/op
+
+  Example:
+    bench/microbench -t 2 -o before.txt
+ */
+
+#define _GNU_SOURCE
+#include "../includes.h"
+#include "../mavlink_json.h"
+#include <sys/mman.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static uint64_t alloc_count;
+static uint64_t alloc_bytes;
+
+void *malloc(size_t size)
+{
+    alloc_count++;
+    alloc_bytes += size;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    alloc_count++;
+    alloc_bytes += nmemb * size;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    alloc_count++;
+    alloc_bytes += size;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+struct bench {
+    const char *name;
+    bool (*setup)(struct bench *b);
+    void (*run)(struct bench *b);
+    const char *input;
+    size_t input_len;
+    const char *content_type;
+    mavlink_message_t msg;
+};
+
+static void *bench_ctx;
+static struct sock_buf *sink;
+static struct template_state *tmpl;
+static struct cgi_state *cgi_base;
+static int input_fd = -1;
+static uint64_t out_bytes;
+
+/*
+  throw away what has been written to the sink
+ */
+static void sink_reset(void)
+{
+    out_bytes += talloc_get_size(sink->buf);
+    talloc_free(sink->buf);
+    sink->buf = NULL;
+    sink->header_length = 0;
+}
+
+/*
+  template benchmarks
+ */
+static bool setup_template(struct bench *b)
+{
+    b->input_len = strlen(b->input);
+    return true;
+}
+
+static void run_template(struct bench *b)
+{
+    tmpl->process_content(tmpl, b->input, b->input_len);
+    sink_reset();
+}
+
+/*
+  CGI benchmarks. The body is put in a memfd which stands in for the
+  connection
+ */
+static bool setup_cgi(struct bench *b)
+{
+    b->input_len = strlen(b->input);
+    if (ftruncate(input_fd, 0) != 0 ||
+        pwrite(input_fd, b->input, b->input_len, 0) != (ssize_t)b->input_len) {
+        return false;
+    }
+    return true;
+}
+
+static void run_cgi(struct bench *b)
+{
+    struct cgi_state *cgi = talloc_memdup(bench_ctx, cgi_base, sizeof(*cgi));
+    cgi->content_type = talloc_strdup(cgi, b->content_type);
+    cgi->content_length = b->input_len;
+    cgi->request_post = 1;
+    lseek(input_fd, 0, SEEK_SET);
+    cgi->load_variables(cgi);
+    talloc_free(cgi);
+}
+
+/*
+  JSON benchmarks
+ */
+static bool setup_json(struct bench *b)
+{
+    return mavlink_message_info(&b->msg) != NULL;
+}
+
+static void run_json(struct bench *b)
+{
+    mavlink_json_message(sink, &b->msg, 0);
+    sink_reset();
+}
+
+static const char page_template[] =
+    "<html><head><title>{{$CGI_title}}</title></head>\n"
+    "<body>\n"
+    "<h1>{{$CGI_title}}</h1>\n"
+    "<p>Welcome to {{$CGI_title}}, running for {{ @uptime() }} seconds.</p>\n"
+    "<table>\n"
+    "<tr><td>name</td><td>{{$CGI_name}}</td></tr>\n"
+    "<tr><td>escaped</td><td>{{%CGI_name}}</td></tr>\n"
+    "<tr><td>count</td><td>{{ @fc_mavlink_count() }}</td></tr>\n"
+    "<tr><td>baudrate</td><td>{{ @fc_mavlink_baudrate() }}</td></tr>\n"
+    "</table>\n"
+    "<p>Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor\n"
+    "incididunt ut labore et dolore magna aliqua. Ut enim ad minim veniam, quis\n"
+    "nostrud exercitation ullamco laboris nisi ut aliquip ex ea commodo consequat.</p>\n"
+    "</body></html>\n";
+
+static const char sysinfo_template[] =
+    "{\n"
+    "    \"uptime\":          {{ @uptime() }},\n"
+    "    \"free_mem_dma\":    {{ @mem_free(1) }},\n"
+    "    \"free_mem_kernel\": {{ @mem_free(2) }},\n"
+    "    \"fc_mavlink_count\": {{ @fc_mavlink_count() }},\n"
+    "    \"fc_mavlink_baudrate\": {{ @fc_mavlink_baudrate() }}\n"
+    "}\n";
+
+static const char urlencoded_body[] =
+    "command1=mavlink_message(ATTITUDE,VFR_HUD,GPS_RAW_INT,SYS_STATUS,HEARTBEAT)"
+    "&command2=get_param_list(INS_%2CCOMPASS_)"
+    "&command3=set_param(ARMING_CHECK,1)";
+
+#define BOUNDARY "----WebKitFormBoundaryu7oxE5lS2fDJNmH3"
+
+// what FormData sends for a command_send() from the UI
+static const char multipart_body[] =
+    "--" BOUNDARY "\r\n"
+    "Content-Disposition: form-data; name=\"command1\"\r\n"
+    "\r\n"
+    "mavlink_message(ATTITUDE,VFR_HUD,GPS_RAW_INT,SYS_STATUS,HEARTBEAT)\r\n"
+    "--" BOUNDARY "\r\n"
+    "Content-Disposition: form-data; name=\"command2\"\r\n"
+    "\r\n"
+    "get_param_list(INS_,COMPASS_)\r\n"
+    "--" BOUNDARY "--\r\n";
+
+static char *upload_body;
+
+static struct bench benches[] = {
+    { "TemplateSysinfo", setup_template, run_template, sysinfo_template },
+    { "TemplatePage", setup_template, run_template, page_template },
+    { "CgiUrlencoded", setup_cgi, run_cgi, urlencoded_body, 0, "application/x-www-form-urlencoded" },
+    { "CgiMultipart", setup_cgi, run_cgi, multipart_body, 0, "multipart/form-data; boundary=" BOUNDARY },
+    { "CgiMultipartUpload", setup_cgi, run_cgi, NULL, 0, "multipart/form-data; boundary=" BOUNDARY },
+    { "JsonHeartbeat", setup_json, run_json },
+    { "JsonAttitude", setup_json, run_json },
+    { "JsonSysStatus", setup_json, run_json },
+    { "JsonParamValue", setup_json, run_json },
+    { "JsonStatustext", setup_json, run_json },
+};
+#define NUM_BENCHES (sizeof(benches)/sizeof(benches[0]))
+
+/*
+  fill in the inputs that are built at runtime
+ */
+static void init_inputs(void)
+{
+    unsigned i;
+    // a 16k parameter file upload, as sent by the parameter page
+    char *file = talloc_strdup(bench_ctx, "");
+    for (i=0; file && strlen(file) < 16*1024; i++) {
+        file = talloc_asprintf_append(file, "PARAM_%04u,%u.%03u\n", i, i*7, i % 1000);
+    }
+    upload_body = talloc_asprintf(bench_ctx,
+                                  "--" BOUNDARY "\r\n"
+                                  "Content-Disposition: form-data; name=\"file\"; filename=\"params.parm\"\r\n"
+                                  "Content-Type: application/octet-stream\r\n"
+                                  "\r\n"
+                                  "%s\r\n"
+                                  "--" BOUNDARY "--\r\n", file);
+    talloc_free(file);
+
+    for (i=0; i<NUM_BENCHES; i++) {
+        struct bench *b = &benches[i];
+        if (strcmp(b->name, "CgiMultipartUpload") == 0) {
+            b->input = upload_body;
+        } else if (strcmp(b->name, "JsonHeartbeat") == 0) {
+            mavlink_heartbeat_t m = { .type = MAV_TYPE_QUADROTOR, .autopilot = MAV_AUTOPILOT_ARDUPILOTMEGA,
+                                      .base_mode = MAV_MODE_FLAG_CUSTOM_MODE_ENABLED, .custom_mode = 5,
+                                      .system_status = MAV_STATE_ACTIVE, .mavlink_version = 3 };
+            mavlink_msg_heartbeat_encode(1, 1, &b->msg, &m);
+        } else if (strcmp(b->name, "JsonAttitude") == 0) {
+            mavlink_attitude_t m = { .time_boot_ms = 123456, .roll = 0.01, .pitch = -0.02, .yaw = 1.57,
+                                     .rollspeed = 0.001, .pitchspeed = 0.002, .yawspeed = -0.003 };
+            mavlink_msg_attitude_encode(1, 1, &b->msg, &m);
+        } else if (strcmp(b->name, "JsonSysStatus") == 0) {
+            mavlink_sys_status_t m = { .onboard_control_sensors_present = 0x2fffff,
+                                       .onboard_control_sensors_enabled = 0x2fffff,
+                                       .onboard_control_sensors_health = 0x2fffff,
+                                       .load = 250, .voltage_battery = 12600, .current_battery = 1500,
+                                       .battery_remaining = 87 };
+            mavlink_msg_sys_status_encode(1, 1, &b->msg, &m);
+        } else if (strcmp(b->name, "JsonParamValue") == 0) {
+            mavlink_param_value_t m = { .param_value = -34.5, .param_type = MAV_PARAM_TYPE_REAL32,
+                                        .param_count = 900, .param_index = 42 };
+            strncpy(m.param_id, "COMPASS_OFS_X", sizeof(m.param_id));
+            mavlink_msg_param_value_encode(1, 1, &b->msg, &m);
+        } else if (strcmp(b->name, "JsonStatustext") == 0) {
+            mavlink_statustext_t m = { .severity = MAV_SEVERITY_INFO };
+            strncpy(m.text, "EKF2 IMU0 is using GPS", sizeof(m.text));
+            mavlink_msg_statustext_encode(1, 1, &b->msg, &m);
+        }
+    }
+}
+
+/*
+  get the current time in nanoseconds
+ */
+static uint64_t time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+  run a benchmark for at least the given time, growing the iteration
+  count the way "go test -bench" does
+ */
+static bool run_bench(struct bench *b, double min_secs, char *line, size_t line_len)
+{
+    uint64_t n = 1;
+    uint64_t elapsed = 0;
+    uint64_t count = 0, bytes = 0;
+
+    if (!b->setup(b)) {
+        printf("%s: setup failed\n", b->name);
+        return false;
+    }
+    // warm up caches and the template variable list
+    b->run(b);
+
+    while (true) {
+        uint64_t i;
+        out_bytes = 0;
+        count = alloc_count;
+        bytes = alloc_bytes;
+        uint64_t start = time_ns();
+        for (i=0; i<n; i++) {
+            b->run(b);
+        }
+        elapsed = time_ns() - start;
+        count = alloc_count - count;
+        bytes = alloc_bytes - bytes;
+        if (elapsed >= min_secs * 1.0e9 || n >= 1000000000ULL) {
+            break;
+        }
+        // aim for the target time, growing by at most 100x at a time
+        uint64_t next = elapsed ? (uint64_t)(n * 1.2 * min_secs * 1.0e9 / elapsed) : n * 100;
+        if (next > n * 100) {
+            next = n * 100;
+        }
+        n = next > n ? next : n + 1;
+    }
+    snprintf(line, line_len,
+             "Benchmark%-22s %10llu %12.1f ns/op %10llu B/op %8llu allocs/op %10llu out-B/op\n",
+             b->name, (unsigned long long)n, elapsed / (double)n,
+             (unsigned long long)(bytes / n), (unsigned long long)(count / n),
+             (unsigned long long)(out_bytes / n));
+    return true;
+}
+
+static void usage(void)
+{
+    printf("Usage: microbench [options]\n");
+    printf("  -t SECS   minimum time per benchmark (default 1)\n");
+    printf("  -b NAME   only run benchmarks whose name contains NAME\n");
+    printf("  -c COUNT  run each benchmark COUNT times (default 1)\n");
+    printf("  -o FILE   append results to FILE as well as stdout\n");
+    printf("  -l LABEL  label recorded with the results, e.g. a git commit\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    double min_secs = 1;
+    const char *filter = NULL;
+    const char *output = NULL;
+    const char *label = NULL;
+    unsigned repeat = 1;
+    unsigned i, r;
+
+    while ((opt=getopt(argc, argv, "t:b:c:o:l:h")) != -1) {
+        switch (opt) {
+        case 't':
+            min_secs = atof(optarg);
+            break;
+        case 'b':
+            filter = optarg;
+            break;
+        case 'c':
+            repeat = atoi(optarg);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        case 'h':
+        default:
+            usage();
+            exit(1);
+        }
+    }
+
+    FILE *f = NULL;
+    if (output != NULL) {
+        f = fopen(output, "a");
+        if (f == NULL) {
+            perror(output);
+            exit(1);
+        }
+    }
+
+    bench_ctx = talloc_new(NULL);
+    sink = talloc_zero(bench_ctx, struct sock_buf);
+    sink->add_content_length = true;
+    input_fd = memfd_create("microbench", 0);
+    if (input_fd == -1) {
+        perror("memfd_create");
+        exit(1);
+    }
+    sink->fd = input_fd;
+
+    mavlink_message_info_init();
+    struct connection_state *c = talloc_zero(bench_ctx, struct connection_state);
+    cgi_base = cgi_init(c, sink);
+    tmpl = cgi_base->tmpl;
+    tmpl->put(tmpl, "CGI_title", "APWeb", NULL);
+    tmpl->put(tmpl, "CGI_name", "<b>ArduPilot</b> & friends", NULL);
+    init_inputs();
+
+    // header lines in the format benchstat expects
+    FILE *outs[2] = { stdout, f };
+    for (r=0; r<2; r++) {
+        if (outs[r] == NULL) {
+            continue;
+        }
+        fprintf(outs[r], "goos: linux\npkg: apweb\n");
+        if (label != NULL) {
+            fprintf(outs[r], "label: %s\n", label);
+        }
+    }
+    for (r=0; r<repeat; r++) {
+        for (i=0; i<NUM_BENCHES; i++) {
+            if (filter != NULL && strstr(benches[i].name, filter) == NULL) {
+                continue;
+            }
+            char line[200];
+            if (!run_bench(&benches[i], min_secs, line, sizeof(line))) {
+                continue;
+            }
+            fputs(line, stdout);
+            fflush(stdout);
+            if (f != NULL) {
+                fputs(line, f);
+                fflush(f);
+            }
+        }
+    }
+    if (f != NULL) {
+        fclose(f);
+    }
+    return 0;
+}
@@ -23,6 +23,7 @@
 
 #ifdef _POSIX_VERSION
 #include "posix/functions.h"
+#include "posix/coalesce.h"
 #endif
 
 #define CONTENT_DISPOSITION "Content-Disposition:"
@@ -479,7 +480,9 @@ static void http_header(struct cgi_state *cgi, const char *filename)
     if (mtype->type != MIME_TYPE_TEXT_HTML &&
         mtype->type != MIME_TYPE_JSON &&
         strncmp(filename, "ajax/", 5) != 0 &&
-        strncmp(filename, "fs/", 3) != 0) {
+        strncmp(filename, "fs/", 3) != 0 &&
+        strncmp(filename, "mavftp/", 7) != 0 &&
+        strncmp(filename, "mavlog/", 7) != 0) {
         //console_printf("serving %s\n", filename);
         sock_printf(cgi->sock, "Cache-Control: public, max-age=3600\r\n");
     }
@@ -598,6 +601,17 @@ static void download(struct cgi_state *cgi, const char *path)
         return;
     }
 
+#ifdef _POSIX_VERSION
+    if (strncmp(path, "mavftp/", 7) == 0) {
+        download_mavftp(cgi, path);
+        return;
+    }
+    if (strncmp(path, "mavlog/", 7) == 0) {
+        download_mavlog(cgi, path);
+        return;
+    }
+#endif
+
     size_t size = 0;
     const char *contents = get_embedded_file(path, &size);
     if (!contents) {
@@ -615,6 +629,11 @@ static void download(struct cgi_state *cgi, const char *path)
         }
         cgi->http_header(cgi, path);
         web_debug(2, "process: %s\n", path);
+#ifdef _POSIX_VERSION
+        if (coalesce_process(cgi, path)) {
+            return;
+        }
+#endif
         cgi->tmpl->process(cgi->tmpl, path, 1);
         return;
     }
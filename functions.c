@@ -93,8 +93,15 @@ static void toggle_video(struct template_state *tmpl, const char *name, const ch
 static void mavlink_message(struct template_state *tmpl, const char *name, const char *value, int argc, char **argv)
 {
     uint16_t i;
-    bool need_comma = false;
     sock_printf(tmpl->sock, "{\n");
+#ifdef _POSIX_VERSION
+    // use the cached JSON for each message
+    bool first = true;
+    for (i=0; i<argc; i++) {
+        mavlink_message_json(tmpl->sock, argv[i], 0, 0, &first);
+    }
+#else
+    bool need_comma = false;
     for (i=0; i<argc; i++) {
         const char *name = argv[i];
         const mavlink_message_t *msg;
@@ -112,6 +119,7 @@ static void mavlink_message(struct template_state *tmpl, const char *name, const
             need_comma = true;
         }
     }
+#endif
     sock_printf(tmpl->sock, "}");
 }
 
@@ -293,6 +301,27 @@ static void process_content(struct template_state *tmpl, const char *name, const
 }
 
 
+#ifdef _POSIX_VERSION
+/*
+  find the target_system argument of a message to send, or 0 if it
+  has none
+ */
+static uint8_t message_target_system(int argc, char **argv)
+{
+    const mavlink_message_info_t *m = mavlink_message_info_by_name(argv[0], NULL);
+    uint8_t i;
+    if (m == NULL) {
+        return 0;
+    }
+    for (i=0; i<m->num_fields && i+1<argc; i++) {
+        if (strcmp(m->fields[i].name, "target_system") == 0) {
+            return atoi(argv[i+1]);
+        }
+    }
+    return 0;
+}
+#endif
+
 /*
   send a mavlink message
  */
@@ -307,6 +336,10 @@ static void mavlink_message_send(struct template_state *tmpl, const char *name,
         command = atoi(command_ack);
         command_ack_get(command, &result, &ack_timestamp);
     }
+#ifdef _POSIX_VERSION
+    // acks counted after this can be replies to this message
+    uint32_t ack_seq = command_ack_seq();
+#endif
     // send the message
     mavlink_message_send_args(argc, argv);
     if (!command_ack) {
@@ -320,6 +353,13 @@ static void mavlink_message_send(struct template_state *tmpl, const char *name,
     if (command_timeout) {
         timeout = atoi(command_timeout);
     }
+#ifdef _POSIX_VERSION
+    // woken as soon as the ack arrives
+    if (command_ack_wait(command, message_target_system(argc, argv), ack_seq, timeout, &result)) {
+        sock_printf(tmpl->sock, "%u", result);
+        return;
+    }
+#else
     uint32_t start = get_time_boot_ms();
     while (get_time_boot_ms() - start < timeout) {
         uint32_t timestamp = 0;
@@ -329,6 +369,7 @@ static void mavlink_message_send(struct template_state *tmpl, const char *name,
         }
         mdelay(100);
     }
+#endif
     sock_printf(tmpl->sock, "-1");
 }
 
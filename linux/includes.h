@@ -31,3 +31,4 @@
 
 #include "util_linux.h"
 #include "mavlink_linux.h"
+#include "mavlink_params.h"
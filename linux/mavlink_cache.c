@@ -0,0 +1,195 @@
+/*
+  warm start cache of parameters and messages
+
+  The parameter set and the last instance of each message are saved
+  regularly to a file per flight controller, named from its sysid,
+  autopilot and vehicle type. When we next see that flight controller
+  the file is loaded, so pages have data straight away. The parameters
+  are checked against the fc with a single _HASH_CHECK request, and are
+  downloaded again if they have changed.
+ */
+
+#include "../includes.h"
+#include "mavlink_cache.h"
+
+#define CACHE_MAGIC 0x43575041
+#define CACHE_VERSION 1
+#define CACHE_SAVE_INTERVAL_MS 30000
+
+struct cache_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t param_total;
+    uint32_t param_hash;
+    uint32_t num_params;
+    uint32_t num_messages;
+    // unix time of the save, for the age of restored messages
+    int64_t save_time;
+};
+
+struct cache_message {
+    uint32_t age_ms;
+    mavlink_message_t msg;
+};
+
+static char *cache_dir;
+static char *cache_path;
+static uint32_t cache_save_ms;
+
+/*
+  set the directory for cache files
+ */
+void mavlink_cache_set_dir(const char *dir)
+{
+    talloc_free(cache_dir);
+    cache_dir = talloc_strdup(NULL, dir);
+}
+
+/*
+  load a whole file into memory
+ */
+static uint8_t *cache_load(const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    uint8_t *buf = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size >= sizeof(struct cache_header)) {
+        buf = talloc_size(NULL, st.st_size);
+        if (buf && read(fd, buf, st.st_size) != st.st_size) {
+            talloc_free(buf);
+            buf = NULL;
+        }
+    }
+    close(fd);
+    return buf;
+}
+
+/*
+  restore the cache for a flight controller. Called when we first see
+  a heartbeat from the target system
+ */
+void mavlink_cache_restore(uint8_t sysid, uint8_t autopilot, uint8_t type)
+{
+    uint32_t i;
+    if (cache_dir == NULL) {
+        return;
+    }
+    talloc_free(cache_path);
+    cache_path = talloc_asprintf(NULL, "%s/fc-%u-%u-%u.cache", cache_dir, sysid, autopilot, type);
+    if (cache_path == NULL) {
+        return;
+    }
+    cache_save_ms = get_time_boot_ms();
+
+    uint8_t *buf = cache_load(cache_path);
+    if (buf == NULL) {
+        return;
+    }
+    const struct cache_header *h = (const struct cache_header *)buf;
+    size_t size = sizeof(*h) +
+        h->num_params * sizeof(struct mavlink_param_snapshot) +
+        h->num_messages * sizeof(struct cache_message);
+    if (h->magic != CACHE_MAGIC || h->version != CACHE_VERSION ||
+        talloc_get_size(buf) != size) {
+        console_printf("ignoring bad cache %s\n", cache_path);
+        talloc_free(buf);
+        return;
+    }
+
+    const struct mavlink_param_snapshot *snap = (const struct mavlink_param_snapshot *)(h+1);
+    mavlink_params_restore(snap, h->num_params, h->param_total, h->param_hash);
+
+    const struct cache_message *m = (const struct cache_message *)(snap + h->num_params);
+    int64_t downtime_ms = (time(NULL) - h->save_time) * 1000LL;
+    if (downtime_ms < 0) {
+        downtime_ms = 0;
+    }
+    uint32_t now = get_time_boot_ms();
+    for (i=0; i<h->num_messages; i++) {
+        int64_t age = m[i].age_ms + downtime_ms;
+        if (age > now) {
+            // make it look as old as we can
+            age = now;
+        }
+        mavlink_restore_packet(&m[i].msg, now - age);
+    }
+    console_printf("restored %u messages from cache\n", h->num_messages);
+    talloc_free(buf);
+}
+
+struct cache_save_state {
+    struct cache_message *messages;
+    uint32_t count;
+    uint32_t now;
+};
+
+static void cache_add_message(const mavlink_message_t *msg, uint32_t receive_ms, void *ptr)
+{
+    struct cache_save_state *state = ptr;
+    struct cache_message *m = talloc_realloc(NULL, state->messages, struct cache_message, state->count+1);
+    if (m == NULL) {
+        return;
+    }
+    state->messages = m;
+    m[state->count].age_ms = state->now - receive_ms;
+    memcpy(&m[state->count].msg, msg, sizeof(*msg));
+    state->count++;
+}
+
+/*
+  write the cache file. Nothing is written until we have a complete
+  parameter set, so an old cache is not replaced by a partial one
+ */
+static void cache_save(void)
+{
+    struct cache_header h;
+    struct mavlink_param_snapshot *snap = NULL;
+    struct cache_save_state state;
+
+    memset(&h, 0, sizeof(h));
+    h.num_params = mavlink_params_snapshot(NULL, &snap, &h.param_total, &h.param_hash);
+    if (h.num_params == 0) {
+        return;
+    }
+    memset(&state, 0, sizeof(state));
+    state.now = get_time_boot_ms();
+    mavlink_foreach_packet(cache_add_message, &state);
+
+    h.magic = CACHE_MAGIC;
+    h.version = CACHE_VERSION;
+    h.num_messages = state.count;
+    h.save_time = time(NULL);
+
+    char *tmp = talloc_asprintf(NULL, "%s.tmp", cache_path);
+    int fd = tmp?open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644):-1;
+    if (fd != -1) {
+        size_t msize = state.count * sizeof(struct cache_message);
+        size_t psize = h.num_params * sizeof(struct mavlink_param_snapshot);
+        bool ok = (write(fd, &h, sizeof(h)) == sizeof(h) &&
+                   write(fd, snap, psize) == psize &&
+                   (msize == 0 || write(fd, state.messages, msize) == msize));
+        close(fd);
+        if (!ok || rename(tmp, cache_path) != 0) {
+            console_printf("failed to save cache %s\n", cache_path);
+            unlink(tmp);
+        }
+    }
+    talloc_free(tmp);
+    talloc_free(snap);
+    talloc_free(state.messages);
+}
+
+/*
+  save the cache regularly. Called from the select loop
+ */
+void mavlink_cache_update(void)
+{
+    if (cache_path == NULL || get_time_boot_ms() - cache_save_ms < CACHE_SAVE_INTERVAL_MS) {
+        return;
+    }
+    cache_save_ms = get_time_boot_ms();
+    cache_save();
+}
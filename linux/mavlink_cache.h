@@ -0,0 +1,7 @@
+#pragma once
+
+#include "../mavlink_core.h"
+
+void mavlink_cache_set_dir(const char *dir);
+void mavlink_cache_restore(uint8_t sysid, uint8_t autopilot, uint8_t type);
+void mavlink_cache_update(void);
@@ -0,0 +1,615 @@
+/*
+  MAVLink FTP client for the target system
+
+  Files are read with burst reads: one BurstReadFile request makes the
+  fc stream the file back as fast as the link allows. Packets lost from
+  the middle of a burst leave gaps, which are tracked as a list of
+  missing ranges and filled with ReadFile requests once the burst is
+  over, with a window of requests in flight. If the burst stops short
+  of the end of the file another is started from the highest offset
+  received.
+
+  One session runs at a time. It is started either by the select loop,
+  for a file wanted whole in memory such as @PARAM/param.pck, or by a
+  http thread that streams the file out as it arrives. A streamed file
+  only keeps a window of data ahead of the reader. Packets past that
+  window are dropped, and fetched with a new burst once the reader
+  catches up.
+
+  Requests are only sent from the select loop, as frames to the fc are
+  written without a lock. A http thread only changes the job, and the
+  next mavlink_ftp_update() sends whatever that calls for.
+ */
+
+#include "../includes.h"
+#include "mavlink_ftp.h"
+
+enum ftp_opcode {
+    FTP_TERMINATE_SESSION = 1,
+    FTP_RESET_SESSIONS = 2,
+    FTP_OPEN_FILE_RO = 4,
+    FTP_READ_FILE = 5,
+    FTP_BURST_READ_FILE = 15,
+    FTP_ACK = 128,
+    FTP_NAK = 129,
+};
+
+#define FTP_ERR_FAIL_ERRNO 2
+#define FTP_ERR_EOF 6
+#define FTP_ERR_NO_SESSIONS 5
+
+#define FTP_DATA_MAX 239
+#define FTP_TIMEOUT_MS 1000
+#define FTP_MAX_TRIES 5
+// ReadFile requests in flight while filling gaps
+#define FTP_GAP_WINDOW 8
+// data kept ahead of a http reader
+#define FTP_STREAM_WINDOW (256*1024)
+// time a http reader waits for another session to finish
+#define FTP_BUSY_WAIT_MS 5000
+
+/*
+  FILE_TRANSFER_PROTOCOL payload
+ */
+struct ftp_op {
+    uint16_t seq;
+    uint8_t session;
+    uint8_t opcode;
+    uint8_t size;
+    uint8_t req_opcode;
+    uint8_t burst_complete;
+    uint8_t pad;
+    uint32_t offset;
+    uint8_t data[FTP_DATA_MAX];
+} __attribute__((packed));
+
+struct ftp_gap {
+    struct ftp_gap *next;
+    uint32_t ofs;
+    uint32_t len;
+    uint32_t sent_ms;
+    uint8_t tries;
+};
+
+enum ftp_state {
+    FTP_OPENING,
+    FTP_READING,
+    FTP_FINISHED,
+};
+
+struct mavlink_ftp_job {
+    char *path;
+    uint8_t sysid;
+    enum ftp_state state;
+    uint8_t session;
+    int error;
+    uint32_t size;
+    // file data from buf_ofs up to highest, less any gaps
+    uint8_t *buf;
+    uint32_t buf_ofs;
+    uint32_t buf_space;
+    uint32_t highest;
+    // missing ranges below highest, in offset order
+    struct ftp_gap *gaps;
+    // bytes kept past buf_ofs, 0 for the whole file
+    uint32_t limit;
+    bool bursting;
+    // time of the last open or burst request, or the last burst data
+    uint32_t request_ms;
+    uint8_t tries;
+    // a http thread is reading the job
+    bool reader;
+    // the reader has gone, end the session from the select loop
+    bool cancel;
+    mavlink_ftp_done_fn done_fn;
+    void *done_ptr;
+};
+
+static pthread_mutex_t ftp_lock = PTHREAD_MUTEX_INITIALIZER;
+// wakes readers on new data and on the end of a session
+static pthread_cond_t ftp_cond = PTHREAD_COND_INITIALIZER;
+// the job with the session on the fc, NULL if none
+static struct mavlink_ftp_job *ftp_job;
+static uint16_t ftp_seq;
+
+/*
+  send a FTP request for a job
+ */
+static void ftp_send(struct mavlink_ftp_job *job, uint8_t opcode, uint32_t offset, uint8_t size, const void *data)
+{
+    struct ftp_op op;
+    memset(&op, 0, sizeof(op));
+    op.seq = ftp_seq++;
+    op.session = job->session;
+    op.opcode = opcode;
+    op.size = size;
+    op.offset = offset;
+    if (data) {
+        memcpy(op.data, data, size);
+    }
+    mavlink_msg_file_transfer_protocol_send(MAVLINK_COMM_FC, 0, job->sysid, MAV_COMP_ID_AUTOPILOT1,
+                                            (const uint8_t *)&op);
+}
+
+static void ftp_send_open(struct mavlink_ftp_job *job)
+{
+    job->tries++;
+    job->request_ms = get_time_boot_ms();
+    ftp_send(job, FTP_OPEN_FILE_RO, 0, strlen(job->path), job->path);
+}
+
+/*
+  create a job. The open is sent by the next mavlink_ftp_update().
+  Caller must hold ftp_lock
+ */
+static struct mavlink_ftp_job *ftp_start(const char *path, uint32_t limit)
+{
+    struct mavlink_ftp_job *job = talloc_zero(NULL, struct mavlink_ftp_job);
+    if (job == NULL) {
+        return NULL;
+    }
+    job->path = talloc_strndup(job, path, FTP_DATA_MAX);
+    if (job->path == NULL) {
+        talloc_free(job);
+        return NULL;
+    }
+    job->sysid = mavlink_target_system();
+    job->limit = limit;
+    ftp_job = job;
+    return job;
+}
+
+/*
+  end of the data we can give out, the first gap or the highest
+  offset received
+ */
+static uint32_t ftp_contiguous(const struct mavlink_ftp_job *job)
+{
+    return job->gaps?job->gaps->ofs:job->highest;
+}
+
+/*
+  end a session. A job with a reader is freed when the reader closes
+  it, otherwise it is freed here. Caller must hold ftp_lock
+ */
+static void ftp_finish(struct mavlink_ftp_job *job, int error)
+{
+    if (job->state == FTP_READING) {
+        ftp_send(job, FTP_TERMINATE_SESSION, 0, 0, NULL);
+    }
+    if (error != 0) {
+        console_printf("ftp %s failed error %d\n", job->path, error);
+    }
+    job->state = FTP_FINISHED;
+    job->error = error;
+    if (ftp_job == job) {
+        ftp_job = NULL;
+    }
+    if (job->done_fn) {
+        job->done_fn(job->buf, ftp_contiguous(job) - job->buf_ofs, error == 0, job->done_ptr);
+    }
+    pthread_cond_broadcast(&ftp_cond);
+    if (!job->reader) {
+        talloc_free(job);
+    }
+}
+
+/*
+  add a gap at the end of the gap list
+ */
+static bool ftp_gap_add(struct mavlink_ftp_job *job, uint32_t ofs, uint32_t len)
+{
+    struct ftp_gap **gp;
+    struct ftp_gap *g = talloc_zero(job, struct ftp_gap);
+    if (g == NULL) {
+        return false;
+    }
+    g->ofs = ofs;
+    g->len = len;
+    for (gp=&job->gaps; *gp; gp=&(*gp)->next) ;
+    *gp = g;
+    return true;
+}
+
+/*
+  remove a received range from the gap list
+ */
+static bool ftp_gap_fill(struct mavlink_ftp_job *job, uint32_t ofs, uint32_t end)
+{
+    struct ftp_gap **gp = &job->gaps;
+    while (*gp) {
+        struct ftp_gap *g = *gp;
+        uint32_t gend = g->ofs + g->len;
+        if (gend <= ofs || g->ofs >= end) {
+            gp = &g->next;
+            continue;
+        }
+        if (ofs <= g->ofs && end >= gend) {
+            *gp = g->next;
+            talloc_free(g);
+            continue;
+        }
+        if (ofs > g->ofs && end < gend) {
+            // split in two
+            struct ftp_gap *g2 = talloc_zero(job, struct ftp_gap);
+            if (g2 == NULL) {
+                return false;
+            }
+            g2->ofs = end;
+            g2->len = gend - end;
+            g2->next = g->next;
+            g->len = ofs - g->ofs;
+            g->next = g2;
+            gp = &g2->next;
+            continue;
+        }
+        if (ofs <= g->ofs) {
+            // a short reply, ask for the rest straight away
+            g->ofs = end;
+            g->len = gend - end;
+            g->tries = 0;
+        } else {
+            g->len = ofs - g->ofs;
+        }
+        gp = &g->next;
+    }
+    return true;
+}
+
+/*
+  split a gap so it can be asked for with one ReadFile. The rest
+  becomes a new gap with its own tries
+ */
+static bool ftp_gap_split(struct mavlink_ftp_job *job, struct ftp_gap *g)
+{
+    if (g->len <= FTP_DATA_MAX) {
+        return true;
+    }
+    struct ftp_gap *g2 = talloc_zero(job, struct ftp_gap);
+    if (g2 == NULL) {
+        return false;
+    }
+    g2->ofs = g->ofs + FTP_DATA_MAX;
+    g2->len = g->len - FTP_DATA_MAX;
+    g2->next = g->next;
+    g->len = FTP_DATA_MAX;
+    g->next = g2;
+    return true;
+}
+
+/*
+  store file data from the fc. Caller must hold ftp_lock
+ */
+static void ftp_store(struct mavlink_ftp_job *job, uint32_t ofs, const uint8_t *data, uint32_t size)
+{
+    uint32_t end = ofs + size;
+    if (end > job->size) {
+        end = job->size;
+    }
+    if (end <= job->buf_ofs || end <= ofs) {
+        // already given to the reader
+        return;
+    }
+    if (job->limit != 0 && end > job->buf_ofs + job->limit) {
+        // past the reader's window, we will ask again later
+        return;
+    }
+    if (end > job->buf_ofs + job->buf_space) {
+        uint32_t space = job->buf_space?job->buf_space:4096;
+        while (space < end - job->buf_ofs) {
+            space *= 2;
+        }
+        uint8_t *buf = talloc_realloc(job, job->buf, uint8_t, space);
+        if (buf == NULL) {
+            ftp_finish(job, MAVLINK_FTP_ERR_CANCELLED);
+            return;
+        }
+        job->buf = buf;
+        job->buf_space = space;
+    }
+    if (ofs > job->highest && !ftp_gap_add(job, job->highest, ofs - job->highest)) {
+        ftp_finish(job, MAVLINK_FTP_ERR_CANCELLED);
+        return;
+    }
+    if (ofs < job->buf_ofs) {
+        data += job->buf_ofs - ofs;
+        ofs = job->buf_ofs;
+    }
+    memcpy(&job->buf[ofs - job->buf_ofs], data, end - ofs);
+    if (ofs < job->highest && !ftp_gap_fill(job, ofs, end)) {
+        ftp_finish(job, MAVLINK_FTP_ERR_CANCELLED);
+        return;
+    }
+    if (end > job->highest) {
+        job->highest = end;
+    }
+    pthread_cond_broadcast(&ftp_cond);
+    if (ftp_contiguous(job) == job->size) {
+        ftp_finish(job, 0);
+    }
+}
+
+/*
+  keep a job moving: time out a burst, keep the gap window full, and
+  start another burst once there are no gaps. Caller must hold
+  ftp_lock
+ */
+static void ftp_pump(struct mavlink_ftp_job *job)
+{
+    uint32_t now = get_time_boot_ms();
+    unsigned inflight = 0;
+    struct ftp_gap *g;
+
+    if (job->state != FTP_READING) {
+        return;
+    }
+    if (job->bursting) {
+        if (now - job->request_ms < FTP_TIMEOUT_MS) {
+            return;
+        }
+        // the rest of this burst has been lost
+        job->bursting = false;
+    }
+    for (g=job->gaps; g && inflight < FTP_GAP_WINDOW; g=g->next) {
+        inflight++;
+        if (g->tries != 0 && now - g->sent_ms < FTP_TIMEOUT_MS) {
+            continue;
+        }
+        if (g->tries >= FTP_MAX_TRIES) {
+            ftp_finish(job, MAVLINK_FTP_ERR_TIMEOUT);
+            return;
+        }
+        // one request per gap, so each request has its own tries
+        if (!ftp_gap_split(job, g)) {
+            ftp_finish(job, MAVLINK_FTP_ERR_CANCELLED);
+            return;
+        }
+        g->tries++;
+        g->sent_ms = now;
+        ftp_send(job, FTP_READ_FILE, g->ofs, g->len, NULL);
+    }
+    if (job->gaps != NULL || job->highest >= job->size ||
+        (job->limit != 0 && job->highest - job->buf_ofs >= job->limit)) {
+        return;
+    }
+    if (job->tries >= FTP_MAX_TRIES) {
+        ftp_finish(job, MAVLINK_FTP_ERR_TIMEOUT);
+        return;
+    }
+    job->tries++;
+    job->bursting = true;
+    job->request_ms = now;
+    ftp_send(job, FTP_BURST_READ_FILE, job->highest, FTP_DATA_MAX, NULL);
+}
+
+/*
+  the error to finish a job with for a NAK
+ */
+static int ftp_nak_error(const struct ftp_op *op)
+{
+    if (op->data[0] == FTP_ERR_FAIL_ERRNO && op->size >= 2) {
+        return MAVLINK_FTP_ERR_ERRNO(op->data[1]);
+    }
+    return op->data[0];
+}
+
+/*
+  handle the reply to an OpenFileRO
+ */
+static void ftp_open_reply(struct mavlink_ftp_job *job, const struct ftp_op *op)
+{
+    if (job->state != FTP_OPENING) {
+        return;
+    }
+    if (op->opcode == FTP_NAK) {
+        if (op->data[0] == FTP_ERR_NO_SESSIONS && job->tries < FTP_MAX_TRIES) {
+            // a session left open by an earlier run
+            ftp_send(job, FTP_RESET_SESSIONS, 0, 0, NULL);
+            ftp_send_open(job);
+            return;
+        }
+        ftp_finish(job, ftp_nak_error(op));
+        return;
+    }
+    if (op->size < 4) {
+        return;
+    }
+    job->session = op->session;
+    memcpy(&job->size, op->data, 4);
+    job->state = FTP_READING;
+    job->tries = 0;
+    if (job->size == 0) {
+        ftp_finish(job, 0);
+        return;
+    }
+    ftp_pump(job);
+}
+
+/*
+  handle FILE_TRANSFER_PROTOCOL from the fc. Called from the select loop
+ */
+void mavlink_ftp_handle_msg(const mavlink_message_t *msg)
+{
+    mavlink_file_transfer_protocol_t m;
+    struct ftp_op op;
+    mavlink_msg_file_transfer_protocol_decode(msg, &m);
+    if (m.target_system != mavlink_system.sysid) {
+        return;
+    }
+    memcpy(&op, m.payload, sizeof(op));
+    if ((op.opcode != FTP_ACK && op.opcode != FTP_NAK) || op.size > FTP_DATA_MAX) {
+        return;
+    }
+
+    pthread_mutex_lock(&ftp_lock);
+    struct mavlink_ftp_job *job = ftp_job;
+    if (job == NULL || msg->sysid != job->sysid) {
+        goto done;
+    }
+    if (op.req_opcode == FTP_OPEN_FILE_RO) {
+        ftp_open_reply(job, &op);
+        goto done;
+    }
+    if (job->state != FTP_READING || op.session != job->session) {
+        goto done;
+    }
+    switch (op.req_opcode) {
+    case FTP_BURST_READ_FILE:
+        if (op.opcode == FTP_NAK) {
+            job->bursting = false;
+            if (op.data[0] != FTP_ERR_EOF) {
+                ftp_finish(job, ftp_nak_error(&op));
+                goto done;
+            }
+            break;
+        }
+        job->tries = 0;
+        job->request_ms = get_time_boot_ms();
+        if (op.burst_complete) {
+            job->bursting = false;
+        }
+        ftp_store(job, op.offset, op.data, op.size);
+        break;
+    case FTP_READ_FILE:
+        if (op.opcode == FTP_ACK) {
+            ftp_store(job, op.offset, op.data, op.size);
+        }
+        break;
+    }
+    if (ftp_job == job) {
+        ftp_pump(job);
+    }
+
+done:
+    pthread_mutex_unlock(&ftp_lock);
+}
+
+/*
+  send new requests and resend anything that has timed out. Called
+  regularly from the select loop
+ */
+void mavlink_ftp_update(void)
+{
+    pthread_mutex_lock(&ftp_lock);
+    struct mavlink_ftp_job *job = ftp_job;
+    if (job && job->cancel) {
+        ftp_finish(job, MAVLINK_FTP_ERR_CANCELLED);
+    } else if (job && job->state == FTP_OPENING &&
+               (job->tries == 0 || get_time_boot_ms() - job->request_ms >= FTP_TIMEOUT_MS)) {
+        if (job->tries >= FTP_MAX_TRIES) {
+            ftp_finish(job, MAVLINK_FTP_ERR_TIMEOUT);
+        } else {
+            ftp_send_open(job);
+        }
+    } else if (job) {
+        ftp_pump(job);
+    }
+    pthread_mutex_unlock(&ftp_lock);
+}
+
+/*
+  read a whole file into memory, calling fn from the select loop when
+  done. Returns false if another session is running
+ */
+bool mavlink_ftp_fetch(const char *path, mavlink_ftp_done_fn fn, void *ptr)
+{
+    struct mavlink_ftp_job *job = NULL;
+    pthread_mutex_lock(&ftp_lock);
+    if (ftp_job == NULL) {
+        job = ftp_start(path, 0);
+        if (job) {
+            job->done_fn = fn;
+            job->done_ptr = ptr;
+        }
+    }
+    pthread_mutex_unlock(&ftp_lock);
+    return job != NULL;
+}
+
+/*
+  open a file on the fc for streaming with mavlink_ftp_read(). Waits
+  for any other session to finish first. Returns NULL with the error
+  set on failure
+ */
+struct mavlink_ftp_job *mavlink_ftp_open(const char *path, uint32_t *size, int *error)
+{
+    uint32_t start = get_time_boot_ms();
+    struct mavlink_ftp_job *job = NULL;
+    pthread_mutex_lock(&ftp_lock);
+    while (ftp_job != NULL && get_time_boot_ms() - start < FTP_BUSY_WAIT_MS) {
+        cond_wait_ms(&ftp_cond, &ftp_lock, 100);
+    }
+    if (ftp_job != NULL) {
+        *error = MAVLINK_FTP_ERR_BUSY;
+        goto done;
+    }
+    job = ftp_start(path, FTP_STREAM_WINDOW);
+    if (job == NULL) {
+        *error = MAVLINK_FTP_ERR_CANCELLED;
+        goto done;
+    }
+    job->reader = true;
+    while (job->state == FTP_OPENING) {
+        cond_wait_ms(&ftp_cond, &ftp_lock, 100);
+    }
+    if (job->state == FTP_FINISHED && job->error != 0) {
+        *error = job->error;
+        talloc_free(job);
+        job = NULL;
+        goto done;
+    }
+    *size = job->size;
+
+done:
+    pthread_mutex_unlock(&ftp_lock);
+    return job;
+}
+
+/*
+  read the next part of a streamed file. Returns the number of bytes
+  read, 0 at the end of the file or -1 if the transfer failed
+ */
+int32_t mavlink_ftp_read(struct mavlink_ftp_job *job, uint8_t *buf, uint32_t len)
+{
+    int32_t ret = -1;
+    pthread_mutex_lock(&ftp_lock);
+    while (true) {
+        uint32_t avail = ftp_contiguous(job) - job->buf_ofs;
+        if (avail > 0) {
+            if (len > avail) {
+                len = avail;
+            }
+            memcpy(buf, job->buf, len);
+            memmove(job->buf, &job->buf[len], job->highest - job->buf_ofs - len);
+            // the window may now have room for another burst, which
+            // the select loop will ask for
+            job->buf_ofs += len;
+            ret = len;
+            break;
+        }
+        if (job->state == FTP_FINISHED) {
+            ret = job->error?-1:0;
+            break;
+        }
+        cond_wait_ms(&ftp_cond, &ftp_lock, 100);
+    }
+    pthread_mutex_unlock(&ftp_lock);
+    return ret;
+}
+
+/*
+  finish with a streamed file, ending the session if it is still
+  running
+ */
+void mavlink_ftp_close(struct mavlink_ftp_job *job)
+{
+    pthread_mutex_lock(&ftp_lock);
+    job->reader = false;
+    if (job->state == FTP_FINISHED) {
+        talloc_free(job);
+    } else {
+        // freed when the select loop ends the session
+        job->cancel = true;
+    }
+    pthread_mutex_unlock(&ftp_lock);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "../mavlink_core.h"
+
+// errors from mavlink_ftp_open(): the fc's NAK codes, plus our own
+#define MAVLINK_FTP_ERR_FILE_NOT_FOUND 10
+#define MAVLINK_FTP_ERR_TIMEOUT 0x100
+#define MAVLINK_FTP_ERR_BUSY 0x101
+#define MAVLINK_FTP_ERR_CANCELLED 0x102
+// a FailErrno NAK, carrying the errno from the fc
+#define MAVLINK_FTP_ERR_ERRNO(e) (0x200 | (e))
+
+struct mavlink_ftp_job;
+
+typedef void (*mavlink_ftp_done_fn)(const uint8_t *data, uint32_t len, bool ok, void *ptr);
+
+bool mavlink_ftp_fetch(const char *path, mavlink_ftp_done_fn fn, void *ptr);
+struct mavlink_ftp_job *mavlink_ftp_open(const char *path, uint32_t *size, int *error);
+int32_t mavlink_ftp_read(struct mavlink_ftp_job *job, uint8_t *buf, uint32_t len);
+void mavlink_ftp_close(struct mavlink_ftp_job *job);
+void mavlink_ftp_handle_msg(const mavlink_message_t *msg);
+void mavlink_ftp_update(void);
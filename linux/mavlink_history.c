@@ -0,0 +1,386 @@
+/*
+  recent history of received mavlink messages
+
+  Each stored message keeps a ring buffer of its last samples. The
+  ring is columnar: one array of receive times plus one array per
+  scalar field, each holding values at the field's native width, so a
+  query for a few fields only touches those columns.
+
+  Rings are only written by the select loop. Readers copy the samples
+  they want without locking and then discard any that the writer may
+  have overwritten while they were copying.
+ */
+
+#include "../includes.h"
+#include "mavlink_history.h"
+
+struct history_column {
+    const mavlink_field_info_t *field;
+    uint8_t width;
+    uint8_t *data;
+};
+
+struct mavlink_history {
+    uint32_t depth;
+    // number of samples ever added. Sample N is stored in slot N % depth
+    uint32_t count;
+    uint32_t *receive_ms;
+    uint8_t num_columns;
+    struct history_column *columns;
+};
+
+/*
+  configured ring depths, from a string like "100,ATTITUDE:500"
+ */
+struct history_depth {
+    struct history_depth *next;
+    char *name;
+    uint32_t depth;
+};
+
+static struct history_depth *history_depths;
+static uint32_t history_default_depth = 100;
+
+/*
+  parse a depth, which must be a plain number
+ */
+static bool parse_depth(const char *s, uint32_t *depth)
+{
+    char *end = NULL;
+    if (!isdigit((unsigned char)*s)) {
+        return false;
+    }
+    unsigned long v = strtoul(s, &end, 10);
+    if (*end != 0 || v > UINT32_MAX) {
+        return false;
+    }
+    *depth = v;
+    return true;
+}
+
+/*
+  set the history depths. The spec is a comma separated list of
+  NAME:depth pairs, plus an optional bare depth for all other messages
+ */
+bool mavlink_history_set_depth(const char *spec)
+{
+    char *s = talloc_strdup(NULL, spec);
+    char *tok, *saveptr = NULL;
+    bool ret = true;
+    if (s == NULL) {
+        return false;
+    }
+    for (tok=strtok_r(s, ",", &saveptr); tok; tok=strtok_r(NULL, ",", &saveptr)) {
+        char *colon = strchr(tok, ':');
+        if (colon == NULL) {
+            if (!parse_depth(tok, &history_default_depth)) {
+                ret = false;
+                break;
+            }
+            continue;
+        }
+        struct history_depth *d = talloc_zero(NULL, struct history_depth);
+        if (d == NULL) {
+            ret = false;
+            break;
+        }
+        d->name = talloc_strndup(d, tok, colon-tok);
+        if (colon == tok || !parse_depth(colon+1, &d->depth)) {
+            talloc_free(d);
+            ret = false;
+            break;
+        }
+        d->next = history_depths;
+        history_depths = d;
+    }
+    talloc_free(s);
+    return ret;
+}
+
+/*
+  get the configured depth for a message
+ */
+static uint32_t history_depth(const char *name)
+{
+    struct history_depth *d;
+    for (d=history_depths; d; d=d->next) {
+        if (strcmp(d->name, name) == 0) {
+            return d->depth;
+        }
+    }
+    return history_default_depth;
+}
+
+/*
+  width of a scalar field on the wire and in its column
+ */
+static uint8_t field_width(uint8_t type)
+{
+    switch (type) {
+    case MAVLINK_TYPE_CHAR:
+    case MAVLINK_TYPE_UINT8_T:
+    case MAVLINK_TYPE_INT8_T:
+        return 1;
+    case MAVLINK_TYPE_UINT16_T:
+    case MAVLINK_TYPE_INT16_T:
+        return 2;
+    case MAVLINK_TYPE_UINT32_T:
+    case MAVLINK_TYPE_INT32_T:
+    case MAVLINK_TYPE_FLOAT:
+        return 4;
+    case MAVLINK_TYPE_UINT64_T:
+    case MAVLINK_TYPE_INT64_T:
+    case MAVLINK_TYPE_DOUBLE:
+        return 8;
+    }
+    return 0;
+}
+
+/*
+  create the history ring for a message, or NULL if history is
+  disabled for this message. Array fields are not kept
+ */
+struct mavlink_history *mavlink_history_new(void *ctx, const mavlink_message_info_t *m)
+{
+    uint32_t depth = history_depth(m->name);
+    unsigned i;
+    if (depth == 0) {
+        return NULL;
+    }
+    struct mavlink_history *h = talloc_zero(ctx, struct mavlink_history);
+    if (h == NULL) {
+        return NULL;
+    }
+    h->depth = depth;
+    h->receive_ms = talloc_zero_array(h, uint32_t, depth);
+    h->columns = talloc_zero_array(h, struct history_column, m->num_fields);
+    if (h->receive_ms == NULL || h->columns == NULL) {
+        goto failed;
+    }
+    for (i=0; i<m->num_fields; i++) {
+        const mavlink_field_info_t *f = &m->fields[i];
+        if (f->array_length != 0) {
+            continue;
+        }
+        struct history_column *c = &h->columns[h->num_columns];
+        c->field = f;
+        c->width = field_width(f->type);
+        c->data = talloc_zero_size(h->columns, depth * c->width);
+        if (c->width == 0 || c->data == NULL) {
+            goto failed;
+        }
+        h->num_columns++;
+    }
+    return h;
+
+failed:
+    talloc_free(h);
+    return NULL;
+}
+
+/*
+  add a sample to a history ring. Only called from the select loop
+ */
+void mavlink_history_add(struct mavlink_history *h, const mavlink_message_t *msg, uint32_t receive_ms)
+{
+    uint32_t slot = h->count % h->depth;
+    uint8_t i;
+    for (i=0; i<h->num_columns; i++) {
+        const struct history_column *c = &h->columns[i];
+        uint8_t *d = &c->data[slot * c->width];
+        uint8_t ofs = c->field->wire_offset;
+        // store in host byte order so readers can use the values directly
+        switch (c->field->type) {
+        case MAVLINK_TYPE_CHAR:
+        case MAVLINK_TYPE_UINT8_T:
+        case MAVLINK_TYPE_INT8_T:
+            *d = _MAV_RETURN_uint8_t(msg, ofs);
+            break;
+        case MAVLINK_TYPE_UINT16_T:
+        case MAVLINK_TYPE_INT16_T: {
+            uint16_t v = _MAV_RETURN_uint16_t(msg, ofs);
+            memcpy(d, &v, sizeof(v));
+            break;
+        }
+        case MAVLINK_TYPE_UINT32_T:
+        case MAVLINK_TYPE_INT32_T:
+        case MAVLINK_TYPE_FLOAT: {
+            uint32_t v = _MAV_RETURN_uint32_t(msg, ofs);
+            memcpy(d, &v, sizeof(v));
+            break;
+        }
+        case MAVLINK_TYPE_UINT64_T:
+        case MAVLINK_TYPE_INT64_T:
+        case MAVLINK_TYPE_DOUBLE: {
+            uint64_t v = _MAV_RETURN_uint64_t(msg, ofs);
+            memcpy(d, &v, sizeof(v));
+            break;
+        }
+        }
+    }
+    h->receive_ms[slot] = receive_ms;
+    __atomic_store_n(&h->count, h->count+1, __ATOMIC_RELEASE);
+}
+
+/*
+  print one column value as JSON
+ */
+static void print_value(struct sock_buf *sock, uint8_t type, const uint8_t *d)
+{
+    union {
+        uint8_t u8;
+        int8_t i8;
+        uint16_t u16;
+        int16_t i16;
+        uint32_t u32;
+        int32_t i32;
+        uint64_t u64;
+        int64_t i64;
+        float f;
+        double d;
+    } v;
+    memcpy(&v, d, field_width(type));
+    switch (type) {
+    case MAVLINK_TYPE_CHAR:
+    case MAVLINK_TYPE_UINT8_T:
+        sock_printf(sock, "%u", v.u8);
+        break;
+    case MAVLINK_TYPE_INT8_T:
+        sock_printf(sock, "%d", v.i8);
+        break;
+    case MAVLINK_TYPE_UINT16_T:
+        sock_printf(sock, "%u", v.u16);
+        break;
+    case MAVLINK_TYPE_INT16_T:
+        sock_printf(sock, "%d", v.i16);
+        break;
+    case MAVLINK_TYPE_UINT32_T:
+        sock_printf(sock, "%lu", (unsigned long)v.u32);
+        break;
+    case MAVLINK_TYPE_INT32_T:
+        sock_printf(sock, "%ld", (long)v.i32);
+        break;
+    case MAVLINK_TYPE_UINT64_T:
+        sock_printf(sock, "%llu", (unsigned long long)v.u64);
+        break;
+    case MAVLINK_TYPE_INT64_T:
+        sock_printf(sock, "%lld", (long long)v.i64);
+        break;
+    case MAVLINK_TYPE_FLOAT:
+        sock_printf(sock, "%f", (double)v.f);
+        break;
+    case MAVLINK_TYPE_DOUBLE:
+        sock_printf(sock, "%f", v.d);
+        break;
+    }
+}
+
+/*
+  find a column by field name
+ */
+static const struct history_column *find_column(const struct mavlink_history *h, const char *name)
+{
+    uint8_t i;
+    for (i=0; i<h->num_columns; i++) {
+        if (strcmp(h->columns[i].field->name, name) == 0) {
+            return &h->columns[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+  print samples from a history ring as JSON. The since argument is
+  either a sample sequence number, giving samples from that sequence
+  on, or a boot time followed by "ms", giving samples received after
+  that time. The _seq field is the sequence to ask for next time.
+
+  With no field names all scalar fields are given.
+ */
+void mavlink_history_json(struct sock_buf *sock, const struct mavlink_history *h,
+                          const char *since, int num_fields, char **fields)
+{
+    char *end = NULL;
+    unsigned long since_val = strtoul(since, &end, 10);
+    bool since_time = (end && strcmp(end, "ms") == 0);
+    const struct history_column **cols;
+    uint8_t **copies;
+    uint32_t *times;
+    uint32_t count, count2, start, n, i;
+    int ncols = 0, c;
+
+    if (num_fields == 0) {
+        num_fields = h->num_columns;
+        fields = NULL;
+    }
+    cols = talloc_zero_array(sock, const struct history_column *, num_fields);
+    copies = talloc_zero_array(sock, uint8_t *, num_fields);
+    times = talloc_array(sock, uint32_t, h->depth);
+    if (cols == NULL || copies == NULL || times == NULL) {
+        goto failed;
+    }
+    for (c=0; c<num_fields; c++) {
+        const struct history_column *col = fields?find_column(h, fields[c]):&h->columns[c];
+        if (col == NULL) {
+            continue;
+        }
+        cols[ncols] = col;
+        copies[ncols] = talloc_size(copies, h->depth * col->width);
+        if (copies[ncols] == NULL) {
+            goto failed;
+        }
+        ncols++;
+    }
+
+    // copy out the samples we want, then check none were overwritten
+    count = __atomic_load_n(&h->count, __ATOMIC_ACQUIRE);
+    start = count > h->depth ? count - h->depth : 0;
+    if (!since_time && since_val > start) {
+        start = since_val > count ? count : since_val;
+    }
+    n = count - start;
+    for (i=0; i<n; i++) {
+        uint32_t slot = (start + i) % h->depth;
+        times[i] = h->receive_ms[slot];
+        for (c=0; c<ncols; c++) {
+            memcpy(&copies[c][i * cols[c]->width], &cols[c]->data[slot * cols[c]->width], cols[c]->width);
+        }
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    count2 = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+
+    // samples at or below count2-depth may have been overwritten
+    uint32_t first = 0;
+    if (count2 >= h->depth && count2 - h->depth + 1 > start) {
+        first = count2 - h->depth + 1 - start;
+        if (first > n) {
+            first = n;
+        }
+    }
+    if (since_time) {
+        while (first < n && (int32_t)(times[first] - since_val) <= 0) {
+            first++;
+        }
+    }
+
+    sock_printf(sock, "\"_seq\" : %u, \"_now\" : %u, \"_receive_ms\" : [", count, get_time_boot_ms());
+    for (i=first; i<n; i++) {
+        sock_printf(sock, "%s%u", i==first?"":",", times[i]);
+    }
+    sock_printf(sock, "]");
+    for (c=0; c<ncols; c++) {
+        sock_printf(sock, ", \"%s\" : [", cols[c]->field->name);
+        for (i=first; i<n; i++) {
+            if (i != first) {
+                sock_printf(sock, ",");
+            }
+            print_value(sock, cols[c]->field->type, &copies[c][i * cols[c]->width]);
+        }
+        sock_printf(sock, "]");
+    }
+
+failed:
+    talloc_free(cols);
+    talloc_free(copies);
+    talloc_free(times);
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "../mavlink_core.h"
+
+struct sock_buf;
+struct mavlink_history;
+
+bool mavlink_history_set_depth(const char *spec);
+struct mavlink_history *mavlink_history_new(void *ctx, const mavlink_message_info_t *m);
+void mavlink_history_add(struct mavlink_history *h, const mavlink_message_t *msg, uint32_t receive_ms);
+void mavlink_history_json(struct sock_buf *sock, const struct mavlink_history *h,
+                          const char *since, int num_fields, char **fields);
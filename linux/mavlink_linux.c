@@ -3,35 +3,82 @@
  */
 
 #include "../includes.h"
+#include "../mavlink_json.h"
+#include "mavlink_history.h"
+#include "mavlink_rollup.h"
+#include "mavlink_cache.h"
+#include "mavlink_mission.h"
+#include "mavlink_ftp.h"
+#include "mavlink_log.h"
 
 /*
-  list of packet types received
+  last instance of each packet type received from each system. Packets
+  are only written by the select loop and are read by http threads
+  without locking, using a seqlock on each packet
  */
 struct mavlink_packet {
-    struct mavlink_packet *next;
-    const char *name;
+    // odd while the writer is updating msg and receive_ms
+    uint32_t seq;
     mavlink_message_t msg;
     uint32_t receive_ms;
+    // rendered JSON for msg without the _age field, valid while
+    // json_seq matches seq
+    char *json;
+    uint32_t json_seq;
+    // recent samples, NULL if history is disabled for this message
+    struct mavlink_history *history;
 };
 
+#define MAVLINK_MAX_SYSTEMS 32
 
-static struct mavlink_packet *mavlink_packets;
+/*
+  stored packets for one msgid, indexed by system
+ */
+struct msgid_packets {
+    // list of all msgids received, newest first
+    struct msgid_packets *next;
+    const char *name;
+    // index of the system that most recently sent this msgid
+    uint8_t latest;
+    struct mavlink_packet *packets[MAVLINK_MAX_SYSTEMS];
+};
+
+static struct msgid_packets *msgid_list;
 
 /*
-  list of parameters received
+  packets indexed directly by 24 bit msgid, using a two level table so
+  we only allocate pages for msgid ranges that are in use
  */
-struct param_packet {
-    struct param_packet *next;
-    char name[17];
-    float value;
+#define MSGID_PAGE_BITS 12
+#define MSGID_PAGE_SIZE (1U<<MSGID_PAGE_BITS)
+#define MSGID_NUM_PAGES (1U<<(24-MSGID_PAGE_BITS))
+static struct msgid_packets **packet_table[MSGID_NUM_PAGES];
+
+/*
+  systems (sysid/compid pairs) we have received messages from
+ */
+struct remote_system {
+    uint8_t sysid;
+    uint8_t compid;
+    bool have_heartbeat;
+    uint8_t type;
+    uint8_t autopilot;
+    uint32_t last_ms;
+    long long last_send_stream;
 };
 
+static struct remote_system systems[MAVLINK_MAX_SYSTEMS];
+static uint8_t num_systems;
+// index+1 into systems[] for each sysid/compid pair, 0 if not seen yet
+static uint8_t system_index[256*256];
+
+// system we request parameters from and send parameter sets to. This
+// is the first autopilot we see a HEARTBEAT from
+static uint8_t target_sysid = MAVLINK_TARGET_SYSTEM_ID;
+static bool have_target_sysid;
 
-// we have a param list per letter, to reduce list traversal cost
-static struct param_packet *param_packets[26];
-static uint32_t param_count;
-static uint32_t param_expected_count;
-static uint32_t param_last_value_sec;
+// protects the json cache of each packet against concurrent http threads
+static pthread_mutex_t json_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*
   list of command acks received
@@ -39,49 +86,54 @@ static uint32_t param_last_value_sec;
 struct mavlink_command_ack {
     struct mavlink_command_ack *next;
     uint32_t receive_ms;
+    // value of command_ack_count when this ack arrived
+    uint32_t seq;
     uint16_t command;
+    // system the ack came from
+    uint8_t sysid;
+    uint8_t compid;
     uint8_t result;
 };
 
 static struct mavlink_command_ack *command_acks;
+// number of acks ever received
+static uint32_t command_ack_count;
+// protects command_acks, and wakes command_ack_wait() on a new ack
+static pthread_mutex_t command_ack_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t command_ack_cond = PTHREAD_COND_INITIALIZER;
 
 /*
   send a request to set stream rates
  */
-static void send_stream_rates_request(uint8_t rate)
+static void send_stream_rates_request(uint8_t sysid, uint8_t compid, uint8_t rate)
 {
     mavlink_msg_request_data_stream_send(MAVLINK_COMM_FC,
-                                         MAVLINK_TARGET_SYSTEM_ID,
-                                         0,
+                                         sysid,
+                                         compid,
                                          MAV_DATA_STREAM_ALL,
                                          rate, 1);
 }
 /*
-  periodic mavlink tasks - run on each HEARTBEAT from fc
+  periodic mavlink tasks - run on each HEARTBEAT from an autopilot
  */
-static void mavlink_periodic(void)
+static void mavlink_periodic(struct remote_system *sys)
 {
     long long now = get_sys_seconds_boot();
-    static long long last_send_stream;
     static long long last_heartbeat;
     
-    if (now - last_send_stream > 15) {
-        send_stream_rates_request(4);
-        last_send_stream = now;
+    if (now - sys->last_send_stream > 15) {
+        send_stream_rates_request(sys->sysid, sys->compid, 4);
+        sys->last_send_stream = now;
+    }
+    if (sys->sysid != target_sysid) {
+        return;
     }
     if (now - last_heartbeat > 10 || last_heartbeat == 0) {
         console_printf("heartbeat ok\n");
     }
 
-    if (param_count == 0 ||
-        (param_expected_count > param_count &&
-         get_sys_seconds_boot() - param_last_value_sec > 20)) {
-        console_printf("requesting parameters param_count=%u param_expected_count=%u\n",
-                       param_count, param_expected_count);
-        mavlink_msg_param_request_list_send(MAVLINK_COMM_FC,
-                                            MAVLINK_TARGET_SYSTEM_ID,
-                                            0);
-    }
+    mavlink_params_periodic(target_sysid);
+    mavlink_mission_periodic(target_sysid);
 
     last_heartbeat = now;
 }
@@ -89,151 +141,312 @@ static void mavlink_periodic(void)
 extern const char *mavlink_message_name(const mavlink_message_t *msg);
 
 /*
-  save a param value
+  find stored packets for a msgid
  */
-static void param_save_packet(const mavlink_message_t *msg)
+static struct msgid_packets *find_msgid_packets(uint32_t msgid)
 {
-    mavlink_param_value_t param_pkt;
-    mavlink_msg_param_value_decode(msg, &param_pkt);
-    if (param_pkt.param_id[0] < 'A' || param_pkt.param_id[0] > 'Z') {
-        // invalid name
-        return;
+    if (msgid >= MSGID_NUM_PAGES*MSGID_PAGE_SIZE) {
+        return NULL;
     }
-    struct param_packet *p0 = param_packets[param_pkt.param_id[0] - 'A'];
-    struct param_packet *p;
-    for (p=p0; p; p=p->next) {
-        if (strncmp(p->name, param_pkt.param_id, 16) == 0) {
-            p->value = param_pkt.param_value;
-            param_last_value_sec = get_sys_seconds_boot();
-            if (param_pkt.param_count < 30000 &&
-                param_pkt.param_count > 0 &&
-                param_pkt.param_count > param_expected_count) {
-                param_expected_count = param_pkt.param_count-1;
-            }
-            return;
+    struct msgid_packets **page = __atomic_load_n(&packet_table[msgid>>MSGID_PAGE_BITS], __ATOMIC_ACQUIRE);
+    if (page == NULL) {
+        return NULL;
+    }
+    return __atomic_load_n(&page[msgid&(MSGID_PAGE_SIZE-1)], __ATOMIC_ACQUIRE);
+}
+
+/*
+  find stored packet for a msgid from a given system. A sysid of zero
+  gives the most recently received packet from any system, a compid of
+  zero gives the most recent from any component of sysid
+ */
+static struct mavlink_packet *find_packet(uint32_t msgid, uint8_t sysid, uint8_t compid)
+{
+    struct msgid_packets *mp = find_msgid_packets(msgid);
+    if (mp == NULL) {
+        return NULL;
+    }
+    if (sysid == 0) {
+        uint8_t latest = __atomic_load_n(&mp->latest, __ATOMIC_ACQUIRE);
+        return __atomic_load_n(&mp->packets[latest], __ATOMIC_ACQUIRE);
+    }
+    if (compid != 0) {
+        uint8_t idx = __atomic_load_n(&system_index[(sysid<<8) | compid], __ATOMIC_ACQUIRE);
+        if (idx == 0) {
+            return NULL;
         }
+        return __atomic_load_n(&mp->packets[idx-1], __ATOMIC_ACQUIRE);
     }
-    p = talloc_size(NULL, sizeof(*p));
-    if (p) {
-        strncpy(p->name, param_pkt.param_id, 16);
-        p->name[16] = 0;
-        p->value = param_pkt.param_value;
-        p->next = p0;
-        param_packets[param_pkt.param_id[0] - 'A'] = p;
-        param_count++;
-        param_last_value_sec = get_sys_seconds_boot();
-        if (param_pkt.param_count < 30000 &&
-            param_pkt.param_count > 0 &&
-            param_pkt.param_count > param_expected_count) {
-            param_expected_count = param_pkt.param_count-1;
+    struct mavlink_packet *best = NULL;
+    uint8_t i, n = __atomic_load_n(&num_systems, __ATOMIC_ACQUIRE);
+    for (i=0; i<n; i++) {
+        if (systems[i].sysid != sysid) {
+            continue;
+        }
+        struct mavlink_packet *p = __atomic_load_n(&mp->packets[i], __ATOMIC_ACQUIRE);
+        if (p && (best == NULL || (int32_t)(p->receive_ms - best->receive_ms) > 0)) {
+            best = p;
         }
     }
+    return best;
 }
 
 /*
-  get a parameter value
+  get the index of the system a message came from, adding it if this
+  is the first message from that system. Returns -1 if the system
+  table is full. Only called from the select loop
  */
-bool mavlink_param_get(const char *name, float *value)
+static int system_get_index(uint8_t sysid, uint8_t compid)
 {
-    if (name[0] < 'A' || name[0] > 'Z') {
-        return false;
+    uint16_t key = (sysid<<8) | compid;
+    if (system_index[key] != 0) {
+        return system_index[key]-1;
+    }
+    if (num_systems == MAVLINK_MAX_SYSTEMS) {
+        return -1;
     }
-    struct param_packet *p0 = param_packets[name[0] - 'A'];
-    struct param_packet *p;
-    for (p=p0; p; p=p->next) {
-        if (strcmp(p->name, name) == 0) {
-            *value = p->value;
-            return true;
+    struct remote_system *sys = &systems[num_systems];
+    memset(sys, 0, sizeof(*sys));
+    sys->sysid = sysid;
+    sys->compid = compid;
+    __atomic_store_n(&num_systems, num_systems+1, __ATOMIC_RELEASE);
+    __atomic_store_n(&system_index[key], num_systems, __ATOMIC_RELEASE);
+    console_printf("new system sysid=%u compid=%u\n", sysid, compid);
+    return num_systems-1;
+}
+
+/*
+  update a stored packet. Only called from the select loop
+ */
+static void packet_write(struct mavlink_packet *p, const mavlink_message_t *msg)
+{
+    __atomic_store_n(&p->seq, p->seq+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&p->msg, msg, sizeof(mavlink_message_t));
+    p->receive_ms = get_time_boot_ms();
+    __atomic_store_n(&p->seq, p->seq+1, __ATOMIC_RELEASE);
+}
+
+/*
+  take a consistent copy of a stored packet, returning the sequence
+  number of the copy
+ */
+static uint32_t packet_read(const struct mavlink_packet *p, mavlink_message_t *msg, uint32_t *receive_ms)
+{
+    while (true) {
+        uint32_t seq1 = __atomic_load_n(&p->seq, __ATOMIC_ACQUIRE);
+        if (seq1 & 1) {
+            // writer is part way through an update
+            continue;
+        }
+        memcpy(msg, &p->msg, sizeof(mavlink_message_t));
+        *receive_ms = p->receive_ms;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint32_t seq2 = __atomic_load_n(&p->seq, __ATOMIC_RELAXED);
+        if (seq1 == seq2) {
+            return seq1;
         }
     }
-    return false;
 }
 
 /*
-  list all parameters as json
+  find or create the stored packets for the msgid of a message
  */
-void mavlink_param_list_json(struct sock_buf *sock, const char *prefix, bool *first)
+static struct msgid_packets *msgid_packets_get(const mavlink_message_t *msg, int idx)
 {
-    uint8_t c;
-    uint8_t plen = strlen(prefix);
-    
-    for (c=0; c<26; c++) {
-        struct param_packet *p0 = param_packets[c];
-        struct param_packet *p;
-        for (p=p0; p; p=p->next) {
-            if (strncmp(p->name, prefix, plen) != 0) {
-                continue;
-            }
-            char *vstr = print_printf(sock, "%f ", p->value);
-            if (vstr == NULL) {
-                continue;
-            }
-            // ensure it is null terminated
-            vstr[talloc_get_size(vstr)-1] = 0;
-            if (vstr[strlen(vstr)-1] == '.') {
-                // can't have trailing . in javascript float for json
-                vstr[strlen(vstr)-1] = 0;
-            }
-            if (!*first) {
-                sock_printf(sock, ",\r\n");
-            }
-            *first = false;
-            sock_printf(sock, "{ \"name\" : \"%s\", \"value\" : %s }",
-                        p->name, vstr);
-            talloc_free(vstr);
+    struct msgid_packets *mp = find_msgid_packets(msg->msgid);
+    if (mp != NULL) {
+        return mp;
+    }
+    struct msgid_packets **page = packet_table[msg->msgid>>MSGID_PAGE_BITS];
+    if (page == NULL) {
+        page = talloc_zero_array(NULL, struct msgid_packets *, MSGID_PAGE_SIZE);
+        if (page == NULL) {
+            return NULL;
         }
+        __atomic_store_n(&packet_table[msg->msgid>>MSGID_PAGE_BITS], page, __ATOMIC_RELEASE);
+    }
+    mp = talloc_zero(NULL, struct msgid_packets);
+    if (mp == NULL) {
+        return NULL;
     }
+    mp->name = mavlink_message_name(msg);
+    mp->latest = idx;
+    mp->next = msgid_list;
+    __atomic_store_n(&page[msg->msgid&(MSGID_PAGE_SIZE-1)], mp, __ATOMIC_RELEASE);
+    __atomic_store_n(&msgid_list, mp, __ATOMIC_RELEASE);
+    return mp;
 }
 
 /*
-  save last instance of each packet type
+  add the first packet from a system for a msgid
+ */
+static struct mavlink_packet *packet_new(struct msgid_packets *mp, int idx,
+                                         const mavlink_message_t *msg, uint32_t receive_ms)
+{
+    struct mavlink_packet *p = talloc_zero(mp, struct mavlink_packet);
+    if (p == NULL) {
+        return NULL;
+    }
+    memcpy(&p->msg, msg, sizeof(mavlink_message_t));
+    p->receive_ms = receive_ms;
+    const mavlink_message_info_t *m = mavlink_message_info(msg);
+    if (m != NULL) {
+        p->history = mavlink_history_new(p, m);
+    }
+    __atomic_store_n(&mp->packets[idx], p, __ATOMIC_RELEASE);
+    return p;
+}
+
+/*
+  save last instance of each packet type from each system
  */
 static void mavlink_save_packet(const mavlink_message_t *msg)
 {
-    if (msg->msgid == MAVLINK_MSG_ID_PARAM_VALUE) {
-        param_save_packet(msg);
+    if (msg->msgid == MAVLINK_MSG_ID_PARAM_VALUE && msg->sysid == target_sysid) {
+        mavlink_param_value_t m;
+        mavlink_msg_param_value_decode(msg, &m);
+        mavlink_param_save(&m);
     }
-    struct mavlink_packet *p;
-    for (p=mavlink_packets; p; p=p->next) {
-        if (p->msg.msgid == msg->msgid) {
-            memcpy(&p->msg, msg, sizeof(mavlink_message_t));
-            p->receive_ms = get_time_boot_ms();
+    int idx = system_get_index(msg->sysid, msg->compid);
+    if (idx == -1) {
+        return;
+    }
+    systems[idx].last_ms = get_time_boot_ms();
+
+    struct msgid_packets *mp = msgid_packets_get(msg, idx);
+    if (mp == NULL) {
+        return;
+    }
+    struct mavlink_packet *p = mp->packets[idx];
+    if (p != NULL) {
+        packet_write(p, msg);
+    } else {
+        p = packet_new(mp, idx, msg, get_time_boot_ms());
+        if (p == NULL) {
             return;
         }
     }
-    p = talloc_size(NULL, sizeof(*p));
-    if (p == NULL) {
+    if (p->history != NULL) {
+        mavlink_history_add(p->history, msg, p->receive_ms);
+    }
+    __atomic_store_n(&mp->latest, idx, __ATOMIC_RELEASE);
+}
+
+/*
+  restore a packet saved by an earlier run. Packets we have already
+  received from the system are kept
+ */
+void mavlink_restore_packet(const mavlink_message_t *msg, uint32_t receive_ms)
+{
+    int idx = system_get_index(msg->sysid, msg->compid);
+    if (idx == -1) {
         return;
     }
-    p->next = mavlink_packets;
-    p->name = mavlink_message_name(msg);
-    memcpy(&p->msg, msg, sizeof(mavlink_message_t));
-    p->receive_ms = get_time_boot_ms();
-    mavlink_packets = p;
+    struct msgid_packets *mp = msgid_packets_get(msg, idx);
+    if (mp == NULL || mp->packets[idx] != NULL) {
+        return;
+    }
+    if (packet_new(mp, idx, msg, receive_ms) != NULL &&
+        mp->packets[mp->latest] == NULL) {
+        __atomic_store_n(&mp->latest, idx, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+  call fn for the last packet of each type from each system. Only
+  called from the select loop, so no copy is needed
+ */
+void mavlink_foreach_packet(void (*fn)(const mavlink_message_t *msg, uint32_t receive_ms, void *ptr), void *ptr)
+{
+    struct msgid_packets *mp;
+    uint8_t i;
+    for (mp=msgid_list; mp; mp=mp->next) {
+        for (i=0; i<MAVLINK_MAX_SYSTEMS; i++) {
+            const struct mavlink_packet *p = mp->packets[i];
+            if (p != NULL) {
+                fn(&p->msg, p->receive_ms, ptr);
+            }
+        }
+    }
+}
+
+/*
+  note a HEARTBEAT from a system. The first autopilot we hear from
+  becomes the target for parameter requests
+ */
+static void heartbeat_save(const mavlink_message_t *msg, const mavlink_heartbeat_t *m)
+{
+    int idx = system_get_index(msg->sysid, msg->compid);
+    if (idx == -1) {
+        return;
+    }
+    struct remote_system *sys = &systems[idx];
+    sys->type = m->type;
+    sys->autopilot = m->autopilot;
+    sys->have_heartbeat = true;
+    if (m->autopilot == MAV_AUTOPILOT_INVALID || m->type == MAV_TYPE_GCS) {
+        return;
+    }
+    if (!have_target_sysid) {
+        target_sysid = msg->sysid;
+        have_target_sysid = true;
+        console_printf("target system sysid=%u\n", target_sysid);
+        mavlink_cache_restore(target_sysid, m->autopilot, m->type);
+    }
+    mavlink_periodic(sys);
 }
 
 
 /*
   save last instance of each COMMAND_ACK
  */
-static void command_ack_save(const mavlink_command_ack_t *m)
+static void command_ack_save(const mavlink_message_t *msg, const mavlink_command_ack_t *m)
 {
+    if (m->target_system != 0 && m->target_system != mavlink_system.sysid) {
+        // ack for another GCS
+        return;
+    }
     struct mavlink_command_ack *p;
+    pthread_mutex_lock(&command_ack_lock);
     for (p=command_acks; p; p=p->next) {
-        if (p->command == m->command) {
-            p->result = m->result;
-            p->receive_ms = get_time_boot_ms();
-            return;
+        if (p->command == m->command && p->sysid == msg->sysid && p->compid == msg->compid) {
+            break;
+        }
+    }
+    if (p == NULL) {
+        p = talloc(NULL, struct mavlink_command_ack);
+        if (p) {
+            p->next = command_acks;
+            p->command = m->command;
+            p->sysid = msg->sysid;
+            p->compid = msg->compid;
+            command_acks = p;
         }
     }
-    p = talloc(NULL, struct mavlink_command_ack);
     if (p) {
-        p->next = command_acks;
-        p->command = m->command;
         p->result = m->result;
         p->receive_ms = get_time_boot_ms();
-        command_acks = p;
+        p->seq = ++command_ack_count;
+        pthread_cond_broadcast(&command_ack_cond);
     }
+    pthread_mutex_unlock(&command_ack_lock);
+}
+
+/*
+  find the newest ack for a command from a system, any system if sysid
+  is 0. Caller must hold command_ack_lock
+ */
+static struct mavlink_command_ack *command_ack_find(uint16_t command, uint8_t sysid)
+{
+    struct mavlink_command_ack *p, *best = NULL;
+    for (p=command_acks; p; p=p->next) {
+        if (p->command == command && (sysid == 0 || p->sysid == sysid) &&
+            (best == NULL || (int32_t)(p->seq - best->seq) > 0)) {
+            best = p;
+        }
+    }
+    return best;
 }
 
 /*
@@ -241,45 +454,145 @@ static void command_ack_save(const mavlink_command_ack_t *m)
  */
 bool command_ack_get(uint16_t command, uint8_t *result, uint32_t *receive_ms)
 {
-    struct mavlink_command_ack *p;
-    for (p=command_acks; p; p=p->next) {
-        if (p->command == command) {
+    pthread_mutex_lock(&command_ack_lock);
+    struct mavlink_command_ack *p = command_ack_find(command, 0);
+    if (p) {
+        *result = p->result;
+        *receive_ms = p->receive_ms;
+    }
+    pthread_mutex_unlock(&command_ack_lock);
+    return p != NULL;
+}
+
+/*
+  get the number of acks received so far, to pass to command_ack_wait()
+ */
+uint32_t command_ack_seq(void)
+{
+    pthread_mutex_lock(&command_ack_lock);
+    uint32_t seq = command_ack_count;
+    pthread_mutex_unlock(&command_ack_lock);
+    return seq;
+}
+
+/*
+  wait for an ack for a command from a system (any system if sysid is
+  0) received after command_ack_seq() returned since_seq. Returns false
+  on timeout
+ */
+bool command_ack_wait(uint16_t command, uint8_t sysid, uint32_t since_seq, uint32_t timeout_ms, uint8_t *result)
+{
+    bool ret = false;
+    uint32_t start = get_time_boot_ms();
+    pthread_mutex_lock(&command_ack_lock);
+    while (true) {
+        struct mavlink_command_ack *p = command_ack_find(command, sysid);
+        if (p && (int32_t)(p->seq - since_seq) > 0) {
             *result = p->result;
-            *receive_ms = p->receive_ms;
-            return true;
+            ret = true;
+            break;
+        }
+        uint32_t elapsed = get_time_boot_ms() - start;
+        if (elapsed >= timeout_ms ||
+            !cond_wait_ms(&command_ack_cond, &command_ack_lock, timeout_ms - elapsed)) {
+            break;
         }
     }
-    return false;
+    pthread_mutex_unlock(&command_ack_lock);
+    return ret;
 }
 
 /*
-  get last message of a specified type
+  find stored packet for a message name
  */
-const mavlink_message_t *mavlink_get_message_by_msgid(uint32_t msgid, uint32_t *receive_ms)
+static struct mavlink_packet *find_packet_by_name(const char *name, uint8_t sysid, uint8_t compid)
 {
-    struct mavlink_packet *p;
-    for (p=mavlink_packets; p; p=p->next) {
-        if (p->msg.msgid == msgid) {
-            *receive_ms = p->receive_ms;
-            return &p->msg;
-        }
+    const mavlink_message_info_t *m = mavlink_message_info_by_name(name, NULL);
+    if (m == NULL) {
+        return NULL;
+    }
+    return find_packet(m->msgid, sysid, compid);
+}
+
+/*
+  get a copy of the last message of a specified type
+ */
+bool mavlink_get_message_by_msgid(uint32_t msgid, mavlink_message_t *msg, uint32_t *receive_ms)
+{
+    struct mavlink_packet *p = find_packet(msgid, 0, 0);
+    if (p == NULL) {
+        return false;
+    }
+    packet_read(p, msg, receive_ms);
+    return true;
+}
+
+/*
+  get a copy of the last message of a specified type
+ */
+bool mavlink_get_message_by_name(const char *name, mavlink_message_t *msg, uint32_t *receive_ms)
+{
+    struct mavlink_packet *p = find_packet_by_name(name, 0, 0);
+    if (p == NULL) {
+        return false;
     }
-    return NULL;
+    packet_read(p, msg, receive_ms);
+    return true;
 }
 
 /*
-  get last message of a specified type
+  send last message of a specified type as JSON, given a message name
+  or a numeric msgid. A sysid of zero selects the most recent message
+  from any system, a compid of zero the most recent from any
+  component. The fields are rendered once per received message and
+  shared between requests, only the _age is computed here
  */
-const mavlink_message_t *mavlink_get_message_by_name(const char *name, uint32_t *receive_ms)
+bool mavlink_message_json(struct sock_buf *sock, const char *name, uint8_t sysid, uint8_t compid, bool *first)
 {
     struct mavlink_packet *p;
-    for (p=mavlink_packets; p; p=p->next) {
-        if (p->name && strcmp(name, p->name) == 0) {
-            *receive_ms = p->receive_ms;
-            return &p->msg;
+    if (isdigit(*name)) {
+        p = find_packet(atoi(name), sysid, compid);
+    } else {
+        p = find_packet_by_name(name, sysid, compid);
+    }
+    if (p == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&json_lock);
+    mavlink_message_t msg;
+    uint32_t receive_ms;
+    uint32_t seq = packet_read(p, &msg, &receive_ms);
+    if (p->json == NULL || p->json_seq != seq) {
+        // render into a memory only sock_buf
+        struct sock_buf *tmp = talloc_zero(NULL, struct sock_buf);
+        if (tmp == NULL) {
+            pthread_mutex_unlock(&json_lock);
+            return false;
+        }
+        tmp->fd = -1;
+        tmp->add_content_length = true;
+        talloc_free(p->json);
+        p->json = NULL;
+        if (mavlink_json_message_body(tmp, &msg) && tmp->buf != NULL) {
+            p->json = talloc_steal(p, tmp->buf);
+            p->json_seq = seq;
         }
+        talloc_free(tmp);
     }
-    return NULL;
+    bool ret = false;
+    if (p->json != NULL) {
+        if (!*first) {
+            sock_printf(sock, ",\r\n");
+        }
+        *first = false;
+        // dynamic json replies are buffered, so this never blocks on the socket
+        sock_write(sock, p->json, talloc_get_size(p->json));
+        mavlink_json_message_age(sock, receive_ms);
+        ret = true;
+    }
+    pthread_mutex_unlock(&json_lock);
+    return ret;
 }
 
 /*
@@ -289,20 +602,103 @@ void mavlink_message_list_json(struct sock_buf *sock)
 {
     sock_printf(sock, "[");
     bool first = true;
-    struct mavlink_packet *p;
-    for (p=mavlink_packets; p; p=p->next) {
-        sock_printf(sock, "%s\"%s\"", first?"":", ", p->name);
+    struct msgid_packets *mp;
+    for (mp=__atomic_load_n(&msgid_list, __ATOMIC_ACQUIRE); mp; mp=mp->next) {
+        if (mp->name == NULL) {
+            continue;
+        }
+        sock_printf(sock, "%s\"%s\"", first?"":", ", mp->name);
         first = false;
     }
     sock_printf(sock, "]");
 }
 
+/*
+  send recent samples of a message as JSON, see mavlink_history_json()
+  for the meaning of since
+ */
+bool mavlink_message_history_json(struct sock_buf *sock, const char *name, uint8_t sysid, uint8_t compid,
+                                  const char *since, int num_fields, char **fields, bool *first)
+{
+    struct mavlink_packet *p;
+    const mavlink_message_info_t *m = NULL;
+    if (isdigit(*name)) {
+        p = find_packet(atoi(name), sysid, compid);
+    } else {
+        m = mavlink_message_info_by_name(name, NULL);
+        p = m?find_packet(m->msgid, sysid, compid):NULL;
+    }
+    if (p == NULL || p->history == NULL) {
+        return false;
+    }
+    if (!*first) {
+        sock_printf(sock, ",\r\n");
+    }
+    *first = false;
+    // key on what was found, not the text asked for
+    if (m != NULL) {
+        sock_printf(sock, "\"%s\" : { ", m->name);
+    } else {
+        sock_printf(sock, "\"%d\" : { ", atoi(name));
+    }
+    mavlink_history_json(sock, p->history, since, num_fields, fields);
+    sock_printf(sock, " }");
+    return true;
+}
+
+/*
+  get list of systems we have received messages from as JSON
+ */
+void mavlink_system_list_json(struct sock_buf *sock)
+{
+    uint8_t i, n = __atomic_load_n(&num_systems, __ATOMIC_ACQUIRE);
+    uint32_t now = get_time_boot_ms();
+    sock_printf(sock, "[");
+    for (i=0; i<n; i++) {
+        const struct remote_system *sys = &systems[i];
+        sock_printf(sock, "%s{ \"sysid\" : %u, \"compid\" : %u, \"type\" : %d, \"autopilot\" : %d, \"target\" : %s, \"_age\" : %u }",
+                    i==0?"":",\r\n",
+                    sys->sysid, sys->compid,
+                    sys->have_heartbeat?sys->type:-1,
+                    sys->have_heartbeat?sys->autopilot:-1,
+                    (have_target_sysid && sys->sysid == target_sysid)?"true":"false",
+                    now - sys->last_ms);
+    }
+    sock_printf(sock, "]");
+}
+
+/*
+  get the system we send parameter requests and sets to
+ */
+uint8_t mavlink_target_system(void)
+{
+    return target_sysid;
+}
+
+/*
+  regular mavlink tasks, called from the select loop at least every
+  100ms
+ */
+void mavlink_update(void)
+{
+    if (have_target_sysid) {
+        mavlink_params_update(target_sysid);
+        mavlink_mission_update(target_sysid);
+        mavlink_ftp_update();
+        mavlink_log_update();
+        mavlink_cache_update();
+    }
+}
+
 /*
  * handle an (as yet undecoded) mavlink message
  */
 bool mavlink_handle_msg(const mavlink_message_t *msg)
 {
     mavlink_save_packet(msg);
+    if (msg->sysid == target_sysid) {
+        mavlink_rollup_update(msg);
+    }
     
     switch(msg->msgid) {
         /*
@@ -311,16 +707,33 @@ bool mavlink_handle_msg(const mavlink_message_t *msg)
     case MAVLINK_MSG_ID_HEARTBEAT: {
 	mavlink_heartbeat_t m;
 	mavlink_msg_heartbeat_decode(msg, &m);
-        mavlink_periodic();
+        heartbeat_save(msg, &m);
         break;
     }
 
     case MAVLINK_MSG_ID_COMMAND_ACK: {
 	mavlink_command_ack_t m;
 	mavlink_msg_command_ack_decode(msg, &m);
-        command_ack_save(&m);
+        command_ack_save(msg, &m);
         break;
     }
+
+    case MAVLINK_MSG_ID_MISSION_COUNT:
+    case MAVLINK_MSG_ID_MISSION_ITEM_INT:
+    case MAVLINK_MSG_ID_MISSION_REQUEST:
+    case MAVLINK_MSG_ID_MISSION_REQUEST_INT:
+    case MAVLINK_MSG_ID_MISSION_ACK:
+        mavlink_mission_handle_msg(msg);
+        break;
+
+    case MAVLINK_MSG_ID_FILE_TRANSFER_PROTOCOL:
+        mavlink_ftp_handle_msg(msg);
+        break;
+
+    case MAVLINK_MSG_ID_LOG_ENTRY:
+    case MAVLINK_MSG_ID_LOG_DATA:
+        mavlink_log_handle_msg(msg);
+        break;
         
     default:
 	break;
@@ -329,11 +742,3 @@ bool mavlink_handle_msg(const mavlink_message_t *msg)
 }
 
 
-/*
-  set a parameter
- */
-void mavlink_param_set(const char *name, float value)
-{
-    console_printf("Setting parameter %s to %f\n", name, value);
-    mavlink_msg_param_set_send(MAVLINK_COMM_FC, MAVLINK_TARGET_SYSTEM_ID, 0, name, value, 0);
-}
@@ -4,13 +4,20 @@
 
 struct sock_buf;
 
-const mavlink_message_t *mavlink_get_message_by_msgid(uint32_t msgid, uint32_t *receive_ms);
-const mavlink_message_t *mavlink_get_message_by_name(const char *name, uint32_t *receive_ms);
+bool mavlink_get_message_by_msgid(uint32_t msgid, mavlink_message_t *msg, uint32_t *receive_ms);
+bool mavlink_get_message_by_name(const char *name, mavlink_message_t *msg, uint32_t *receive_ms);
 void mavlink_message_list_json(struct sock_buf *sock);
+bool mavlink_message_json(struct sock_buf *sock, const char *name, uint8_t sysid, uint8_t compid, bool *first);
+bool mavlink_message_history_json(struct sock_buf *sock, const char *name, uint8_t sysid, uint8_t compid,
+                                  const char *since, int num_fields, char **fields, bool *first);
+void mavlink_system_list_json(struct sock_buf *sock);
+uint8_t mavlink_target_system(void);
 bool command_ack_get(uint16_t command, uint8_t *result, uint32_t *receive_ms);
-void mavlink_param_set(const char *name, float value);
-bool mavlink_param_get(const char *name, float *value);
-void mavlink_param_list_json(struct sock_buf *sock, const char *prefix, bool *first);
+uint32_t command_ack_seq(void);
+bool command_ack_wait(uint16_t command, uint8_t sysid, uint32_t since_seq, uint32_t timeout_ms, uint8_t *result);
 void mavlink_fc_send(mavlink_message_t *msg);
 bool mavlink_handle_msg(const mavlink_message_t *msg);
+void mavlink_update(void);
+void mavlink_restore_packet(const mavlink_message_t *msg, uint32_t receive_ms);
+void mavlink_foreach_packet(void (*fn)(const mavlink_message_t *msg, uint32_t receive_ms, void *ptr), void *ptr);
 
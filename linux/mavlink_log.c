@@ -0,0 +1,484 @@
+/*
+  dataflash log download from the target system
+
+  A log is fetched with LOG_REQUEST_DATA requests for large windows of
+  data, which the fc streams back as 90 byte LOG_DATA chunks. Received
+  chunks are marked in a bitmap. When a window finishes, or stalls, the
+  next request is for the first missing chunk: just the run of missing
+  chunks if it is inside a window already requested, or else a new
+  window. The fc only serves one request at a time, so gaps are filled
+  in order before moving on.
+
+  Chunks are kept in a ring buffer until the http thread reading the
+  log takes them, in order. Requests never go past the space left in
+  the ring, so a slow reader slows the download rather than losing
+  data.
+
+  Requests are only sent from the select loop, as frames to the fc are
+  written without a lock. A http thread only changes the download or
+  asks for the log list, and the next mavlink_log_update() sends the
+  requests.
+ */
+
+#include "../includes.h"
+#include "mavlink_log.h"
+
+#define LOG_CHUNK 90
+// chunks asked for in one LOG_REQUEST_DATA
+#define LOG_WINDOW_CHUNKS 2048
+// chunks held for the reader, a little over 1MB
+#define LOG_BUFFER_CHUNKS 11651
+#define LOG_BUFFER_SIZE (LOG_BUFFER_CHUNKS * LOG_CHUNK)
+#define LOG_TIMEOUT_MS 1000
+#define LOG_MAX_TRIES 5
+#define LOG_LIST_TIMEOUT_MS 5000
+// time a reader waits for another download to finish
+#define LOG_BUSY_WAIT_MS 5000
+
+struct log_entry {
+    uint16_t id;
+    uint32_t size;
+    uint32_t time_utc;
+};
+
+struct mavlink_log_job {
+    uint16_t id;
+    uint8_t sysid;
+    uint32_t size;
+    uint32_t num_chunks;
+    // bitmap of chunks received
+    uint8_t *received;
+    // first chunk not yet received
+    uint32_t contig;
+    // ring of LOG_BUFFER_SIZE bytes, holding the log from buf_ofs on
+    uint8_t *buf;
+    uint32_t buf_ofs;
+    // current request, and the end of all data requested so far
+    bool requesting;
+    uint32_t request_end;
+    uint32_t requested_chunks;
+    uint32_t last_data_ms;
+    // first chunk of the last request, and tries starting from there
+    uint32_t try_chunk;
+    uint8_t tries;
+    bool finished;
+    int error;
+    bool reader;
+    // the reader has gone, stop the download from the select loop
+    bool cancel;
+};
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+// wakes readers on new data, log list entries and the end of a download
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static struct mavlink_log_job *log_job;
+static char *log_dir;
+
+// log list from LOG_ENTRY messages
+static struct log_entry *log_entries;
+static uint16_t log_num_entries;
+static uint16_t log_num_logs;
+static bool log_list_reply;
+static uint32_t log_entry_ms;
+// LOG_REQUEST_LIST waiting to be sent by the select loop
+static bool log_list_pending;
+static uint16_t log_list_start, log_list_end;
+
+/*
+  set the directory downloaded logs can be saved in
+ */
+void mavlink_log_set_dir(const char *dir)
+{
+    talloc_free(log_dir);
+    log_dir = talloc_strdup(NULL, dir);
+}
+
+/*
+  directory for saved logs, or NULL if saving is disabled
+ */
+const char *mavlink_log_dir(void)
+{
+    return log_dir;
+}
+
+static bool log_chunk_received(const struct mavlink_log_job *job, uint32_t chunk)
+{
+    return (job->received[chunk/8] & (1U<<(chunk%8))) != 0;
+}
+
+/*
+  end of the log data a reader can take
+ */
+static uint32_t log_contiguous(const struct mavlink_log_job *job)
+{
+    uint64_t end = (uint64_t)job->contig * LOG_CHUNK;
+    return end > job->size ? job->size : end;
+}
+
+/*
+  end a download. The job is freed by its reader. Caller must hold
+  log_lock
+ */
+static void log_finish(struct mavlink_log_job *job, int error)
+{
+    mavlink_msg_log_request_end_send(MAVLINK_COMM_FC, job->sysid, 0);
+    if (error != 0) {
+        console_printf("log %u download failed error %d\n", job->id, error);
+    }
+    job->finished = true;
+    job->error = error;
+    if (log_job == job) {
+        log_job = NULL;
+    }
+    pthread_cond_broadcast(&log_cond);
+    if (!job->reader) {
+        talloc_free(job);
+    }
+}
+
+/*
+  ask for the next window or gap if the current request has finished
+  or stalled. Caller must hold log_lock
+ */
+static void log_pump(struct mavlink_log_job *job)
+{
+    uint32_t now = get_time_boot_ms();
+    if (job->finished) {
+        return;
+    }
+    if (job->contig == job->num_chunks) {
+        log_finish(job, 0);
+        return;
+    }
+    if (job->requesting && now - job->last_data_ms < LOG_TIMEOUT_MS) {
+        return;
+    }
+    job->requesting = false;
+
+    // don't ask for more than fits in the ring
+    uint32_t limit = (job->buf_ofs + LOG_BUFFER_SIZE) / LOG_CHUNK;
+    if (limit > job->num_chunks) {
+        limit = job->num_chunks;
+    }
+    uint32_t first = job->contig;
+    if (first >= limit) {
+        return;
+    }
+    uint32_t end = first;
+    while (end < limit && !log_chunk_received(job, end)) {
+        end++;
+    }
+    if (end >= job->requested_chunks || end == limit) {
+        // past anything asked for before, start a new window
+        end = first + LOG_WINDOW_CHUNKS;
+        if (end > limit) {
+            end = limit;
+        }
+    }
+    if (first == job->try_chunk) {
+        if (job->tries >= LOG_MAX_TRIES) {
+            log_finish(job, MAVLINK_LOG_ERR_TIMEOUT);
+            return;
+        }
+        job->tries++;
+    } else {
+        job->try_chunk = first;
+        job->tries = 1;
+    }
+    uint32_t ofs = first * LOG_CHUNK;
+    uint64_t request_end = (uint64_t)end * LOG_CHUNK;
+    if (request_end > job->size) {
+        request_end = job->size;
+    }
+    job->requesting = true;
+    job->request_end = request_end;
+    job->last_data_ms = now;
+    if (end > job->requested_chunks) {
+        job->requested_chunks = end;
+    }
+    mavlink_msg_log_request_data_send(MAVLINK_COMM_FC, job->sysid, 0, job->id, ofs, request_end - ofs);
+}
+
+/*
+  store a LOG_DATA chunk. Caller must hold log_lock
+ */
+static void log_data_save(struct mavlink_log_job *job, const mavlink_log_data_t *m)
+{
+    uint32_t chunk = m->ofs / LOG_CHUNK;
+    if (m->id != job->id || m->ofs % LOG_CHUNK != 0 || chunk >= job->num_chunks) {
+        return;
+    }
+    uint32_t expected = job->size - m->ofs;
+    if (expected > LOG_CHUNK) {
+        expected = LOG_CHUNK;
+    }
+    job->last_data_ms = get_time_boot_ms();
+    if (m->ofs + m->count >= job->request_end) {
+        // end of the current request
+        job->requesting = false;
+    }
+    if (m->count != expected || log_chunk_received(job, chunk) ||
+        m->ofs + m->count > job->buf_ofs + LOG_BUFFER_SIZE) {
+        return;
+    }
+    // the ring is a whole number of chunks, so a chunk never wraps
+    memcpy(&job->buf[m->ofs % LOG_BUFFER_SIZE], m->data, m->count);
+    job->received[chunk/8] |= 1U<<(chunk%8);
+    while (job->contig < job->num_chunks && log_chunk_received(job, job->contig)) {
+        job->contig++;
+    }
+    pthread_cond_broadcast(&log_cond);
+}
+
+/*
+  note a LOG_ENTRY. Caller must hold log_lock
+ */
+static void log_entry_save(const mavlink_log_entry_t *m)
+{
+    uint16_t i;
+    log_list_reply = true;
+    log_entry_ms = get_time_boot_ms();
+    log_num_logs = m->num_logs;
+    pthread_cond_broadcast(&log_cond);
+    if (m->num_logs == 0) {
+        return;
+    }
+    for (i=0; i<log_num_entries; i++) {
+        if (log_entries[i].id == m->id) {
+            break;
+        }
+    }
+    if (i == log_num_entries) {
+        struct log_entry *e = talloc_realloc(NULL, log_entries, struct log_entry, i+1);
+        if (e == NULL) {
+            return;
+        }
+        log_entries = e;
+        log_num_entries++;
+    }
+    log_entries[i].id = m->id;
+    log_entries[i].size = m->size;
+    log_entries[i].time_utc = m->time_utc;
+}
+
+/*
+  handle LOG_ENTRY and LOG_DATA from the fc. Called from the select loop
+ */
+void mavlink_log_handle_msg(const mavlink_message_t *msg)
+{
+    if (msg->sysid != mavlink_target_system()) {
+        return;
+    }
+    pthread_mutex_lock(&log_lock);
+    switch (msg->msgid) {
+    case MAVLINK_MSG_ID_LOG_ENTRY: {
+        mavlink_log_entry_t m;
+        mavlink_msg_log_entry_decode(msg, &m);
+        log_entry_save(&m);
+        break;
+    }
+    case MAVLINK_MSG_ID_LOG_DATA: {
+        mavlink_log_data_t m;
+        mavlink_msg_log_data_decode(msg, &m);
+        if (log_job) {
+            struct mavlink_log_job *job = log_job;
+            log_data_save(job, &m);
+            if (!job->requesting) {
+                log_pump(job);
+            }
+        }
+        break;
+    }
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+/*
+  send new requests and resend stalled ones. Called regularly from the
+  select loop
+ */
+void mavlink_log_update(void)
+{
+    pthread_mutex_lock(&log_lock);
+    if (log_list_pending) {
+        log_list_pending = false;
+        mavlink_msg_log_request_list_send(MAVLINK_COMM_FC, mavlink_target_system(), 0,
+                                          log_list_start, log_list_end);
+    }
+    if (log_job && log_job->cancel) {
+        log_finish(log_job, MAVLINK_LOG_ERR_CANCELLED);
+    } else if (log_job) {
+        log_pump(log_job);
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+/*
+  ask the fc for its log list, or part of it, and wait for the
+  entries. Caller must hold log_lock
+ */
+static void log_list_request(uint16_t start, uint16_t end)
+{
+    uint32_t start_ms = get_time_boot_ms();
+    log_list_reply = false;
+    log_entry_ms = start_ms;
+    log_list_start = start;
+    log_list_end = end;
+    log_list_pending = true;
+    while (get_time_boot_ms() - start_ms < LOG_LIST_TIMEOUT_MS) {
+        if (log_list_reply &&
+            (log_num_entries >= log_num_logs || get_time_boot_ms() - log_entry_ms >= LOG_TIMEOUT_MS)) {
+            break;
+        }
+        if (!log_list_reply && get_time_boot_ms() - log_entry_ms >= LOG_TIMEOUT_MS) {
+            // no reply at all
+            break;
+        }
+        cond_wait_ms(&log_cond, &log_lock, 100);
+    }
+}
+
+/*
+  the log list as json. While a download is running the fc can't be
+  asked, so the list from before is given
+ */
+void mavlink_log_list_json(struct sock_buf *sock)
+{
+    uint16_t i, n;
+    pthread_mutex_lock(&log_lock);
+    if (log_job == NULL) {
+        log_num_entries = 0;
+        log_list_request(0, 0xFFFF);
+    }
+    n = log_num_entries;
+    struct log_entry *entries = talloc_memdup(sock, log_entries, n * sizeof(struct log_entry));
+    pthread_mutex_unlock(&log_lock);
+
+    sock_printf(sock, "[");
+    for (i=0; entries && i<n; i++) {
+        sock_printf(sock, "%s{ \"id\" : %u, \"size\" : %u, \"time_utc\" : %u }",
+                    i==0?"":",\r\n", entries[i].id, entries[i].size, entries[i].time_utc);
+    }
+    sock_printf(sock, "]");
+    talloc_free(entries);
+}
+
+/*
+  find a log in the list. Caller must hold log_lock
+ */
+static const struct log_entry *log_entry_find(uint16_t id)
+{
+    uint16_t i;
+    for (i=0; i<log_num_entries; i++) {
+        if (log_entries[i].id == id) {
+            return &log_entries[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+  start downloading a log, for streaming with mavlink_log_read().
+  Waits for any other download to finish first. Returns NULL with the
+  error set on failure
+ */
+struct mavlink_log_job *mavlink_log_open(uint16_t id, uint32_t *size, int *error)
+{
+    uint32_t start = get_time_boot_ms();
+    struct mavlink_log_job *job = NULL;
+    pthread_mutex_lock(&log_lock);
+    while (log_job != NULL && get_time_boot_ms() - start < LOG_BUSY_WAIT_MS) {
+        cond_wait_ms(&log_cond, &log_lock, 100);
+    }
+    if (log_job != NULL) {
+        *error = MAVLINK_LOG_ERR_BUSY;
+        goto done;
+    }
+    const struct log_entry *e = log_entry_find(id);
+    if (e == NULL) {
+        log_list_request(id, id);
+        e = log_entry_find(id);
+    }
+    if (e == NULL) {
+        *error = log_list_reply?MAVLINK_LOG_ERR_NOT_FOUND:MAVLINK_LOG_ERR_TIMEOUT;
+        goto done;
+    }
+    job = talloc_zero(NULL, struct mavlink_log_job);
+    if (job == NULL) {
+        *error = MAVLINK_LOG_ERR_CANCELLED;
+        goto done;
+    }
+    job->id = id;
+    job->sysid = mavlink_target_system();
+    job->size = e->size;
+    job->num_chunks = (e->size + LOG_CHUNK - 1) / LOG_CHUNK;
+    job->received = talloc_zero_array(job, uint8_t, (job->num_chunks+7)/8 + 1);
+    job->buf = talloc_size(job, LOG_BUFFER_SIZE);
+    job->try_chunk = UINT32_MAX;
+    job->reader = true;
+    if (job->received == NULL || job->buf == NULL) {
+        talloc_free(job);
+        job = NULL;
+        *error = MAVLINK_LOG_ERR_CANCELLED;
+        goto done;
+    }
+    console_printf("downloading log %u of %u bytes\n", id, job->size);
+    *size = job->size;
+    // the first request goes out from the select loop
+    log_job = job;
+
+done:
+    pthread_mutex_unlock(&log_lock);
+    return job;
+}
+
+/*
+  read the next part of a log. Returns the number of bytes read, 0 at
+  the end of the log or -1 if the download failed
+ */
+int32_t mavlink_log_read(struct mavlink_log_job *job, uint8_t *buf, uint32_t len)
+{
+    int32_t ret = -1;
+    pthread_mutex_lock(&log_lock);
+    while (true) {
+        uint32_t avail = log_contiguous(job) - job->buf_ofs;
+        if (avail > 0) {
+            uint32_t pos = job->buf_ofs % LOG_BUFFER_SIZE;
+            if (len > avail) {
+                len = avail;
+            }
+            if (len > LOG_BUFFER_SIZE - pos) {
+                len = LOG_BUFFER_SIZE - pos;
+            }
+            memcpy(buf, &job->buf[pos], len);
+            // there may now be room for another window, which the
+            // select loop will ask for
+            job->buf_ofs += len;
+            ret = len;
+            break;
+        }
+        if (job->finished) {
+            ret = job->error?-1:0;
+            break;
+        }
+        cond_wait_ms(&log_cond, &log_lock, 100);
+    }
+    pthread_mutex_unlock(&log_lock);
+    return ret;
+}
+
+/*
+  finish with a log download, stopping it if it is still running
+ */
+void mavlink_log_close(struct mavlink_log_job *job)
+{
+    pthread_mutex_lock(&log_lock);
+    job->reader = false;
+    if (job->finished) {
+        talloc_free(job);
+    } else {
+        // freed when the select loop stops the download
+        job->cancel = true;
+    }
+    pthread_mutex_unlock(&log_lock);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "../mavlink_core.h"
+
+struct sock_buf;
+
+// errors from mavlink_log_open()
+#define MAVLINK_LOG_ERR_NOT_FOUND 1
+#define MAVLINK_LOG_ERR_BUSY 2
+#define MAVLINK_LOG_ERR_TIMEOUT 3
+#define MAVLINK_LOG_ERR_CANCELLED 4
+
+struct mavlink_log_job;
+
+void mavlink_log_set_dir(const char *dir);
+const char *mavlink_log_dir(void);
+void mavlink_log_handle_msg(const mavlink_message_t *msg);
+void mavlink_log_update(void);
+void mavlink_log_list_json(struct sock_buf *sock);
+struct mavlink_log_job *mavlink_log_open(uint16_t id, uint32_t *size, int *error);
+int32_t mavlink_log_read(struct mavlink_log_job *job, uint8_t *buf, uint32_t len);
+void mavlink_log_close(struct mavlink_log_job *job);
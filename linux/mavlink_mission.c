@@ -0,0 +1,585 @@
+/*
+  mission transfer for the target system
+
+  A download sends MISSION_REQUEST_LIST and then keeps a window of
+  MISSION_REQUEST_INTs in flight, so a long mission doesn't cost a
+  round trip per item. Requests with no reply are sent again after a
+  timeout. The finished mission is rendered once as compact json, which
+  is what http clients are given.
+
+  An upload sends MISSION_COUNT, and the fc then asks for each item.
+  The select loop answers those requests itself, so the http thread
+  that started the upload only waits for the final MISSION_ACK.
+
+  Only one transfer runs at a time. It is started by a http thread or
+  by the first heartbeat from the target, and is then moved along by
+  the select loop. Any number of http threads can wait for it to
+  finish; the last one out frees it.
+ */
+
+#include "../includes.h"
+#include "mavlink_mission.h"
+#include <math.h>
+
+// MISSION_REQUEST_INTs in flight at once during a download
+#define MISSION_WINDOW 8
+#define MISSION_TIMEOUT_MS 1000
+#define MISSION_MAX_TRIES 5
+// downloads started by heartbeats before we leave it to the user
+#define MISSION_AUTO_TRIES 3
+
+// results for transfers that never got a MISSION_ACK
+#define MISSION_RESULT_TIMEOUT -1
+#define MISSION_RESULT_BUSY -2
+#define MISSION_RESULT_BAD_FILE -3
+
+struct mission_xfer {
+    bool upload;
+    bool done;
+    int result;
+    // http threads waiting for this transfer
+    unsigned waiters;
+    uint16_t count;
+    mavlink_mission_item_int_t *items;
+    // tries and last send time of the MISSION_REQUEST_LIST or MISSION_COUNT
+    uint8_t start_tries;
+    uint32_t start_ms;
+    // download: MISSION_COUNT has arrived
+    bool have_count;
+    // download: bitmap of items received, and the time and number of
+    // requests for each item
+    uint8_t *received;
+    uint32_t *sent_ms;
+    uint8_t *tries;
+    uint16_t missing;
+    uint16_t next;
+    uint16_t inflight;
+    // upload: time of the last item request from the fc, and how far
+    // through the items it has asked
+    bool requested;
+    uint32_t request_ms;
+    uint16_t sent;
+};
+
+static pthread_mutex_t mission_lock = PTHREAD_MUTEX_INITIALIZER;
+// wakes http threads when a transfer finishes
+static pthread_cond_t mission_cond = PTHREAD_COND_INITIALIZER;
+static struct mission_xfer *mission_xfer;
+// the current mission as a json array, NULL until we have one
+static char *mission_json;
+static uint16_t mission_count;
+// bumped each time the mission changes
+static uint32_t mission_version;
+static uint8_t mission_auto_tries;
+
+/*
+  send the message that starts a transfer, or send it again
+ */
+static void mission_send_start(struct mission_xfer *x, uint8_t sysid)
+{
+    x->start_tries++;
+    x->start_ms = get_time_boot_ms();
+    if (x->upload) {
+        mavlink_msg_mission_count_send(MAVLINK_COMM_FC, sysid, 0, x->count, MAV_MISSION_TYPE_MISSION);
+    } else {
+        mavlink_msg_mission_request_list_send(MAVLINK_COMM_FC, sysid, 0, MAV_MISSION_TYPE_MISSION);
+    }
+}
+
+/*
+  create a transfer and send its first message. Caller must hold
+  mission_lock
+ */
+static struct mission_xfer *mission_start(uint8_t sysid, mavlink_mission_item_int_t *items, uint16_t count)
+{
+    struct mission_xfer *x = talloc_zero(NULL, struct mission_xfer);
+    if (x == NULL) {
+        return NULL;
+    }
+    if (items) {
+        x->upload = true;
+        x->items = talloc_steal(x, items);
+        x->count = count;
+        console_printf("uploading mission of %u items\n", count);
+    } else {
+        console_printf("downloading mission\n");
+    }
+    mission_xfer = x;
+    mission_send_start(x, sysid);
+    return x;
+}
+
+/*
+  end the current transfer. Caller must hold mission_lock
+ */
+static void mission_finish(struct mission_xfer *x, int result)
+{
+    console_printf("mission %s %s result %d\n",
+                   x->upload?"upload":"download",
+                   result==MAV_MISSION_ACCEPTED?"done":"failed", result);
+    x->done = true;
+    x->result = result;
+    mission_xfer = NULL;
+    pthread_cond_broadcast(&mission_cond);
+    if (x->waiters == 0) {
+        talloc_free(x);
+    }
+}
+
+/*
+  print a float param as json, which has no nan
+ */
+static char *mission_float(char *s, float v)
+{
+    if (isnan(v) || isinf(v)) {
+        return talloc_asprintf_append(s, "null");
+    }
+    return talloc_asprintf_append(s, "%.7g", v);
+}
+
+/*
+  make the items of a transfer the current mission, rendering them as
+  an array of [command, frame, current, autocontinue, param1, param2,
+  param3, param4, x, y, z] arrays. Caller must hold mission_lock
+ */
+static void mission_publish(const struct mission_xfer *x)
+{
+    char *s = talloc_strdup(NULL, "[");
+    uint16_t i;
+    for (i=0; s && i<x->count; i++) {
+        const mavlink_mission_item_int_t *m = &x->items[i];
+        s = talloc_asprintf_append(s, "%s[%u,%u,%u,%u,", i==0?"":",",
+                                   m->command, m->frame, m->current, m->autocontinue);
+        s = s?mission_float(s, m->param1):NULL;
+        s = s?talloc_asprintf_append(s, ","):NULL;
+        s = s?mission_float(s, m->param2):NULL;
+        s = s?talloc_asprintf_append(s, ","):NULL;
+        s = s?mission_float(s, m->param3):NULL;
+        s = s?talloc_asprintf_append(s, ","):NULL;
+        s = s?mission_float(s, m->param4):NULL;
+        s = s?talloc_asprintf_append(s, ",%ld,%ld,", (long)m->x, (long)m->y):NULL;
+        s = s?mission_float(s, m->z):NULL;
+        s = s?talloc_asprintf_append(s, "]"):NULL;
+    }
+    s = s?talloc_asprintf_append(s, "]"):NULL;
+    if (s == NULL) {
+        return;
+    }
+    talloc_free(mission_json);
+    mission_json = s;
+    mission_count = x->count;
+    mission_version++;
+}
+
+/*
+  fill the download window with requests for items not yet asked for
+ */
+static void mission_request_more(struct mission_xfer *x, uint8_t sysid)
+{
+    uint32_t now = get_time_boot_ms();
+    while (x->inflight < MISSION_WINDOW && x->next < x->count) {
+        uint16_t i = x->next++;
+        if (x->received[i/8] & (1U<<(i%8))) {
+            continue;
+        }
+        x->sent_ms[i] = now;
+        x->tries[i] = 1;
+        x->inflight++;
+        mavlink_msg_mission_request_int_send(MAVLINK_COMM_FC, sysid, 0, i, MAV_MISSION_TYPE_MISSION);
+    }
+}
+
+/*
+  handle MISSION_COUNT during a download
+ */
+static void mission_count_save(struct mission_xfer *x, const mavlink_message_t *msg)
+{
+    mavlink_mission_count_t m;
+    mavlink_msg_mission_count_decode(msg, &m);
+    if (x->upload || x->have_count || m.mission_type != MAV_MISSION_TYPE_MISSION) {
+        return;
+    }
+    x->count = m.count;
+    x->items = talloc_zero_array(x, mavlink_mission_item_int_t, m.count);
+    x->received = talloc_zero_array(x, uint8_t, (m.count+7)/8);
+    x->sent_ms = talloc_zero_array(x, uint32_t, m.count);
+    x->tries = talloc_zero_array(x, uint8_t, m.count);
+    if (m.count != 0 && (x->items == NULL || x->received == NULL ||
+                         x->sent_ms == NULL || x->tries == NULL)) {
+        mission_finish(x, MAV_MISSION_ERROR);
+        return;
+    }
+    x->have_count = true;
+    x->missing = m.count;
+    if (m.count == 0) {
+        mavlink_msg_mission_ack_send(MAVLINK_COMM_FC, msg->sysid, msg->compid,
+                                     MAV_MISSION_ACCEPTED, MAV_MISSION_TYPE_MISSION);
+        mission_publish(x);
+        mission_finish(x, MAV_MISSION_ACCEPTED);
+        return;
+    }
+    mission_request_more(x, msg->sysid);
+}
+
+/*
+  handle MISSION_ITEM_INT during a download
+ */
+static void mission_item_save(struct mission_xfer *x, const mavlink_message_t *msg)
+{
+    mavlink_mission_item_int_t m;
+    mavlink_msg_mission_item_int_decode(msg, &m);
+    if (x->upload || !x->have_count || m.mission_type != MAV_MISSION_TYPE_MISSION ||
+        m.seq >= x->count || (x->received[m.seq/8] & (1U<<(m.seq%8)))) {
+        return;
+    }
+    x->items[m.seq] = m;
+    x->received[m.seq/8] |= 1U<<(m.seq%8);
+    x->missing--;
+    if (x->tries[m.seq] != 0) {
+        x->inflight--;
+    }
+    if (x->missing == 0) {
+        mavlink_msg_mission_ack_send(MAVLINK_COMM_FC, msg->sysid, msg->compid,
+                                     MAV_MISSION_ACCEPTED, MAV_MISSION_TYPE_MISSION);
+        mission_publish(x);
+        mission_finish(x, MAV_MISSION_ACCEPTED);
+        return;
+    }
+    mission_request_more(x, msg->sysid);
+}
+
+/*
+  answer a request for an item during an upload
+ */
+static void mission_item_send(struct mission_xfer *x, const mavlink_message_t *msg, uint16_t seq, uint8_t mission_type)
+{
+    if (!x->upload || mission_type != MAV_MISSION_TYPE_MISSION || seq >= x->count) {
+        return;
+    }
+    const mavlink_mission_item_int_t *m = &x->items[seq];
+    x->requested = true;
+    x->request_ms = get_time_boot_ms();
+    if (seq >= x->sent) {
+        x->sent = seq+1;
+    }
+    mavlink_msg_mission_item_int_send(MAVLINK_COMM_FC, msg->sysid, msg->compid, seq,
+                                      m->frame, m->command, m->current, m->autocontinue,
+                                      m->param1, m->param2, m->param3, m->param4,
+                                      m->x, m->y, m->z, MAV_MISSION_TYPE_MISSION);
+}
+
+/*
+  handle MISSION_ACK, which ends an upload, or a download the fc has
+  given up on
+ */
+static void mission_ack_save(struct mission_xfer *x, const mavlink_message_t *msg)
+{
+    mavlink_mission_ack_t m;
+    mavlink_msg_mission_ack_decode(msg, &m);
+    if (m.mission_type != MAV_MISSION_TYPE_MISSION) {
+        return;
+    }
+    if (x->upload) {
+        if (m.type == MAV_MISSION_ACCEPTED) {
+            mission_publish(x);
+        }
+        mission_finish(x, m.type);
+    } else if (m.type != MAV_MISSION_ACCEPTED) {
+        mission_finish(x, m.type);
+    }
+}
+
+/*
+  handle a mission message from the fc. Called from the select loop
+ */
+void mavlink_mission_handle_msg(const mavlink_message_t *msg)
+{
+    if (msg->sysid != mavlink_target_system()) {
+        return;
+    }
+    pthread_mutex_lock(&mission_lock);
+    struct mission_xfer *x = mission_xfer;
+    if (x == NULL) {
+        pthread_mutex_unlock(&mission_lock);
+        return;
+    }
+    switch (msg->msgid) {
+    case MAVLINK_MSG_ID_MISSION_COUNT:
+        mission_count_save(x, msg);
+        break;
+    case MAVLINK_MSG_ID_MISSION_ITEM_INT:
+        mission_item_save(x, msg);
+        break;
+    case MAVLINK_MSG_ID_MISSION_REQUEST_INT: {
+        mavlink_mission_request_int_t m;
+        mavlink_msg_mission_request_int_decode(msg, &m);
+        mission_item_send(x, msg, m.seq, m.mission_type);
+        break;
+    }
+    case MAVLINK_MSG_ID_MISSION_REQUEST: {
+        // older fcs ask for MISSION_ITEM, but accept MISSION_ITEM_INT
+        mavlink_mission_request_t m;
+        mavlink_msg_mission_request_decode(msg, &m);
+        mission_item_send(x, msg, m.seq, m.mission_type);
+        break;
+    }
+    case MAVLINK_MSG_ID_MISSION_ACK:
+        mission_ack_save(x, msg);
+        break;
+    }
+    pthread_mutex_unlock(&mission_lock);
+}
+
+/*
+  start a download if we have no mission yet. Called on each HEARTBEAT
+  from the target system
+ */
+void mavlink_mission_periodic(uint8_t sysid)
+{
+    pthread_mutex_lock(&mission_lock);
+    if (mission_json == NULL && mission_xfer == NULL && mission_auto_tries < MISSION_AUTO_TRIES) {
+        mission_auto_tries++;
+        mission_start(sysid, NULL, 0);
+    }
+    pthread_mutex_unlock(&mission_lock);
+}
+
+/*
+  resend anything that has timed out. Called regularly from the select
+  loop
+ */
+void mavlink_mission_update(uint8_t sysid)
+{
+    uint32_t now = get_time_boot_ms();
+    uint16_t i;
+    pthread_mutex_lock(&mission_lock);
+    struct mission_xfer *x = mission_xfer;
+    if (x == NULL) {
+        goto done;
+    }
+    if (!x->have_count && !x->requested) {
+        // no reply to the MISSION_REQUEST_LIST or MISSION_COUNT yet
+        if (now - x->start_ms >= MISSION_TIMEOUT_MS) {
+            if (x->start_tries >= MISSION_MAX_TRIES) {
+                mission_finish(x, MISSION_RESULT_TIMEOUT);
+            } else {
+                mission_send_start(x, sysid);
+            }
+        }
+        goto done;
+    }
+    if (x->upload) {
+        // the fc retries its own requests, we only give up on it
+        if (now - x->request_ms >= MISSION_TIMEOUT_MS * MISSION_MAX_TRIES) {
+            mission_finish(x, MISSION_RESULT_TIMEOUT);
+        }
+        goto done;
+    }
+    for (i=0; i<x->next; i++) {
+        if ((x->received[i/8] & (1U<<(i%8))) || now - x->sent_ms[i] < MISSION_TIMEOUT_MS) {
+            continue;
+        }
+        if (x->tries[i] >= MISSION_MAX_TRIES) {
+            mission_finish(x, MISSION_RESULT_TIMEOUT);
+            goto done;
+        }
+        x->tries[i]++;
+        x->sent_ms[i] = now;
+        mavlink_msg_mission_request_int_send(MAVLINK_COMM_FC, sysid, 0, i, MAV_MISSION_TYPE_MISSION);
+    }
+
+done:
+    pthread_mutex_unlock(&mission_lock);
+}
+
+/*
+  wait for a transfer to finish. Caller must hold mission_lock
+ */
+static int mission_wait(struct mission_xfer *x, uint32_t timeout_ms)
+{
+    int result = MISSION_RESULT_TIMEOUT;
+    uint32_t start = get_time_boot_ms();
+    x->waiters++;
+    while (!x->done) {
+        uint32_t elapsed = get_time_boot_ms() - start;
+        if (elapsed >= timeout_ms ||
+            !cond_wait_ms(&mission_cond, &mission_lock, timeout_ms - elapsed)) {
+            break;
+        }
+    }
+    x->waiters--;
+    if (x->done) {
+        result = x->result;
+        if (x->waiters == 0) {
+            talloc_free(x);
+        }
+    }
+    return result;
+}
+
+/*
+  download the mission from the fc, or join a download already
+  running. Returns a MAV_MISSION_RESULT, or a negative value if the fc
+  didn't answer or an upload is running
+ */
+int mavlink_mission_download(uint32_t timeout_ms)
+{
+    int result = MISSION_RESULT_BUSY;
+    pthread_mutex_lock(&mission_lock);
+    struct mission_xfer *x = mission_xfer;
+    if (x == NULL) {
+        x = mission_start(mavlink_target_system(), NULL, 0);
+    }
+    if (x && !x->upload) {
+        result = mission_wait(x, timeout_ms);
+    }
+    pthread_mutex_unlock(&mission_lock);
+    return result;
+}
+
+/*
+  check for a frame whose x and y are latitude and longitude
+ */
+static bool mission_frame_global(uint8_t frame)
+{
+    switch (frame) {
+    case MAV_FRAME_GLOBAL:
+    case MAV_FRAME_GLOBAL_RELATIVE_ALT:
+    case MAV_FRAME_GLOBAL_TERRAIN_ALT:
+    case MAV_FRAME_GLOBAL_INT:
+    case MAV_FRAME_GLOBAL_RELATIVE_ALT_INT:
+    case MAV_FRAME_GLOBAL_TERRAIN_ALT_INT:
+        return true;
+    }
+    return false;
+}
+
+static int32_t mission_int(double v)
+{
+    return (int32_t)(v < 0 ? v - 0.5 : v + 0.5);
+}
+
+/*
+  parse a QGC WPL 110 mission file. Each line after the header is seq,
+  current, frame, command, param1-4, x, y, z and autocontinue, with
+  x and y in degrees for global frames
+ */
+static mavlink_mission_item_int_t *mission_parse(const char *text, uint32_t len, uint16_t *count)
+{
+    char *buf = talloc_strndup(NULL, text, len);
+    char *line, *saveptr = NULL;
+    mavlink_mission_item_int_t *items = talloc_array(buf, mavlink_mission_item_int_t, 0);
+    bool header = false;
+    *count = 0;
+    if (buf == NULL || items == NULL) {
+        goto failed;
+    }
+    for (line=strtok_r(buf, "\r\n", &saveptr); line; line=strtok_r(NULL, "\r\n", &saveptr)) {
+        unsigned seq, current, frame, command, autocontinue;
+        float p1, p2, p3, p4, z;
+        double x, y;
+        line += strspn(line, " \t");
+        if (*line == 0) {
+            continue;
+        }
+        if (!header) {
+            if (strncmp(line, "QGC WPL", 7) != 0) {
+                goto failed;
+            }
+            header = true;
+            continue;
+        }
+        if (sscanf(line, "%u %u %u %u %f %f %f %f %lf %lf %f %u",
+                   &seq, &current, &frame, &command, &p1, &p2, &p3, &p4,
+                   &x, &y, &z, &autocontinue) != 12 ||
+            seq != *count || *count == UINT16_MAX) {
+            goto failed;
+        }
+        items = talloc_realloc(buf, items, mavlink_mission_item_int_t, *count+1);
+        if (items == NULL) {
+            goto failed;
+        }
+        mavlink_mission_item_int_t *m = &items[*count];
+        memset(m, 0, sizeof(*m));
+        m->seq = seq;
+        m->current = current;
+        m->frame = frame;
+        m->command = command;
+        m->autocontinue = autocontinue;
+        m->param1 = p1;
+        m->param2 = p2;
+        m->param3 = p3;
+        m->param4 = p4;
+        if (mission_frame_global(frame)) {
+            x *= 1.0e7;
+            y *= 1.0e7;
+        }
+        m->x = mission_int(x);
+        m->y = mission_int(y);
+        m->z = z;
+        m->mission_type = MAV_MISSION_TYPE_MISSION;
+        (*count)++;
+    }
+    if (!header) {
+        goto failed;
+    }
+    talloc_steal(NULL, items);
+    talloc_free(buf);
+    return items;
+
+failed:
+    talloc_free(buf);
+    return NULL;
+}
+
+/*
+  upload a QGC WPL mission file to the fc. Returns the
+  MAV_MISSION_RESULT from the fc, or a negative value if the file is
+  bad, the fc didn't answer or another transfer is running
+ */
+int mavlink_mission_upload(const char *text, uint32_t len, uint32_t timeout_ms)
+{
+    uint16_t count;
+    int result = MISSION_RESULT_BUSY;
+    mavlink_mission_item_int_t *items = mission_parse(text, len, &count);
+    if (items == NULL) {
+        return MISSION_RESULT_BAD_FILE;
+    }
+    pthread_mutex_lock(&mission_lock);
+    if (mission_xfer == NULL) {
+        struct mission_xfer *x = mission_start(mavlink_target_system(), items, count);
+        if (x) {
+            items = NULL;
+            result = mission_wait(x, timeout_ms);
+        }
+    }
+    pthread_mutex_unlock(&mission_lock);
+    talloc_free(items);
+    return result;
+}
+
+/*
+  the current mission as json, with the progress of any transfer
+ */
+void mavlink_mission_json(struct sock_buf *sock)
+{
+    const char *state = "idle";
+    uint16_t done = 0, total = 0;
+    pthread_mutex_lock(&mission_lock);
+    const struct mission_xfer *x = mission_xfer;
+    if (x) {
+        state = x->upload?"uploading":"downloading";
+        total = x->count;
+        done = x->upload?x->sent:x->count - x->missing;
+    }
+    uint32_t version = mission_version;
+    uint16_t count = mission_count;
+    char *json = mission_json?talloc_strdup(sock, mission_json):NULL;
+    pthread_mutex_unlock(&mission_lock);
+
+    sock_printf(sock, "{ \"version\" : %u, \"state\" : \"%s\", \"progress\" : [%u,%u], \"count\" : %u, \"items\" : ",
+                version, state, done, total, count);
+    sock_write(sock, json?json:"[]", json?strlen(json):2);
+    sock_printf(sock, " }");
+    talloc_free(json);
+}
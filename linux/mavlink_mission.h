@@ -0,0 +1,12 @@
+#pragma once
+
+#include "../mavlink_core.h"
+
+struct sock_buf;
+
+void mavlink_mission_periodic(uint8_t sysid);
+void mavlink_mission_update(uint8_t sysid);
+void mavlink_mission_handle_msg(const mavlink_message_t *msg);
+void mavlink_mission_json(struct sock_buf *sock);
+int mavlink_mission_download(uint32_t timeout_ms);
+int mavlink_mission_upload(const char *text, uint32_t len, uint32_t timeout_ms);
@@ -0,0 +1,986 @@
+/*
+  parameter store for the target system
+
+  Parameters are kept in an array in the order they arrive, so an
+  entry never moves once added. An open addressing hash over that
+  array gives lookup by name, and a separate array of entry indexes
+  kept sorted by name gives prefix ranges with a binary search.
+
+  The select loop is the only writer, and renders the json for a
+  parameter each time its value changes. http threads take a read lock
+  and copy out the json fragments they need, so a parameter list is
+  just a concatenation of fragments.
+
+  The whole set is first fetched as @PARAM/param.pck over MAVLink FTP,
+  which is a single burst transfer. If the fc doesn't support that we
+  fall back to PARAM_REQUEST_LIST.
+
+  The download is tracked with a bitmap of the param_index values
+  received. Once the PARAM_REQUEST_LIST stream stops, any indexes
+  still missing are fetched one by one with PARAM_REQUEST_READ, paced
+  to a share of the link bandwidth.
+ */
+
+#include "../includes.h"
+#include "mavlink_params.h"
+#include "mavlink_ftp.h"
+
+struct param_entry {
+    char name[17];
+    float value;
+    // value of param_version when this parameter last changed
+    uint32_t version;
+    // json for this parameter, rendered whenever the value changes
+    uint8_t json_len;
+    char json[95];
+};
+
+static pthread_rwlock_t param_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct param_entry *params;
+// indexes into params[] sorted by name
+static uint16_t *param_order;
+// hash of names to index+1 into params[], 0 for an empty slot
+static uint16_t *param_hash;
+static uint32_t param_hash_size;
+static uint32_t param_space;
+static uint32_t param_count;
+// bumped on every change to the parameter set
+static uint32_t param_version;
+// random per run, so versions from before a restart can be told apart
+static uint32_t param_epoch;
+static pthread_once_t param_epoch_once = PTHREAD_ONCE_INIT;
+
+// wakes get_param_changes() waiters when param_version changes
+static pthread_mutex_t param_change_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t param_change_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+  state of one parameter in a bulk set
+ */
+enum param_set_state {
+    PARAM_SET_PENDING,
+    PARAM_SET_SENT,
+    PARAM_SET_OK,
+    PARAM_SET_UNCHANGED,
+    PARAM_SET_UNKNOWN,
+    PARAM_SET_FAILED,
+};
+
+struct param_set_entry {
+    char name[17];
+    float value;
+    enum param_set_state state;
+    uint8_t tries;
+    uint32_t sent_ms;
+    // last value the fc reported while the set was in flight
+    bool have_reply;
+    float reply;
+};
+
+/*
+  a bulk set in progress, owned by the http thread running it
+ */
+struct param_set_job {
+    struct param_set_job *next;
+    struct param_set_entry *entries;
+    uint32_t count;
+};
+
+// number of PARAM_SETs in flight at once for each bulk set
+#define PARAM_SET_WINDOW 8
+#define PARAM_SET_TIMEOUT_MS 1000
+#define PARAM_SET_MAX_TRIES 3
+
+// protects the list of bulk set jobs, and wakes them on PARAM_VALUE
+static pthread_mutex_t param_set_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t param_set_cond = PTHREAD_COND_INITIALIZER;
+static struct param_set_job *param_set_jobs;
+
+// share of the fc link we use for replies to our PARAM_REQUEST_READs
+#define PARAM_FETCH_LINK_SHARE 0.25f
+// bytes of a PARAM_VALUE reply on the wire
+#define PARAM_VALUE_WIRE_LEN (MAVLINK_NUM_NON_PAYLOAD_BYTES + MAVLINK_MSG_ID_PARAM_VALUE_LEN)
+// most requests we send at once
+#define PARAM_FETCH_BURST 8
+// time with no PARAM_VALUE before we consider the list stream finished
+#define PARAM_STREAM_TIMEOUT_MS 1000
+// time to wait for replies before requesting indexes again
+#define PARAM_FETCH_RETRY_MS 1000
+
+// bitmap of param_index values received for the current download
+static uint8_t *param_received;
+static uint16_t param_total;
+static uint16_t param_missing;
+static uint32_t param_last_value_ms;
+static bool param_fetching;
+static uint16_t param_fetch_index;
+static uint32_t param_fetch_pass_ms;
+static float param_fetch_tokens;
+static uint32_t param_fetch_update_ms;
+
+// hash of the whole parameter set, as given by the fc for _HASH_CHECK
+static uint32_t param_set_hash;
+static bool param_hash_valid;
+static uint8_t param_hash_tries;
+static uint32_t param_hash_request_ms;
+// parameters were restored from the cache and the fc has not yet
+// confirmed they are current
+static bool param_verifying;
+#define PARAM_HASH_MAX_TRIES 3
+
+// state of the download of the set with MAVLink FTP
+enum param_ftp_state {
+    PARAM_FTP_IDLE,
+    PARAM_FTP_RUNNING,
+    // not supported by the fc, use PARAM_REQUEST_LIST from now on
+    PARAM_FTP_FAILED,
+};
+static enum param_ftp_state param_ftp_state;
+#define PARAM_FTP_FILE "@PARAM/param.pck"
+#define PARAM_PCK_MAGIC 0x671B
+#define PARAM_PCK_MAGIC_DEFAULTS 0x671C
+
+int uart2_get_baudrate();
+
+static uint32_t param_name_hash(const char *name)
+{
+    uint32_t h = 2166136261U;
+    uint8_t i;
+    for (i=0; i<16 && name[i]; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/*
+  find the entry for a name, or -1. Caller must hold the lock
+ */
+static int param_find(const char *name)
+{
+    if (param_hash == NULL) {
+        return -1;
+    }
+    uint32_t mask = param_hash_size-1;
+    uint32_t h = param_name_hash(name) & mask;
+    while (param_hash[h] != 0) {
+        uint16_t idx = param_hash[h]-1;
+        if (strncmp(params[idx].name, name, 16) == 0) {
+            return idx;
+        }
+        h = (h+1) & mask;
+    }
+    return -1;
+}
+
+/*
+  add an entry to the hash. Caller must hold the write lock
+ */
+static void param_hash_insert(uint16_t idx)
+{
+    uint32_t mask = param_hash_size-1;
+    uint32_t h = param_name_hash(params[idx].name) & mask;
+    while (param_hash[h] != 0) {
+        h = (h+1) & mask;
+    }
+    param_hash[h] = idx+1;
+}
+
+/*
+  find the first position in param_order with a name not less than
+  the given prefix. Caller must hold the lock
+ */
+static uint32_t param_lower_bound(const char *prefix, uint8_t plen)
+{
+    uint32_t lo = 0, hi = param_count;
+    while (lo < hi) {
+        uint32_t mid = (lo+hi)/2;
+        if (strncmp(params[param_order[mid]].name, prefix, plen) < 0) {
+            lo = mid+1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+  make room for another parameter. Caller must hold the write lock
+ */
+static bool param_grow(void)
+{
+    if (param_count < param_space) {
+        return true;
+    }
+    uint32_t space = param_space?param_space*2:256;
+    if (space > 0xFFFF) {
+        return false;
+    }
+    struct param_entry *new_params = talloc_realloc(NULL, params, struct param_entry, space);
+    if (new_params == NULL) {
+        return false;
+    }
+    params = new_params;
+    uint16_t *new_order = talloc_realloc(NULL, param_order, uint16_t, space);
+    if (new_order == NULL) {
+        return false;
+    }
+    param_order = new_order;
+    uint16_t *new_hash = talloc_zero_array(NULL, uint16_t, space*2);
+    if (new_hash == NULL) {
+        return false;
+    }
+    talloc_free(param_hash);
+    param_hash = new_hash;
+    param_hash_size = space*2;
+    param_space = space;
+    uint32_t i;
+    for (i=0; i<param_count; i++) {
+        param_hash_insert(i);
+    }
+    return true;
+}
+
+/*
+  start tracking a download of total parameters
+ */
+static void param_download_reset(uint16_t total)
+{
+    talloc_free(param_received);
+    param_received = talloc_zero_array(NULL, uint8_t, (total+7)/8);
+    param_total = param_received?total:0;
+    param_missing = param_total;
+    param_fetching = false;
+    param_fetch_index = 0;
+    param_hash_valid = false;
+    param_hash_tries = 0;
+}
+
+/*
+  render the json for a parameter. Caller must hold the write lock
+ */
+static void param_render(struct param_entry *p)
+{
+    int len = snprintf(p->json, sizeof(p->json), "{ \"name\" : \"%s\", \"value\" : %f", p->name, p->value);
+    if (len < 0 || len > sizeof(p->json)-3) {
+        len = snprintf(p->json, sizeof(p->json), "{ \"name\" : \"%s\", \"value\" : %g", p->name, p->value);
+    }
+    if (p->json[len-1] == '.') {
+        // can't have trailing . in javascript float for json
+        len--;
+    }
+    memcpy(&p->json[len], " }", 3);
+    p->json_len = len+2;
+}
+
+/*
+  store a parameter value, returning true if it changed
+ */
+static bool param_store(const char *name, float value)
+{
+    bool changed = false;
+    pthread_rwlock_wrlock(&param_lock);
+    int idx = param_find(name);
+    if (idx != -1) {
+        if (params[idx].value != value) {
+            params[idx].value = value;
+            params[idx].version = ++param_version;
+            param_render(&params[idx]);
+            changed = true;
+        }
+    } else if (param_grow()) {
+        idx = param_count;
+        strncpy(params[idx].name, name, 16);
+        params[idx].name[16] = 0;
+        params[idx].value = value;
+        params[idx].version = ++param_version;
+        param_render(&params[idx]);
+        param_hash_insert(idx);
+        uint32_t pos = param_lower_bound(params[idx].name, 16);
+        memmove(&param_order[pos+1], &param_order[pos], (param_count-pos)*sizeof(param_order[0]));
+        param_order[pos] = idx;
+        param_count++;
+        changed = true;
+    }
+    pthread_rwlock_unlock(&param_lock);
+    if (changed) {
+        pthread_mutex_lock(&param_change_lock);
+        pthread_cond_broadcast(&param_change_cond);
+        pthread_mutex_unlock(&param_change_lock);
+    }
+    return changed;
+}
+
+/*
+  handle the reply to a _HASH_CHECK request
+ */
+static void param_hash_save(float value)
+{
+    uint32_t hash;
+    memcpy(&hash, &value, sizeof(hash));
+    if (param_verifying) {
+        param_verifying = false;
+        if (hash != param_set_hash) {
+            console_printf("cached parameters are out of date\n");
+            // keep showing the cached values while we download
+            param_download_reset(0);
+            return;
+        }
+        console_printf("cached parameters verified\n");
+    }
+    param_set_hash = hash;
+    param_hash_valid = true;
+}
+
+/*
+  pass a PARAM_VALUE to any bulk set waiting on that parameter
+ */
+static void param_set_reply(const char *name, float value)
+{
+    struct param_set_job *job;
+    uint32_t i;
+    bool found = false;
+    pthread_mutex_lock(&param_set_lock);
+    for (job=param_set_jobs; job; job=job->next) {
+        for (i=0; i<job->count; i++) {
+            struct param_set_entry *e = &job->entries[i];
+            if (e->state == PARAM_SET_SENT && strncmp(e->name, name, 16) == 0) {
+                e->have_reply = true;
+                e->reply = value;
+                found = true;
+            }
+        }
+    }
+    if (found) {
+        pthread_cond_broadcast(&param_set_cond);
+    }
+    pthread_mutex_unlock(&param_set_lock);
+}
+
+/*
+  save a PARAM_VALUE from the target system
+ */
+void mavlink_param_save(const mavlink_param_value_t *m)
+{
+    if (strncmp(m->param_id, "_HASH_CHECK", 16) == 0) {
+        param_hash_save(m->param_value);
+        return;
+    }
+    if (m->param_id[0] < 'A' || m->param_id[0] > 'Z') {
+        // invalid name
+        return;
+    }
+    if (param_store(m->param_id, m->param_value) && param_missing == 0) {
+        // the hash we have no longer matches our values
+        param_hash_valid = false;
+        param_hash_tries = 0;
+    }
+    param_set_reply(m->param_id, m->param_value);
+
+    param_last_value_ms = get_time_boot_ms();
+    if (m->param_count < 30000 &&
+        m->param_count > 0 &&
+        m->param_count != param_total) {
+        // first value, or the fc has a different parameter set
+        param_download_reset(m->param_count);
+    }
+    uint16_t i = m->param_index;
+    if (i < param_total && !(param_received[i/8] & (1U<<(i%8)))) {
+        param_received[i/8] |= 1U<<(i%8);
+        if (--param_missing == 0) {
+            console_printf("received all %u parameters\n", param_total);
+        }
+    }
+}
+
+/*
+  load the parameter set from a param.pck file. Each entry is a type
+  byte with flags in the top nibble, a byte giving the length of the
+  name (less one) in the top nibble and the number of leading
+  characters shared with the previous name in the bottom nibble, the
+  rest of the name, then the value and, if flagged, the default
+  value. Zero bytes between entries are padding
+ */
+static bool param_pck_load(const uint8_t *data, uint32_t len)
+{
+    static const uint8_t type_len[] = { 0, 1, 2, 4, 4 };
+    uint16_t magic, num_params, total_params, n = 0;
+    char name[17] = "";
+    uint32_t ofs = 6;
+
+    if (len < 6) {
+        return false;
+    }
+    memcpy(&magic, &data[0], 2);
+    memcpy(&num_params, &data[2], 2);
+    memcpy(&total_params, &data[4], 2);
+    if ((magic != PARAM_PCK_MAGIC && magic != PARAM_PCK_MAGIC_DEFAULTS) ||
+        num_params != total_params) {
+        return false;
+    }
+    while (ofs < len) {
+        if (data[ofs] == 0) {
+            ofs++;
+            continue;
+        }
+        if (ofs + 2 > len) {
+            return false;
+        }
+        uint8_t ptype = data[ofs] & 0x0F;
+        uint8_t flags = data[ofs] >> 4;
+        uint8_t name_len = (data[ofs+1] >> 4) + 1;
+        uint8_t common_len = data[ofs+1] & 0x0F;
+        if (ptype == 0 || ptype >= sizeof(type_len) ||
+            common_len + name_len > 16 ||
+            ofs + 2 + name_len + type_len[ptype] > len) {
+            return false;
+        }
+        ofs += 2;
+        memcpy(&name[common_len], &data[ofs], name_len);
+        name[common_len+name_len] = 0;
+        ofs += name_len;
+
+        float value;
+        switch (ptype) {
+        case 1:
+            value = (int8_t)data[ofs];
+            break;
+        case 2: {
+            int16_t v;
+            memcpy(&v, &data[ofs], sizeof(v));
+            value = v;
+            break;
+        }
+        case 3: {
+            int32_t v;
+            memcpy(&v, &data[ofs], sizeof(v));
+            value = v;
+            break;
+        }
+        default:
+            memcpy(&value, &data[ofs], sizeof(value));
+            break;
+        }
+        ofs += type_len[ptype];
+        if (flags & 1) {
+            // skip the default value
+            ofs += type_len[ptype];
+        }
+        param_store(name, value);
+        n++;
+    }
+    if (n != num_params) {
+        return false;
+    }
+    param_download_reset(total_params);
+    if (param_received == NULL) {
+        return false;
+    }
+    memset(param_received, 0xFF, talloc_get_size(param_received));
+    param_missing = 0;
+    console_printf("received all %u parameters with ftp\n", total_params);
+    return true;
+}
+
+/*
+  called from the select loop when the ftp download of param.pck ends
+ */
+static void param_ftp_done(const uint8_t *data, uint32_t len, bool ok, void *ptr)
+{
+    if (ok && param_total == 0 && param_pck_load(data, len)) {
+        param_ftp_state = PARAM_FTP_IDLE;
+        return;
+    }
+    if (param_total == 0) {
+        console_printf("ftp parameter download failed\n");
+        param_ftp_state = PARAM_FTP_FAILED;
+    } else {
+        param_ftp_state = PARAM_FTP_IDLE;
+    }
+}
+
+/*
+  request the parameters if we haven't started a download. Called on
+  each HEARTBEAT from the target system
+ */
+void mavlink_params_periodic(uint8_t sysid)
+{
+    if (param_verifying) {
+        if (param_hash_tries < PARAM_HASH_MAX_TRIES) {
+            param_hash_tries++;
+            mavlink_msg_param_request_read_send(MAVLINK_COMM_FC, sysid, 0, "_HASH_CHECK", -1);
+            return;
+        }
+        console_printf("no reply to _HASH_CHECK\n");
+        param_verifying = false;
+        param_download_reset(0);
+    }
+    if (param_total == 0 && param_ftp_state == PARAM_FTP_RUNNING) {
+        return;
+    }
+    if (param_total == 0 && param_ftp_state == PARAM_FTP_IDLE) {
+        if (mavlink_ftp_fetch(PARAM_FTP_FILE, param_ftp_done, NULL)) {
+            console_printf("requesting parameters with ftp\n");
+            param_ftp_state = PARAM_FTP_RUNNING;
+            return;
+        }
+    }
+    if (param_total == 0) {
+        console_printf("requesting parameters\n");
+        mavlink_msg_param_request_list_send(MAVLINK_COMM_FC,
+                                            sysid,
+                                            0);
+    }
+}
+
+/*
+  request missing parameters by index. Called regularly from the
+  select loop
+ */
+void mavlink_params_update(uint8_t sysid)
+{
+    uint32_t now = get_time_boot_ms();
+    float bytes_per_sec = uart2_get_baudrate() / 10 * PARAM_FETCH_LINK_SHARE;
+    param_fetch_tokens += bytes_per_sec * (now - param_fetch_update_ms) * 0.001f;
+    if (param_fetch_tokens > PARAM_FETCH_BURST * PARAM_VALUE_WIRE_LEN) {
+        param_fetch_tokens = PARAM_FETCH_BURST * PARAM_VALUE_WIRE_LEN;
+    }
+    param_fetch_update_ms = now;
+
+    if (param_total == 0 || param_verifying) {
+        return;
+    }
+    if (param_missing == 0) {
+        if (!param_hash_valid &&
+            param_hash_tries < PARAM_HASH_MAX_TRIES &&
+            now - param_hash_request_ms > 1000) {
+            // get the hash of the complete set for the cache
+            param_hash_tries++;
+            param_hash_request_ms = now;
+            mavlink_msg_param_request_read_send(MAVLINK_COMM_FC, sysid, 0, "_HASH_CHECK", -1);
+        }
+        return;
+    }
+    if (!param_fetching) {
+        // leave the list stream to finish before filling the gaps
+        if (now - param_last_value_ms < PARAM_STREAM_TIMEOUT_MS) {
+            return;
+        }
+        console_printf("fetching %u missing parameters\n", param_missing);
+        param_fetching = true;
+        param_fetch_index = 0;
+        param_fetch_pass_ms = 0;
+    }
+    if (param_fetch_index == 0 && now - param_fetch_pass_ms < PARAM_FETCH_RETRY_MS) {
+        return;
+    }
+    while (param_fetch_tokens >= PARAM_VALUE_WIRE_LEN && param_fetch_index < param_total) {
+        uint16_t i = param_fetch_index++;
+        if (param_received[i/8] & (1U<<(i%8))) {
+            continue;
+        }
+        mavlink_msg_param_request_read_send(MAVLINK_COMM_FC, sysid, 0, "", i);
+        param_fetch_tokens -= PARAM_VALUE_WIRE_LEN;
+    }
+    if (param_fetch_index == param_total) {
+        // wait for replies before going round again
+        param_fetch_index = 0;
+        param_fetch_pass_ms = now;
+    }
+}
+
+/*
+  take a copy of the complete parameter set, returning the number of
+  parameters, or 0 if we don't have a complete set with a known hash
+ */
+uint32_t mavlink_params_snapshot(void *ctx, struct mavlink_param_snapshot **snap, uint16_t *total, uint32_t *hash)
+{
+    uint32_t i, n = 0;
+    if (param_missing != 0 || param_total == 0 || !param_hash_valid) {
+        return 0;
+    }
+    pthread_rwlock_rdlock(&param_lock);
+    *snap = talloc_array(ctx, struct mavlink_param_snapshot, param_count);
+    if (*snap != NULL) {
+        for (i=0; i<param_count; i++) {
+            memcpy((*snap)[i].name, params[i].name, 16);
+            (*snap)[i].value = params[i].value;
+        }
+        n = param_count;
+    }
+    pthread_rwlock_unlock(&param_lock);
+    *total = param_total;
+    *hash = param_set_hash;
+    return n;
+}
+
+/*
+  restore a parameter set saved by an earlier run. The fc is asked for
+  its hash to check the set is still current, falling back to a full
+  download if it isn't
+ */
+void mavlink_params_restore(const struct mavlink_param_snapshot *snap, uint32_t n, uint16_t total, uint32_t hash)
+{
+    uint32_t i;
+    if (param_total != 0) {
+        // a download has already started
+        return;
+    }
+    for (i=0; i<n; i++) {
+        char name[17];
+        memcpy(name, snap[i].name, 16);
+        name[16] = 0;
+        param_store(name, snap[i].value);
+    }
+    param_download_reset(total);
+    if (param_received != NULL) {
+        memset(param_received, 0xFF, talloc_get_size(param_received));
+        param_missing = 0;
+    }
+    param_set_hash = hash;
+    param_verifying = true;
+    console_printf("restored %u parameters from cache\n", n);
+}
+
+/*
+  get a parameter value
+ */
+bool mavlink_param_get(const char *name, float *value)
+{
+    if (name[0] < 'A' || name[0] > 'Z') {
+        return false;
+    }
+    pthread_rwlock_rdlock(&param_lock);
+    int idx = param_find(name);
+    if (idx != -1) {
+        *value = params[idx].value;
+    }
+    pthread_rwlock_unlock(&param_lock);
+    return idx != -1;
+}
+
+/*
+  copy the json for parameters order[start..end) that pass a filter
+  into one buffer and send it. Caller must hold the read lock, which is
+  released before sending
+ */
+static void param_send_json(struct sock_buf *sock, uint32_t start, uint32_t end,
+                            bool (*match)(const struct param_entry *p, void *ptr), void *ptr,
+                            bool *first)
+{
+    uint32_t i;
+    size_t len = 0;
+    for (i=start; i<end; i++) {
+        const struct param_entry *p = &params[param_order[i]];
+        if (match == NULL || match(p, ptr)) {
+            len += p->json_len + 3;
+        }
+    }
+    char *buf = len?talloc_size(sock, len):NULL;
+    len = 0;
+    if (buf != NULL) {
+        for (i=start; i<end; i++) {
+            const struct param_entry *p = &params[param_order[i]];
+            if (match != NULL && !match(p, ptr)) {
+                continue;
+            }
+            if (!*first) {
+                memcpy(&buf[len], ",\r\n", 3);
+                len += 3;
+            }
+            *first = false;
+            memcpy(&buf[len], p->json, p->json_len);
+            len += p->json_len;
+        }
+    }
+    pthread_rwlock_unlock(&param_lock);
+    if (buf != NULL) {
+        sock_write(sock, buf, len);
+        talloc_free(buf);
+    }
+}
+
+/*
+  list all parameters starting with prefix as json, in name order
+ */
+void mavlink_param_list_json(struct sock_buf *sock, const char *prefix, bool *first)
+{
+    uint8_t plen = strnlen(prefix, 16);
+
+    pthread_rwlock_rdlock(&param_lock);
+    uint32_t start = param_lower_bound(prefix, plen);
+    uint32_t end = start;
+    while (end < param_count && strncmp(params[param_order[end]].name, prefix, plen) == 0) {
+        end++;
+    }
+    param_send_json(sock, start, end, NULL, NULL, first);
+}
+
+/*
+  pick the epoch for this run
+ */
+static void param_epoch_init(void)
+{
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd == -1 || read(fd, &param_epoch, sizeof(param_epoch)) != sizeof(param_epoch)) {
+        param_epoch = time(NULL) ^ (getpid() << 16);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    if (param_epoch == 0) {
+        param_epoch = 1;
+    }
+}
+
+/*
+  get the epoch of this run. Parameter versions only mean something
+  together with the epoch they were given out in
+ */
+uint32_t mavlink_param_epoch(void)
+{
+    pthread_once(&param_epoch_once, param_epoch_init);
+    return param_epoch;
+}
+
+/*
+  get the current parameter set version
+ */
+uint32_t mavlink_param_version(void)
+{
+    return __atomic_load_n(&param_version, __ATOMIC_ACQUIRE);
+}
+
+/*
+  wait up to wait_ms for the parameter set version to move past
+  version. Returns the current version
+ */
+uint32_t mavlink_param_wait(uint32_t version, uint32_t wait_ms)
+{
+    uint32_t start = get_time_boot_ms();
+    pthread_mutex_lock(&param_change_lock);
+    while (mavlink_param_version() == version) {
+        uint32_t elapsed = get_time_boot_ms() - start;
+        if (elapsed >= wait_ms ||
+            !cond_wait_ms(&param_change_cond, &param_change_lock, wait_ms - elapsed)) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&param_change_lock);
+    return mavlink_param_version();
+}
+
+struct param_changes_filter {
+    uint32_t since;
+    int num_prefixes;
+    char **prefixes;
+};
+
+static bool param_changed_match(const struct param_entry *p, void *ptr)
+{
+    const struct param_changes_filter *f = ptr;
+    int i;
+    if ((int32_t)(p->version - f->since) <= 0) {
+        return false;
+    }
+    for (i=0; i<f->num_prefixes; i++) {
+        if (strncmp(p->name, f->prefixes[i], strlen(f->prefixes[i])) == 0) {
+            return true;
+        }
+    }
+    return f->num_prefixes == 0;
+}
+
+/*
+  list parameters changed since a version, in name order, as json.
+  Only parameters starting with one of the prefixes are given, or all
+  parameters if there are no prefixes
+ */
+void mavlink_param_changes_json(struct sock_buf *sock, uint32_t since, int num_prefixes, char **prefixes, bool *first)
+{
+    struct param_changes_filter f = { since, num_prefixes, prefixes };
+    pthread_rwlock_rdlock(&param_lock);
+    param_send_json(sock, 0, param_count, param_changed_match, &f, first);
+}
+
+/*
+  set a parameter
+ */
+void mavlink_param_set(const char *name, float value)
+{
+    console_printf("Setting parameter %s to %f\n", name, value);
+    mavlink_msg_param_set_send(MAVLINK_COMM_FC, mavlink_target_system(), 0, name, value, 0);
+}
+
+/*
+  check if a value reported by the fc matches the value we set
+ */
+static bool param_value_equal(float v1, float v2)
+{
+    float diff = v1 > v2 ? v1 - v2 : v2 - v1;
+    float mag = v1 > 0 ? v1 : -v1;
+    return diff <= 1.0e-5f * (mag > 1 ? mag : 1);
+}
+
+/*
+  parse a parameter file into a job. Lines are NAME,VALUE or NAME
+  VALUE, with # comments. A name given more than once takes its last
+  value
+ */
+static bool param_set_parse(struct param_set_job *job, const char *text, uint32_t len)
+{
+    char *buf = talloc_strndup(job, text, len);
+    char *line, *saveptr = NULL;
+    if (buf == NULL) {
+        return false;
+    }
+    for (line=strtok_r(buf, "\r\n", &saveptr); line; line=strtok_r(NULL, "\r\n", &saveptr)) {
+        char *name, *value, *end;
+        char *hash = strchr(line, '#');
+        if (hash) {
+            *hash = 0;
+        }
+        name = line + strspn(line, " \t");
+        size_t nlen = strcspn(name, " \t,");
+        if (nlen == 0 || nlen > 16) {
+            continue;
+        }
+        value = name + nlen;
+        value += strspn(value, " \t,");
+        name[nlen] = 0;
+        float v = strtof(value, &end);
+        if (end == value) {
+            continue;
+        }
+        uint32_t i;
+        for (i=0; i<job->count; i++) {
+            if (strcmp(job->entries[i].name, name) == 0) {
+                break;
+            }
+        }
+        if (i == job->count) {
+            struct param_set_entry *e = talloc_realloc(job, job->entries, struct param_set_entry, job->count+1);
+            if (e == NULL) {
+                return false;
+            }
+            job->entries = e;
+            memset(&e[i], 0, sizeof(e[i]));
+            strcpy(e[i].name, name);
+            job->count++;
+        }
+        job->entries[i].value = v;
+    }
+    talloc_free(buf);
+    return true;
+}
+
+/*
+  run a bulk set, keeping a window of PARAM_SETs in flight until every
+  parameter is confirmed by a matching PARAM_VALUE or has run out of
+  retries. Called from a http thread, which blocks until done
+ */
+static void param_set_run(struct param_set_job *job)
+{
+    uint32_t next = 0, inflight = 0, i;
+    uint8_t sysid = mavlink_target_system();
+
+    pthread_mutex_lock(&param_set_lock);
+    while (next < job->count || inflight > 0) {
+        uint32_t now = get_time_boot_ms();
+        for (i=0; i<next; i++) {
+            struct param_set_entry *e = &job->entries[i];
+            if (e->state != PARAM_SET_SENT) {
+                continue;
+            }
+            if (e->have_reply && param_value_equal(e->reply, e->value)) {
+                e->state = PARAM_SET_OK;
+                inflight--;
+            } else if (now - e->sent_ms >= PARAM_SET_TIMEOUT_MS) {
+                if (e->tries >= PARAM_SET_MAX_TRIES) {
+                    e->state = PARAM_SET_FAILED;
+                    inflight--;
+                } else {
+                    e->tries++;
+                    e->sent_ms = now;
+                    mavlink_msg_param_set_send(MAVLINK_COMM_FC, sysid, 0, e->name, e->value, 0);
+                }
+            }
+        }
+        while (next < job->count && inflight < PARAM_SET_WINDOW) {
+            struct param_set_entry *e = &job->entries[next++];
+            float current;
+            if (mavlink_param_get(e->name, &current)) {
+                if (param_value_equal(current, e->value)) {
+                    e->state = PARAM_SET_UNCHANGED;
+                    continue;
+                }
+            } else if (param_total != 0 && param_missing == 0) {
+                // we have the full set and this isn't in it
+                e->state = PARAM_SET_UNKNOWN;
+                continue;
+            }
+            e->state = PARAM_SET_SENT;
+            e->tries = 1;
+            e->sent_ms = now;
+            mavlink_msg_param_set_send(MAVLINK_COMM_FC, sysid, 0, e->name, e->value, 0);
+            inflight++;
+        }
+        if (inflight == 0) {
+            continue;
+        }
+        cond_wait_ms(&param_set_cond, &param_set_lock, 100);
+    }
+    pthread_mutex_unlock(&param_set_lock);
+}
+
+/*
+  set all the parameters in a parameter file, giving the result for
+  each parameter as json
+ */
+void mavlink_param_set_bulk(struct sock_buf *sock, const char *text, uint32_t len)
+{
+    static const char *results[] = { "pending", "sent", "ok", "unchanged", "unknown", "failed" };
+    struct param_set_job *job = talloc_zero(sock, struct param_set_job);
+    struct param_set_job **jp;
+    uint32_t i, ok = 0;
+
+    sock_printf(sock, "[");
+    if (job == NULL || !param_set_parse(job, text, len)) {
+        sock_printf(sock, "]");
+        talloc_free(job);
+        return;
+    }
+    console_printf("Setting %u parameters\n", job->count);
+
+    pthread_mutex_lock(&param_set_lock);
+    job->next = param_set_jobs;
+    param_set_jobs = job;
+    pthread_mutex_unlock(&param_set_lock);
+
+    param_set_run(job);
+
+    pthread_mutex_lock(&param_set_lock);
+    for (jp=&param_set_jobs; *jp; jp=&(*jp)->next) {
+        if (*jp == job) {
+            *jp = job->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&param_set_lock);
+
+    for (i=0; i<job->count; i++) {
+        const struct param_set_entry *e = &job->entries[i];
+        if (e->state == PARAM_SET_OK || e->state == PARAM_SET_UNCHANGED) {
+            ok++;
+        }
+        sock_printf(sock, "%s{ \"name\" : \"%s\", \"value\" : %f, \"result\" : \"%s\", \"tries\" : %u",
+                    i==0?"":",\r\n", e->name, e->value, results[e->state], e->tries);
+        if (e->state == PARAM_SET_FAILED && e->have_reply) {
+            sock_printf(sock, ", \"reply\" : %f", e->reply);
+        }
+        sock_printf(sock, " }");
+    }
+    sock_printf(sock, "]");
+    console_printf("Set %u of %u parameters\n", ok, job->count);
+    talloc_free(job);
+}
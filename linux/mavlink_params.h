@@ -0,0 +1,24 @@
+#pragma once
+
+#include "../mavlink_core.h"
+
+struct sock_buf;
+
+struct mavlink_param_snapshot {
+    char name[16];
+    float value;
+};
+
+void mavlink_param_save(const mavlink_param_value_t *m);
+void mavlink_params_periodic(uint8_t sysid);
+void mavlink_params_update(uint8_t sysid);
+void mavlink_param_set(const char *name, float value);
+bool mavlink_param_get(const char *name, float *value);
+void mavlink_param_list_json(struct sock_buf *sock, const char *prefix, bool *first);
+uint32_t mavlink_params_snapshot(void *ctx, struct mavlink_param_snapshot **snap, uint16_t *total, uint32_t *hash);
+void mavlink_params_restore(const struct mavlink_param_snapshot *snap, uint32_t n, uint16_t total, uint32_t hash);
+uint32_t mavlink_param_epoch(void);
+uint32_t mavlink_param_version(void);
+uint32_t mavlink_param_wait(uint32_t version, uint32_t wait_ms);
+void mavlink_param_changes_json(struct sock_buf *sock, uint32_t since, int num_prefixes, char **prefixes, bool *first);
+void mavlink_param_set_bulk(struct sock_buf *sock, const char *text, uint32_t len);
@@ -0,0 +1,256 @@
+/*
+  replay a telemetry log as if it came from the fc
+
+  A thread reads the tlog and writes the frames into one end of a
+  socket pair. The other end is handed to the select loop in place of
+  the serial port, so frames go through exactly the same parse, handle
+  and forward path. Anything the server sends to the fc is read and
+  discarded so it can never block.
+
+  Frames are paced by their timestamps divided by the speed factor. A
+  speed of zero sends frames as fast as the server will take them.
+ */
+
+#include "../includes.h"
+#include "mavlink_replay.h"
+#include <poll.h>
+
+#define REPLAY_BUF_SIZE 4096
+
+struct replay_state {
+    FILE *f;
+    const char *file;
+    float speed;
+    bool loop;
+    int fd;
+    uint64_t frames;
+    uint64_t bytes;
+    uint32_t loops;
+};
+
+/*
+  get the current time in microseconds
+ */
+static uint64_t replay_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+  read one record, returning the frame length or 0 at end of file
+ */
+static uint16_t read_record(struct replay_state *r, uint64_t *usec, uint8_t *frame)
+{
+    uint8_t ts[8];
+    if (fread(ts, 1, 8, r->f) != 8) {
+        return 0;
+    }
+    while (true) {
+        int c = fgetc(r->f);
+        if (c == EOF) {
+            return 0;
+        }
+        if (c == MAVLINK_STX || c == MAVLINK_STX_MAVLINK1) {
+            frame[0] = c;
+            break;
+        }
+        // not a frame, resync one byte at a time
+        memmove(ts, ts+1, 7);
+        ts[7] = c;
+    }
+    if (fread(&frame[1], 1, 2, r->f) != 2) {
+        return 0;
+    }
+    uint16_t len;
+    if (frame[0] == MAVLINK_STX_MAVLINK1) {
+        len = 6 + frame[1] + 2;
+    } else {
+        len = MAVLINK_NUM_NON_PAYLOAD_BYTES + frame[1];
+        if (frame[2] & MAVLINK_IFLAG_SIGNED) {
+            len += MAVLINK_SIGNATURE_BLOCK_LEN;
+        }
+    }
+    if (fread(&frame[3], 1, len-3, r->f) != len-3) {
+        return 0;
+    }
+    *usec = 0;
+    uint8_t i;
+    for (i=0; i<8; i++) {
+        *usec = (*usec << 8) | ts[i];
+    }
+    return len;
+}
+
+/*
+  write to the server, discarding anything it sends back while we wait
+ */
+static bool replay_write(struct replay_state *r, const uint8_t *buf, uint32_t len)
+{
+    while (len > 0) {
+        struct pollfd pfd = { r->fd, POLLIN|POLLOUT, 0 };
+        if (poll(&pfd, 1, 1000) <= 0) {
+            continue;
+        }
+        if (pfd.revents & (POLLERR|POLLHUP)) {
+            return false;
+        }
+        if (pfd.revents & POLLIN) {
+            uint8_t discard[1024];
+            if (read(r->fd, discard, sizeof(discard)) <= 0) {
+                return false;
+            }
+        }
+        if (pfd.revents & POLLOUT) {
+            ssize_t n = write(r->fd, buf, len);
+            if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            buf += n;
+            len -= n;
+        }
+    }
+    return true;
+}
+
+/*
+  wait until a time, discarding anything the server sends
+ */
+static void replay_wait(struct replay_state *r, uint64_t until_us)
+{
+    while (true) {
+        uint64_t now = replay_time_us();
+        if (now >= until_us) {
+            return;
+        }
+        struct pollfd pfd = { r->fd, POLLIN, 0 };
+        uint64_t wait_ms = (until_us - now + 999) / 1000;
+        if (poll(&pfd, 1, wait_ms) > 0 && (pfd.revents & POLLIN)) {
+            uint8_t discard[1024];
+            if (read(r->fd, discard, sizeof(discard)) <= 0) {
+                return;
+            }
+        }
+    }
+}
+
+/*
+  replay thread
+ */
+static void *replay_thread(void *arg)
+{
+    struct replay_state *r = arg;
+    uint8_t buf[REPLAY_BUF_SIZE];
+    uint32_t buf_len = 0;
+    uint64_t start_us = replay_time_us();
+    uint64_t log_start_us = 0;
+    bool have_start = false;
+    uint64_t last_usec = 0;
+
+    while (true) {
+        uint64_t usec;
+        uint16_t len = read_record(r, &usec, &buf[buf_len]);
+        if (len == 0) {
+            if (buf_len > 0 && !replay_write(r, buf, buf_len)) {
+                break;
+            }
+            buf_len = 0;
+            if (!r->loop) {
+                break;
+            }
+            rewind(r->f);
+            r->loops++;
+            have_start = false;
+            continue;
+        }
+        r->frames++;
+        r->bytes += len;
+
+        if (r->speed > 0) {
+            // times going backwards, or a big gap, restart the clock
+            if (!have_start || usec < last_usec || usec - last_usec > 60*1000000ULL) {
+                start_us = replay_time_us();
+                log_start_us = usec;
+                have_start = true;
+            }
+            last_usec = usec;
+            uint64_t due_us = start_us + (uint64_t)((usec - log_start_us) / r->speed);
+            if (due_us > replay_time_us()) {
+                // send what we already have, then wait for this frame
+                if (buf_len > 0 && !replay_write(r, buf, buf_len)) {
+                    break;
+                }
+                memmove(buf, &buf[buf_len], len);
+                buf_len = 0;
+                replay_wait(r, due_us);
+            }
+        }
+        buf_len += len;
+        if (buf_len + MAVLINK_MAX_PACKET_LEN > sizeof(buf)) {
+            if (!replay_write(r, buf, buf_len)) {
+                break;
+            }
+            buf_len = 0;
+        }
+    }
+
+    uint64_t elapsed_us = replay_time_us() - start_us;
+    console_printf("Replay of %s finished: %llu frames %llu bytes %u loops\n",
+                   r->file, (unsigned long long)r->frames, (unsigned long long)r->bytes, r->loops);
+    if (!r->loop && r->speed <= 0 && elapsed_us > 0) {
+        console_printf("Replay rate %.0f frames/s\n", r->frames * 1.0e6 / elapsed_us);
+    }
+    fclose(r->f);
+
+    // keep draining so the server never blocks writing to us
+    while (true) {
+        replay_wait(r, replay_time_us() + 1000000);
+    }
+    return NULL;
+}
+
+/*
+  start replaying a tlog, returning the fd the select loop should read
+  frames from, or -1 on error
+ */
+int mavlink_replay_open(const char *file, float speed, bool loop)
+{
+    int sv[2];
+    pthread_t thread_id;
+
+    struct replay_state *r = talloc_zero(NULL, struct replay_state);
+    if (r == NULL) {
+        return -1;
+    }
+    r->file = talloc_strdup(r, file);
+    r->speed = speed;
+    r->loop = loop;
+    r->f = fopen(file, "r");
+    if (r->f == NULL) {
+        console_printf("Failed to open %s: %s\n", file, strerror(errno));
+        talloc_free(r);
+        return -1;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        console_printf("socketpair failed: %s\n", strerror(errno));
+        fclose(r->f);
+        talloc_free(r);
+        return -1;
+    }
+    r->fd = sv[1];
+    int perrno = pthread_create(&thread_id, NULL, replay_thread, r);
+    if (perrno != 0) {
+        console_printf("pthread_create failed: %s\n", strerror(perrno));
+        fclose(r->f);
+        close(sv[0]);
+        close(sv[1]);
+        talloc_free(r);
+        return -1;
+    }
+    pthread_detach(thread_id);
+    return sv[0];
+}
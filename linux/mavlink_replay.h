@@ -0,0 +1,5 @@
+#pragma once
+
+#include "../mavlink_core.h"
+
+int mavlink_replay_open(const char *file, float speed, bool loop);
@@ -0,0 +1,529 @@
+/*
+  long term min/max/mean rollups of key telemetry values
+
+  Values are accumulated into 1 second intervals, and each completed
+  interval is folded into the 10 second and then 60 second
+  intervals. Completed intervals are appended to blocks in a memory
+  mapped file so the history survives restarts. Each block holds a run
+  of consecutive intervals at one resolution, with the values for each
+  series stored as contiguous arrays.
+ */
+
+// for mremap()
+#define _GNU_SOURCE
+#include "../includes.h"
+#include "../mavlink_json.h"
+#include "mavlink_rollup.h"
+#include <math.h>
+
+#define ROLLUP_MAGIC 0x52554c4c
+#define ROLLUP_BLOCK_MAGIC 0x524c424b
+#define ROLLUP_VERSION 1
+#define ROLLUP_NUM_SERIES 8
+#define ROLLUP_NUM_LEVELS 3
+#define ROLLUP_BLOCK_LEN 64
+#define ROLLUP_NAME_LEN 48
+#define ROLLUP_HEADER_SIZE 1024
+
+/*
+  the values we keep rollups for. Changing this list starts a new file
+ */
+static const struct {
+    const char *msg_name;
+    const char *field_name;
+} series_names[ROLLUP_NUM_SERIES] = {
+    { "SYS_STATUS", "voltage_battery" },
+    { "SYS_STATUS", "current_battery" },
+    { "VFR_HUD", "alt" },
+    { "VFR_HUD", "groundspeed" },
+    { "GLOBAL_POSITION_INT", "relative_alt" },
+    { "VIBRATION", "vibration_x" },
+    { "VIBRATION", "vibration_y" },
+    { "VIBRATION", "vibration_z" },
+};
+
+static const uint16_t resolutions[ROLLUP_NUM_LEVELS] = { 1, 10, 60 };
+
+struct rollup_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t num_series;
+    uint32_t block_size;
+    char series[ROLLUP_NUM_SERIES][ROLLUP_NAME_LEN];
+};
+
+struct rollup_block {
+    uint32_t magic;
+    uint16_t resolution;
+    uint16_t count;
+    // unix time of the first interval
+    int64_t start;
+    float min[ROLLUP_NUM_SERIES][ROLLUP_BLOCK_LEN];
+    float max[ROLLUP_NUM_SERIES][ROLLUP_BLOCK_LEN];
+    float mean[ROLLUP_NUM_SERIES][ROLLUP_BLOCK_LEN];
+    uint32_t samples[ROLLUP_NUM_SERIES][ROLLUP_BLOCK_LEN];
+};
+
+/*
+  the interval currently being accumulated at each resolution
+ */
+struct rollup_accum {
+    int64_t start;
+    double sum[ROLLUP_NUM_SERIES];
+    float min[ROLLUP_NUM_SERIES];
+    float max[ROLLUP_NUM_SERIES];
+    uint32_t samples[ROLLUP_NUM_SERIES];
+};
+
+static struct {
+    const mavlink_message_info_t *msg;
+    const mavlink_field_info_t *field;
+} series[ROLLUP_NUM_SERIES];
+
+static pthread_mutex_t rollup_lock = PTHREAD_MUTEX_INITIALIZER;
+static int rollup_fd = -1;
+static uint8_t *rollup_map;
+static size_t rollup_size;
+static struct rollup_accum accum[ROLLUP_NUM_LEVELS];
+// offset of the block being appended to at each resolution, 0 for none
+static size_t current_block[ROLLUP_NUM_LEVELS];
+
+/*
+  get the level for a resolution, or -1
+ */
+static int resolution_level(uint16_t resolution)
+{
+    int i;
+    for (i=0; i<ROLLUP_NUM_LEVELS; i++) {
+        if (resolutions[i] == resolution) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+  check an existing file matches our layout
+ */
+static bool header_valid(const struct rollup_header *h)
+{
+    uint8_t i;
+    if (h->magic != ROLLUP_MAGIC ||
+        h->version != ROLLUP_VERSION ||
+        h->num_series != ROLLUP_NUM_SERIES ||
+        h->block_size != sizeof(struct rollup_block)) {
+        return false;
+    }
+    for (i=0; i<ROLLUP_NUM_SERIES; i++) {
+        char name[ROLLUP_NAME_LEN];
+        snprintf(name, sizeof(name), "%s.%s", series_names[i].msg_name, series_names[i].field_name);
+        if (strncmp(h->series[i], name, ROLLUP_NAME_LEN) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+  open or create the rollup file. Existing rollups are kept and
+  appended to
+ */
+bool mavlink_rollup_init(const char *filename)
+{
+    uint8_t i;
+    struct stat st;
+
+    for (i=0; i<ROLLUP_NUM_SERIES; i++) {
+        series[i].msg = mavlink_message_info_by_name(series_names[i].msg_name, NULL);
+        if (series[i].msg) {
+            series[i].field = mavlink_field_info_by_name(series[i].msg, series_names[i].field_name);
+        }
+        if (series[i].field == NULL || series[i].field->array_length != 0) {
+            console_printf("rollup: unknown field %s.%s\n", series_names[i].msg_name, series_names[i].field_name);
+            series[i].msg = NULL;
+            series[i].field = NULL;
+        }
+    }
+
+    int fd = open(filename, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+    if (fd == -1) {
+        console_printf("rollup: failed to open %s: %s\n", filename, strerror(errno));
+        return false;
+    }
+    if (fstat(fd, &st) != 0) {
+        goto failed;
+    }
+    size_t size = st.st_size;
+    bool new_file = (size < ROLLUP_HEADER_SIZE);
+    if (new_file) {
+        size = ROLLUP_HEADER_SIZE;
+    } else {
+        // drop any partly written block at the end
+        size -= (size - ROLLUP_HEADER_SIZE) % sizeof(struct rollup_block);
+    }
+    if (ftruncate(fd, size) != 0) {
+        goto failed;
+    }
+    uint8_t *map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        goto failed;
+    }
+    struct rollup_header *h = (struct rollup_header *)map;
+    if (new_file) {
+        memset(map, 0, ROLLUP_HEADER_SIZE);
+        h->magic = ROLLUP_MAGIC;
+        h->version = ROLLUP_VERSION;
+        h->num_series = ROLLUP_NUM_SERIES;
+        h->block_size = sizeof(struct rollup_block);
+        for (i=0; i<ROLLUP_NUM_SERIES; i++) {
+            snprintf(h->series[i], ROLLUP_NAME_LEN, "%s.%s", series_names[i].msg_name, series_names[i].field_name);
+        }
+    } else if (!header_valid(h)) {
+        console_printf("rollup: %s has a different layout, not using it\n", filename);
+        munmap(map, size);
+        goto failed;
+    }
+
+    // find the last block at each resolution so we can carry on filling it
+    size_t ofs;
+    for (ofs=ROLLUP_HEADER_SIZE; ofs<size; ofs+=sizeof(struct rollup_block)) {
+        const struct rollup_block *b = (const struct rollup_block *)(map + ofs);
+        int level = resolution_level(b->resolution);
+        if (b->magic == ROLLUP_BLOCK_MAGIC && level != -1) {
+            current_block[level] = ofs;
+        }
+    }
+
+    rollup_fd = fd;
+    rollup_map = map;
+    rollup_size = size;
+    return true;
+
+failed:
+    console_printf("rollup: failed to setup %s\n", filename);
+    close(fd);
+    return false;
+}
+
+/*
+  get a block to append an interval to, adding a block to the file if
+  the interval doesn't follow on from the current block
+ */
+static struct rollup_block *block_for_interval(uint8_t level, int64_t start)
+{
+    if (current_block[level] != 0) {
+        struct rollup_block *b = (struct rollup_block *)(rollup_map + current_block[level]);
+        if (b->count < ROLLUP_BLOCK_LEN &&
+            start == b->start + b->count * (int64_t)resolutions[level]) {
+            return b;
+        }
+    }
+    size_t new_size = rollup_size + sizeof(struct rollup_block);
+    if (ftruncate(rollup_fd, new_size) != 0) {
+        return NULL;
+    }
+    uint8_t *map = mremap(rollup_map, rollup_size, new_size, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    rollup_map = map;
+    current_block[level] = rollup_size;
+    rollup_size = new_size;
+    struct rollup_block *b = (struct rollup_block *)(rollup_map + current_block[level]);
+    memset(b, 0, sizeof(*b));
+    b->magic = ROLLUP_BLOCK_MAGIC;
+    b->resolution = resolutions[level];
+    b->start = start;
+    return b;
+}
+
+/*
+  start a new interval at a level
+ */
+static void accum_reset(struct rollup_accum *a, int64_t start)
+{
+    memset(a, 0, sizeof(*a));
+    a->start = start;
+}
+
+static void accum_advance(uint8_t level, int64_t t);
+
+/*
+  store a completed interval and fold it into the next level
+ */
+static void accum_complete(uint8_t level)
+{
+    const struct rollup_accum *a = &accum[level];
+    uint8_t i;
+    bool have_samples = false;
+    for (i=0; i<ROLLUP_NUM_SERIES; i++) {
+        if (a->samples[i] != 0) {
+            have_samples = true;
+        }
+    }
+    if (!have_samples) {
+        return;
+    }
+
+    struct rollup_block *b = block_for_interval(level, a->start);
+    if (b != NULL) {
+        uint16_t idx = b->count;
+        for (i=0; i<ROLLUP_NUM_SERIES; i++) {
+            b->samples[i][idx] = a->samples[i];
+            if (a->samples[i] != 0) {
+                b->min[i][idx] = a->min[i];
+                b->max[i][idx] = a->max[i];
+                b->mean[i][idx] = a->sum[i] / a->samples[i];
+            }
+        }
+        b->count = idx+1;
+    }
+
+    if (level+1 < ROLLUP_NUM_LEVELS) {
+        accum_advance(level+1, a->start);
+        struct rollup_accum *next = &accum[level+1];
+        for (i=0; i<ROLLUP_NUM_SERIES; i++) {
+            if (a->samples[i] == 0) {
+                continue;
+            }
+            if (next->samples[i] == 0 || a->min[i] < next->min[i]) {
+                next->min[i] = a->min[i];
+            }
+            if (next->samples[i] == 0 || a->max[i] > next->max[i]) {
+                next->max[i] = a->max[i];
+            }
+            next->sum[i] += a->sum[i];
+            next->samples[i] += a->samples[i];
+        }
+    }
+}
+
+/*
+  move the interval at a level on to the one containing time t
+ */
+static void accum_advance(uint8_t level, int64_t t)
+{
+    int64_t start = t - t % resolutions[level];
+    if (accum[level].start == start) {
+        return;
+    }
+    accum_complete(level);
+    accum_reset(&accum[level], start);
+}
+
+/*
+  add the values from a message to the rollups
+ */
+void mavlink_rollup_update(const mavlink_message_t *msg)
+{
+    uint8_t i;
+    if (rollup_map == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&rollup_lock);
+    accum_advance(0, time(NULL));
+    struct rollup_accum *a = &accum[0];
+    for (i=0; i<ROLLUP_NUM_SERIES; i++) {
+        if (series[i].msg == NULL || series[i].msg->msgid != msg->msgid) {
+            continue;
+        }
+        float v = mavlink_field_double(msg, series[i].field);
+        if (a->samples[i] == 0 || v < a->min[i]) {
+            a->min[i] = v;
+        }
+        if (a->samples[i] == 0 || v > a->max[i]) {
+            a->max[i] = v;
+        }
+        a->sum[i] += v;
+        a->samples[i]++;
+    }
+    pthread_mutex_unlock(&rollup_lock);
+}
+
+/*
+  find a series by its MSG.field name
+ */
+static int series_index(const char *name)
+{
+    int i;
+    for (i=0; i<ROLLUP_NUM_SERIES; i++) {
+        size_t len = strlen(series_names[i].msg_name);
+        if (strncmp(name, series_names[i].msg_name, len) == 0 &&
+            name[len] == '.' &&
+            strcmp(&name[len+1], series_names[i].field_name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+  intervals copied out of the file for a query, so they can be printed
+  without holding rollup_lock
+ */
+struct rollup_copy {
+    uint32_t count;
+    int64_t *t;
+    uint8_t num_series;
+    int series[ROLLUP_NUM_SERIES];
+    // min, max and mean of each series, NAN where it had no samples
+    float *values[ROLLUP_NUM_SERIES][3];
+    // largest magnitude of any value, to size the output
+    float max_abs;
+};
+
+static const char *array_names[3] = { "min", "max", "mean" };
+
+/*
+  copy the intervals at a level starting at or after since. Caller
+  must hold rollup_lock
+ */
+static bool rollup_copy(void *ctx, struct rollup_copy *c, uint8_t level, int64_t since)
+{
+    size_t ofs;
+    uint32_t n = 0;
+    uint8_t k, j;
+
+    for (ofs=ROLLUP_HEADER_SIZE; ofs<rollup_size; ofs+=sizeof(struct rollup_block)) {
+        const struct rollup_block *b = (const struct rollup_block *)(rollup_map + ofs);
+        uint16_t i;
+        if (b->magic != ROLLUP_BLOCK_MAGIC || b->resolution != resolutions[level]) {
+            continue;
+        }
+        for (i=0; i<b->count; i++) {
+            if (b->start + i * (int64_t)resolutions[level] >= since) {
+                n++;
+            }
+        }
+    }
+
+    c->t = talloc_array(ctx, int64_t, n+1);
+    if (c->t == NULL) {
+        return false;
+    }
+    for (k=0; k<c->num_series; k++) {
+        for (j=0; j<3; j++) {
+            c->values[k][j] = talloc_array(ctx, float, n+1);
+            if (c->values[k][j] == NULL) {
+                return false;
+            }
+        }
+    }
+
+    c->count = 0;
+    c->max_abs = 0;
+    for (ofs=ROLLUP_HEADER_SIZE; ofs<rollup_size && c->count<n; ofs+=sizeof(struct rollup_block)) {
+        const struct rollup_block *b = (const struct rollup_block *)(rollup_map + ofs);
+        uint16_t i;
+        if (b->magic != ROLLUP_BLOCK_MAGIC || b->resolution != resolutions[level]) {
+            continue;
+        }
+        for (i=0; i<b->count && c->count<n; i++) {
+            int64_t t = b->start + i * (int64_t)resolutions[level];
+            if (t < since) {
+                continue;
+            }
+            c->t[c->count] = t;
+            for (k=0; k<c->num_series; k++) {
+                int s = c->series[k];
+                const float v[3] = { b->min[s][i], b->max[s][i], b->mean[s][i] };
+                for (j=0; j<3; j++) {
+                    if (b->samples[s][i] == 0 || isnan(v[j]) || isinf(v[j])) {
+                        c->values[k][j][c->count] = NAN;
+                        continue;
+                    }
+                    c->values[k][j][c->count] = v[j];
+                    if (fabsf(v[j]) > c->max_abs) {
+                        c->max_abs = fabsf(v[j]);
+                    }
+                }
+            }
+            c->count++;
+        }
+    }
+    return true;
+}
+
+/*
+  print rollups at a resolution as JSON, for intervals starting at or
+  after the unix time since. The "t" array gives the start time of
+  each interval, and each series has min, max and mean arrays, with
+  null for intervals where the series had no samples. With no series
+  names all series are given
+ */
+bool mavlink_rollup_json(struct sock_buf *sock, uint16_t resolution, int64_t since, int num_names, char **names)
+{
+    int level = resolution_level(resolution);
+    struct rollup_copy c;
+    int i;
+    uint8_t k, j;
+    uint32_t n;
+
+    if (rollup_map == NULL || level == -1) {
+        return false;
+    }
+    memset(&c, 0, sizeof(c));
+    for (i=0; i<(num_names?num_names:ROLLUP_NUM_SERIES); i++) {
+        int s = num_names?series_index(names[i]):i;
+        if (s == -1) {
+            continue;
+        }
+        for (k=0; k<c.num_series && c.series[k] != s; k++) ;
+        if (k == c.num_series) {
+            c.series[c.num_series++] = s;
+        }
+    }
+
+    void *tmp = talloc_new(sock);
+    if (tmp == NULL) {
+        return false;
+    }
+    pthread_mutex_lock(&rollup_lock);
+    bool ok = rollup_copy(tmp, &c, level, since);
+    pthread_mutex_unlock(&rollup_lock);
+    if (!ok) {
+        talloc_free(tmp);
+        return false;
+    }
+
+    // size the reply once: the widest a value can print as, plus a comma
+    int width = snprintf(NULL, 0, "%f", -(double)c.max_abs);
+    if (width < 4) {
+        width = 4;
+    }
+    size_t size = 64 + c.count * 21 +
+        c.num_series * (ROLLUP_NAME_LEN + 64 + 3 * c.count * (size_t)(width + 1));
+    char *buf = talloc_size(tmp, size);
+    if (buf == NULL) {
+        talloc_free(tmp);
+        return false;
+    }
+    size_t len = 0;
+    len += snprintf(&buf[len], size-len, "{ \"resolution\" : %u, \"t\" : [", resolution);
+    for (n=0; n<c.count; n++) {
+        len += snprintf(&buf[len], size-len, "%s%lld", n?",":"", (long long)c.t[n]);
+    }
+    len += snprintf(&buf[len], size-len, "]");
+    for (k=0; k<c.num_series; k++) {
+        int s = c.series[k];
+        len += snprintf(&buf[len], size-len, ",\r\n\"%s.%s\" : { ",
+                        series_names[s].msg_name, series_names[s].field_name);
+        for (j=0; j<3; j++) {
+            len += snprintf(&buf[len], size-len, "%s\"%s\" : [", j?", ":"", array_names[j]);
+            for (n=0; n<c.count; n++) {
+                float v = c.values[k][j][n];
+                if (isnan(v)) {
+                    len += snprintf(&buf[len], size-len, "%snull", n?",":"");
+                } else {
+                    len += snprintf(&buf[len], size-len, "%s%f", n?",":"", v);
+                }
+            }
+            len += snprintf(&buf[len], size-len, "]");
+        }
+        len += snprintf(&buf[len], size-len, " }");
+    }
+    len += snprintf(&buf[len], size-len, " }");
+    sock_write(sock, buf, len);
+    talloc_free(tmp);
+    return true;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "../mavlink_core.h"
+
+struct sock_buf;
+
+bool mavlink_rollup_init(const char *filename);
+void mavlink_rollup_update(const mavlink_message_t *msg);
+bool mavlink_rollup_json(struct sock_buf *sock, uint16_t resolution, int64_t since, int num_names, char **names);
@@ -0,0 +1,909 @@
+/*
+  MAVLink router between the flight controller and any number of
+  UDP, TCP and serial endpoints
+
+  Routes are learnt from the source sysid/compid of every frame
+  received on a link. Frames with no target, or a target system of
+  zero, go to every other link. Targeted frames only go to the links
+  where the target has been seen, or to the flight controller if the
+  target is unknown. Frames of messages not in our dialect can't be
+  checked or targeted, so they go to every other link too.
+
+  Endpoints are given on the command line, e.g.
+    udp:192.168.1.10:14550    send to an address, replying peers are followed
+    udpin:14550               listen, and send to whoever last sent to us
+    bcast:14550               broadcast to 255.255.255.255 (or bcast:IP:PORT)
+    tcp:192.168.1.10:5760     connect out, reconnecting when dropped
+    tcpin:5760                accept any number of clients
+    serial:/dev/ttyUSB0:57600 serial port
+
+  A udp endpoint with ",pack" on the end, e.g. udp:192.168.1.10:14550,pack,
+  gets several frames per datagram. Only use it with a GCS that parses
+  datagrams as a byte stream.
+
+  Output is queued and written once per select loop by
+  mavlink_router_flush(), with sendmmsg() for udp. Tcp and serial
+  endpoints with output left over, or a connect in progress, are also
+  selected for writing so they are seen to as soon as they are ready.
+  Udp input is read in batches with recvmmsg().
+
+  Frames are passed on as the bytes they arrived as, so signed frames
+  stay valid and nothing is encoded more than once.
+
+  Everything runs from the select loop. The lock is only for status
+  requests from web threads.
+ */
+
+#define _GNU_SOURCE
+#include "../includes.h"
+#include "mavlink_router.h"
+#include "mavlink_tlog.h"
+#include <arpa/inet.h>
+#include <poll.h>
+
+#define ROUTER_MAX_ROUTES 64
+#define ROUTER_RECONNECT_MS 2000
+// pending output for an endpoint
+#define ROUTER_TXBUF_SIZE (64*1024)
+// datagrams per recvmmsg()/sendmmsg() call
+#define ROUTER_UDP_BATCH 32
+// largest datagram made when packing frames
+#define ROUTER_UDP_MTU 1400
+
+extern const mavlink_msg_entry_t *mavlink_get_msg_entry(uint32_t msgid);
+
+enum endpoint_type {
+    EP_UDP_OUT,
+    EP_UDP_IN,
+    EP_UDP_BCAST,
+    EP_TCP_OUT,
+    EP_TCP_LISTEN,
+    EP_TCP_CLIENT,
+    EP_SERIAL,
+};
+
+static const char *type_names[] = {
+    "udp", "udpin", "bcast", "tcp", "tcpin", "tcpclient", "serial"
+};
+
+struct endpoint {
+    struct endpoint *next;
+    enum endpoint_type type;
+    char *name;
+    int fd;
+    bool connected;
+    // destination for udp endpoints
+    struct sockaddr_in addr;
+    bool have_addr;
+    // for reopening tcp and serial endpoints
+    char *path;
+    unsigned baudrate;
+    uint32_t last_open_ms;
+    // parser state, kept per endpoint
+    mavlink_message_t rxmsg;
+    mavlink_status_t rxstatus;
+    struct mavlink_raw_frame rxraw;
+    uint8_t *txbuf;
+    uint32_t txlen;
+    // queued udp datagrams, packed one after the other in txbuf
+    bool pack;
+    uint8_t num_dgrams;
+    uint16_t dgram_len[ROUTER_UDP_BATCH];
+    uint8_t dgram_frames[ROUTER_UDP_BATCH];
+    // set while routing one frame, so no endpoint gets it twice
+    uint32_t mark;
+    struct {
+        uint64_t rx_frames;
+        uint64_t rx_bytes;
+        uint64_t rx_errors;
+        uint64_t tx_frames;
+        uint64_t tx_bytes;
+        uint64_t tx_dropped;
+    } stats;
+};
+
+struct route {
+    uint8_t sysid;
+    uint8_t compid;
+    // NULL for the flight controller
+    struct endpoint *ep;
+};
+
+static pthread_mutex_t router_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct endpoint *endpoints;
+static struct route routes[ROUTER_MAX_ROUTES];
+static unsigned num_routes;
+static uint32_t mark_counter;
+
+static struct {
+    uint64_t rx_frames;
+    uint64_t tx_frames;
+    uint64_t unroutable;
+} fc_stats;
+
+/*
+  parse [ip:]port, with a default ip
+ */
+static bool parse_addr(const char *s, const char *default_ip, struct sockaddr_in *addr)
+{
+    char ip[64];
+    const char *colon = strrchr(s, ':');
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    if (colon == NULL) {
+        if (default_ip == NULL) {
+            return false;
+        }
+        strncpy(ip, default_ip, sizeof(ip)-1);
+        ip[sizeof(ip)-1] = 0;
+        addr->sin_port = htons(atoi(s));
+    } else {
+        size_t len = colon - s;
+        if (len >= sizeof(ip)) {
+            return false;
+        }
+        memcpy(ip, s, len);
+        ip[len] = 0;
+        addr->sin_port = htons(atoi(colon+1));
+    }
+    if (addr->sin_port == 0) {
+        return false;
+    }
+    return inet_pton(AF_INET, ip, &addr->sin_addr.s_addr) == 1;
+}
+
+/*
+  make a fd non-blocking
+ */
+static void set_nonblocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+/*
+  open a udp socket, bound to an address if given
+ */
+static int udp_socket(const struct sockaddr_in *bind_addr, bool broadcast)
+{
+    struct sockaddr_in sock;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *)&one, sizeof(one));
+    if (broadcast) {
+        setsockopt(fd, SOL_SOCKET, SO_BROADCAST, (char *)&one, sizeof(one));
+    }
+    memset(&sock, 0, sizeof(sock));
+    sock.sin_family = AF_INET;
+    if (bind_addr != NULL) {
+        sock = *bind_addr;
+    }
+    if (bind(fd, (struct sockaddr *)&sock, sizeof(sock)) != 0) {
+        close(fd);
+        return -1;
+    }
+    set_nonblocking(fd);
+    return fd;
+}
+
+/*
+  start a non-blocking tcp connection
+ */
+static void tcp_connect(struct endpoint *ep)
+{
+    int one = 1;
+    ep->last_open_ms = get_time_boot_ms();
+    ep->connected = false;
+    ep->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (ep->fd == -1) {
+        return;
+    }
+    setsockopt(ep->fd, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(one));
+    set_nonblocking(ep->fd);
+    if (connect(ep->fd, (struct sockaddr *)&ep->addr, sizeof(ep->addr)) == 0) {
+        ep->connected = true;
+    } else if (errno != EINPROGRESS) {
+        close(ep->fd);
+        ep->fd = -1;
+    }
+}
+
+/*
+  open a serial endpoint
+ */
+static void serial_open(struct endpoint *ep)
+{
+    ep->last_open_ms = get_time_boot_ms();
+    ep->fd = mavlink_serial_open(ep->path, ep->baudrate);
+    if (ep->fd != -1) {
+        set_nonblocking(ep->fd);
+        ep->connected = true;
+    }
+}
+
+/*
+  close an endpoint's fd. Endpoints other than accepted tcp clients
+  are reopened later
+ */
+static void endpoint_close(struct endpoint *ep)
+{
+    if (ep->fd != -1) {
+        close(ep->fd);
+        ep->fd = -1;
+    }
+    ep->connected = false;
+    ep->txlen = 0;
+    ep->num_dgrams = 0;
+    ep->rxstatus.parse_state = MAVLINK_PARSE_STATE_IDLE;
+    ep->rxraw.len = 0;
+}
+
+/*
+  keep a byte of the frame being parsed. Call after the parser has
+  seen the byte, so a start byte the parser restarts on begins a new
+  frame
+ */
+void mavlink_raw_frame_byte(struct mavlink_raw_frame *raw, const mavlink_status_t *status, uint8_t c)
+{
+    if (status->parse_state == MAVLINK_PARSE_STATE_GOT_STX) {
+        raw->buf[0] = c;
+        raw->len = 1;
+    } else if (raw->len < sizeof(raw->buf)) {
+        raw->buf[raw->len++] = c;
+    }
+}
+
+/*
+  see if the kept bytes are the whole of a parsed frame
+ */
+static bool raw_frame_whole(const struct mavlink_raw_frame *raw, const mavlink_message_t *msg)
+{
+    uint16_t len;
+    if (msg->magic == MAVLINK_STX_MAVLINK1) {
+        len = 6 + msg->len + 2;
+    } else {
+        len = MAVLINK_NUM_NON_PAYLOAD_BYTES + msg->len;
+        if (msg->incompat_flags & MAVLINK_IFLAG_SIGNED) {
+            len += MAVLINK_SIGNATURE_BLOCK_LEN;
+        }
+    }
+    return raw->len == len && raw->buf[0] == msg->magic;
+}
+
+/*
+  check the kept bytes once a frame is parsed, encoding the frame
+  again if they are not the whole frame
+ */
+void mavlink_raw_frame_finish(struct mavlink_raw_frame *raw, const mavlink_message_t *msg)
+{
+    if (!raw_frame_whole(raw, msg)) {
+        raw->len = mavlink_msg_to_send_buffer(raw->buf, msg);
+    }
+}
+
+/*
+  add an endpoint from a spec like udp:1.2.3.4:14550
+ */
+bool mavlink_router_add(const char *spec)
+{
+    struct endpoint *ep = talloc_zero(NULL, struct endpoint);
+    if (ep == NULL) {
+        return false;
+    }
+    ep->name = talloc_strdup(ep, spec);
+    ep->fd = -1;
+
+    // strip options
+    char *options = strchr(ep->name, ',');
+    if (options != NULL) {
+        spec = talloc_strndup(ep, ep->name, options - ep->name);
+        if (strcmp(options, ",pack") != 0) {
+            console_printf("Bad endpoint options %s\n", options);
+            talloc_free(ep);
+            return false;
+        }
+        ep->pack = true;
+    }
+    const char *colon = strchr(spec, ':');
+    if (colon == NULL) {
+        console_printf("Bad endpoint %s\n", spec);
+        talloc_free(ep);
+        return false;
+    }
+    const char *arg = colon+1;
+    size_t tlen = colon - spec;
+    bool ok = false;
+
+    if (strncmp(spec, "udp", tlen) == 0 && tlen == 3) {
+        ep->type = EP_UDP_OUT;
+        if (parse_addr(arg, NULL, &ep->addr)) {
+            ep->have_addr = true;
+            ep->fd = udp_socket(NULL, false);
+            ok = (ep->fd != -1);
+        }
+    } else if (strncmp(spec, "udpin", tlen) == 0 && tlen == 5) {
+        struct sockaddr_in bind_addr;
+        ep->type = EP_UDP_IN;
+        if (parse_addr(arg, "0.0.0.0", &bind_addr)) {
+            ep->fd = udp_socket(&bind_addr, false);
+            ok = (ep->fd != -1);
+        }
+    } else if (strncmp(spec, "bcast", tlen) == 0 && tlen == 5) {
+        ep->type = EP_UDP_BCAST;
+        if (parse_addr(arg, "255.255.255.255", &ep->addr)) {
+            ep->have_addr = true;
+            ep->fd = udp_socket(NULL, true);
+            ok = (ep->fd != -1);
+        }
+    } else if (strncmp(spec, "tcp", tlen) == 0 && tlen == 3) {
+        ep->type = EP_TCP_OUT;
+        if (parse_addr(arg, NULL, &ep->addr)) {
+            tcp_connect(ep);
+            ok = true;
+        }
+    } else if (strncmp(spec, "tcpin", tlen) == 0 && tlen == 5) {
+        struct sockaddr_in bind_addr;
+        int one = 1;
+        ep->type = EP_TCP_LISTEN;
+        if (parse_addr(arg, "0.0.0.0", &bind_addr) &&
+            (ep->fd = socket(AF_INET, SOCK_STREAM, 0)) != -1) {
+            setsockopt(ep->fd, SOL_SOCKET, SO_REUSEADDR, (char *)&one, sizeof(one));
+            ok = (bind(ep->fd, (struct sockaddr *)&bind_addr, sizeof(bind_addr)) == 0 &&
+                  listen(ep->fd, 5) == 0);
+        }
+    } else if (strncmp(spec, "serial", tlen) == 0 && tlen == 6) {
+        const char *baud = strrchr(arg, ':');
+        ep->type = EP_SERIAL;
+        if (baud != NULL) {
+            ep->path = talloc_strndup(ep, arg, baud - arg);
+            ep->baudrate = atoi(baud+1);
+            serial_open(ep);
+            ok = (ep->fd != -1);
+        }
+    }
+
+    if (!ok) {
+        console_printf("Failed to open endpoint %s\n", spec);
+        if (ep->fd != -1) {
+            close(ep->fd);
+        }
+        talloc_free(ep);
+        return false;
+    }
+    if (ep->type != EP_TCP_LISTEN) {
+        ep->txbuf = talloc_size(ep, ROUTER_TXBUF_SIZE);
+    }
+
+    pthread_mutex_lock(&router_lock);
+    ep->next = endpoints;
+    endpoints = ep;
+    pthread_mutex_unlock(&router_lock);
+    return true;
+}
+
+/*
+  remember which link a sysid/compid was seen on
+ */
+static void learn(const mavlink_message_t *msg, struct endpoint *ep)
+{
+    unsigned i;
+    if (msg->sysid == 0) {
+        return;
+    }
+    for (i=0; i<num_routes; i++) {
+        if (routes[i].sysid == msg->sysid && routes[i].compid == msg->compid) {
+            routes[i].ep = ep;
+            return;
+        }
+    }
+    if (num_routes < ROUTER_MAX_ROUTES) {
+        routes[num_routes].sysid = msg->sysid;
+        routes[num_routes].compid = msg->compid;
+        routes[num_routes].ep = ep;
+        num_routes++;
+    }
+}
+
+/*
+  forget routes through an endpoint
+ */
+static void forget(struct endpoint *ep)
+{
+    unsigned i;
+    for (i=0; i<num_routes; ) {
+        if (routes[i].ep == ep) {
+            routes[i] = routes[--num_routes];
+        } else {
+            i++;
+        }
+    }
+}
+
+/*
+  get the target system and component of a message, or -1 if it has none
+ */
+static void get_target(const mavlink_message_t *msg, int16_t *sysid, int16_t *compid)
+{
+    const mavlink_msg_entry_t *e = mavlink_get_msg_entry(msg->msgid);
+    *sysid = -1;
+    *compid = -1;
+    if (e == NULL) {
+        return;
+    }
+    if (e->flags & MAV_MSG_ENTRY_FLAG_HAVE_TARGET_SYSTEM) {
+        *sysid = _MAV_RETURN_uint8_t(msg, e->target_system_ofs);
+    }
+    if (e->flags & MAV_MSG_ENTRY_FLAG_HAVE_TARGET_COMPONENT) {
+        *compid = _MAV_RETURN_uint8_t(msg, e->target_component_ofs);
+    }
+}
+
+/*
+  non-blocking write to a stream endpoint
+ */
+static ssize_t send_or_write(struct endpoint *ep, const uint8_t *buf, size_t len)
+{
+    if (ep->type == EP_SERIAL) {
+        return write(ep->fd, buf, len);
+    }
+    return send(ep->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/*
+  try to write out pending data on a stream endpoint
+ */
+static void stream_flush(struct endpoint *ep)
+{
+    if (ep->txlen == 0 || !ep->connected) {
+        return;
+    }
+    ssize_t n = send_or_write(ep, ep->txbuf, ep->txlen);
+    if (n > 0) {
+        memmove(ep->txbuf, &ep->txbuf[n], ep->txlen - n);
+        ep->txlen -= n;
+    }
+}
+
+/*
+  send the queued datagrams on a udp endpoint
+ */
+static void udp_flush(struct endpoint *ep)
+{
+    struct mmsghdr msgs[ROUTER_UDP_BATCH];
+    struct iovec iov[ROUTER_UDP_BATCH];
+    uint32_t ofs = 0;
+    unsigned i, sent = 0;
+
+    if (ep->num_dgrams == 0) {
+        return;
+    }
+    memset(msgs, 0, sizeof(msgs[0]) * ep->num_dgrams);
+    for (i=0; i<ep->num_dgrams; i++) {
+        iov[i].iov_base = &ep->txbuf[ofs];
+        iov[i].iov_len = ep->dgram_len[i];
+        ofs += ep->dgram_len[i];
+        msgs[i].msg_hdr.msg_name = &ep->addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(ep->addr);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    while (sent < ep->num_dgrams) {
+        int n = sendmmsg(ep->fd, &msgs[sent], ep->num_dgrams - sent, MSG_DONTWAIT);
+        if (n <= 0) {
+            break;
+        }
+        sent += n;
+    }
+    for (i=0; i<ep->num_dgrams; i++) {
+        if (i < sent) {
+            ep->stats.tx_frames += ep->dgram_frames[i];
+            ep->stats.tx_bytes += ep->dgram_len[i];
+        } else {
+            ep->stats.tx_dropped += ep->dgram_frames[i];
+        }
+    }
+    ep->num_dgrams = 0;
+    ep->txlen = 0;
+}
+
+/*
+  queue a frame for an endpoint. Nothing here may block the select
+  loop, so frames that do not fit are dropped
+ */
+static void endpoint_send(struct endpoint *ep, const uint8_t *buf, uint16_t len)
+{
+    switch (ep->type) {
+    case EP_UDP_OUT:
+    case EP_UDP_IN:
+    case EP_UDP_BCAST:
+        if (!ep->have_addr) {
+            ep->stats.tx_dropped++;
+            return;
+        }
+        if (ep->pack && ep->num_dgrams > 0 &&
+            ep->dgram_len[ep->num_dgrams-1] + len <= ROUTER_UDP_MTU) {
+            ep->dgram_len[ep->num_dgrams-1] += len;
+            ep->dgram_frames[ep->num_dgrams-1]++;
+        } else {
+            if (ep->num_dgrams == ROUTER_UDP_BATCH) {
+                udp_flush(ep);
+            }
+            ep->dgram_len[ep->num_dgrams] = len;
+            ep->dgram_frames[ep->num_dgrams] = 1;
+            ep->num_dgrams++;
+        }
+        memcpy(&ep->txbuf[ep->txlen], buf, len);
+        ep->txlen += len;
+        // counted when sent
+        return;
+
+    case EP_TCP_OUT:
+    case EP_TCP_CLIENT:
+    case EP_SERIAL:
+        if (!ep->connected || ep->txlen + len > ROUTER_TXBUF_SIZE) {
+            ep->stats.tx_dropped++;
+            return;
+        }
+        memcpy(&ep->txbuf[ep->txlen], buf, len);
+        ep->txlen += len;
+        break;
+
+    case EP_TCP_LISTEN:
+        return;
+    }
+    ep->stats.tx_frames++;
+    ep->stats.tx_bytes += len;
+}
+
+/*
+  route one frame from a link (NULL for the flight controller)
+ */
+static void route_frame(const mavlink_message_t *msg, struct endpoint *src, const uint8_t *buf, uint16_t len)
+{
+    int16_t target_sysid, target_compid;
+    struct endpoint *ep;
+    bool to_fc = false;
+    unsigned i;
+
+    if (src != NULL) {
+        // frames from the fc are logged by the caller
+        mavlink_tlog_add(buf, len);
+    }
+    learn(msg, src);
+    get_target(msg, &target_sysid, &target_compid);
+    mark_counter++;
+
+    if (target_sysid <= 0) {
+        // broadcast to every other link
+        for (ep=endpoints; ep; ep=ep->next) {
+            if (ep != src) {
+                ep->mark = mark_counter;
+            }
+        }
+        to_fc = (src != NULL);
+    } else {
+        bool found = false;
+        for (i=0; i<num_routes; i++) {
+            struct route *r = &routes[i];
+            if (r->sysid != target_sysid ||
+                (target_compid > 0 && r->compid != target_compid)) {
+                continue;
+            }
+            found = true;
+            if (r->ep == src) {
+                continue;
+            }
+            if (r->ep == NULL) {
+                to_fc = true;
+            } else {
+                r->ep->mark = mark_counter;
+            }
+        }
+        if (!found) {
+            if (src != NULL) {
+                // the flight controller is the default route
+                to_fc = true;
+            } else {
+                fc_stats.unroutable++;
+            }
+        }
+    }
+
+    for (ep=endpoints; ep; ep=ep->next) {
+        if (ep->mark == mark_counter) {
+            endpoint_send(ep, buf, len);
+        }
+    }
+    if (to_fc) {
+        mavlink_fc_write(buf, len);
+        fc_stats.tx_frames++;
+    }
+}
+
+/*
+  route a frame received from the flight controller
+ */
+void mavlink_router_from_fc(const mavlink_message_t *msg, const uint8_t *frame, uint16_t len)
+{
+    pthread_mutex_lock(&router_lock);
+    fc_stats.rx_frames++;
+    route_frame(msg, NULL, frame, len);
+    pthread_mutex_unlock(&router_lock);
+}
+
+/*
+  parse bytes received on an endpoint
+ */
+static void endpoint_input(struct endpoint *ep, const uint8_t *buf, ssize_t len)
+{
+    mavlink_message_t msg;
+    mavlink_status_t status;
+    ssize_t i;
+
+    ep->stats.rx_bytes += len;
+    for (i=0; i<len; i++) {
+        uint8_t res = mavlink_frame_char_buffer(&ep->rxmsg, &ep->rxstatus, buf[i], &msg, &status);
+        mavlink_raw_frame_byte(&ep->rxraw, &ep->rxstatus, buf[i]);
+        if (res == MAVLINK_FRAMING_OK) {
+            ep->stats.rx_frames++;
+            mavlink_raw_frame_finish(&ep->rxraw, &msg);
+            route_frame(&msg, ep, ep->rxraw.buf, ep->rxraw.len);
+        } else if (res == MAVLINK_FRAMING_BAD_CRC &&
+                   mavlink_get_msg_entry(ep->rxmsg.msgid) == NULL &&
+                   raw_frame_whole(&ep->rxraw, &ep->rxmsg)) {
+            // a message we have no definition of, so no crc extra to
+            // check it with. Pass it on untargeted as it arrived
+            ep->stats.rx_frames++;
+            route_frame(&ep->rxmsg, ep, ep->rxraw.buf, ep->rxraw.len);
+        } else if (res == MAVLINK_FRAMING_BAD_CRC || res == MAVLINK_FRAMING_BAD_SIGNATURE) {
+            ep->stats.rx_errors++;
+        }
+    }
+}
+
+/*
+  read a batch of datagrams on a udp endpoint
+ */
+static void udp_receive(struct endpoint *ep)
+{
+    // only used from the select loop
+    static uint8_t bufs[ROUTER_UDP_BATCH][2048];
+    static struct sockaddr_in from[ROUTER_UDP_BATCH];
+    struct mmsghdr msgs[ROUTER_UDP_BATCH];
+    struct iovec iov[ROUTER_UDP_BATCH];
+    int i, n;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i=0; i<ROUTER_UDP_BATCH; i++) {
+        iov[i].iov_base = bufs[i];
+        iov[i].iov_len = sizeof(bufs[i]);
+        msgs[i].msg_hdr.msg_name = &from[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    n = recvmmsg(ep->fd, msgs, ROUTER_UDP_BATCH, MSG_DONTWAIT, NULL);
+    for (i=0; i<n; i++) {
+        if (ep->type != EP_UDP_BCAST) {
+            // reply to whoever is talking to us
+            ep->addr = from[i];
+            ep->have_addr = true;
+        }
+        endpoint_input(ep, bufs[i], msgs[i].msg_len);
+    }
+}
+
+/*
+  accept a client on a tcp listening endpoint
+ */
+static void tcp_accept(struct endpoint *listener)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int one = 1;
+    int fd = accept(listener->fd, (struct sockaddr *)&addr, &addrlen);
+    if (fd == -1) {
+        return;
+    }
+    struct endpoint *ep = talloc_zero(NULL, struct endpoint);
+    if (ep == NULL) {
+        close(fd);
+        return;
+    }
+    char ip[INET_ADDRSTRLEN] = "";
+    inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+    ep->type = EP_TCP_CLIENT;
+    ep->name = talloc_asprintf(ep, "%s/%s:%u", listener->name, ip, ntohs(addr.sin_port));
+    ep->fd = fd;
+    ep->connected = true;
+    ep->txbuf = talloc_size(ep, ROUTER_TXBUF_SIZE);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(one));
+    set_nonblocking(fd);
+    ep->next = endpoints;
+    endpoints = ep;
+}
+
+/*
+  see if a stream endpoint is waiting to be able to write, either with
+  output queued or for a tcp connect to finish
+ */
+static bool stream_want_write(const struct endpoint *ep)
+{
+    switch (ep->type) {
+    case EP_TCP_OUT:
+        return !ep->connected || ep->txlen > 0;
+    case EP_TCP_CLIENT:
+    case EP_SERIAL:
+        return ep->connected && ep->txlen > 0;
+    default:
+        return false;
+    }
+}
+
+/*
+  add the endpoint fds to the select sets, for writing as well as
+  reading where a stream endpoint is waiting to write
+ */
+void mavlink_router_fdset(fd_set *fds, fd_set *wfds, int *numfd)
+{
+    struct endpoint *ep;
+    pthread_mutex_lock(&router_lock);
+    for (ep=endpoints; ep; ep=ep->next) {
+        if (ep->fd != -1) {
+            FD_SET(ep->fd, fds);
+            if (stream_want_write(ep)) {
+                FD_SET(ep->fd, wfds);
+            }
+            if (ep->fd >= *numfd) {
+                *numfd = ep->fd+1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&router_lock);
+}
+
+/*
+  check a connecting tcp endpoint
+ */
+static void tcp_check_connect(struct endpoint *ep)
+{
+    struct pollfd pfd = { ep->fd, POLLOUT, 0 };
+    if (poll(&pfd, 1, 0) != 1) {
+        return;
+    }
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(ep->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+        endpoint_close(ep);
+        return;
+    }
+    ep->connected = true;
+}
+
+/*
+  handle endpoint input after select, write out queued data on
+  endpoints that can take it, and reopen lost endpoints
+ */
+void mavlink_router_poll(fd_set *fds, fd_set *wfds)
+{
+    struct endpoint *ep, *next, **prev;
+    uint8_t buf[2048];
+
+    pthread_mutex_lock(&router_lock);
+    for (prev=&endpoints, ep=endpoints; ep; ep=next) {
+        next = ep->next;
+        if (ep->fd == -1) {
+            if ((ep->type == EP_TCP_OUT || ep->type == EP_SERIAL) &&
+                get_time_boot_ms() - ep->last_open_ms > ROUTER_RECONNECT_MS) {
+                if (ep->type == EP_TCP_OUT) {
+                    tcp_connect(ep);
+                } else {
+                    serial_open(ep);
+                }
+            }
+            prev = &ep->next;
+            continue;
+        }
+        if (ep->type == EP_TCP_OUT && !ep->connected) {
+            tcp_check_connect(ep);
+        }
+        if (ep->fd != -1 && FD_ISSET(ep->fd, wfds)) {
+            stream_flush(ep);
+        }
+        if (ep->fd == -1 || !FD_ISSET(ep->fd, fds)) {
+            prev = &ep->next;
+            continue;
+        }
+
+        if (ep->type == EP_TCP_LISTEN) {
+            // new clients go on the front of the list, behind us
+            tcp_accept(ep);
+            prev = &ep->next;
+            continue;
+        }
+
+        if (ep->type == EP_UDP_OUT || ep->type == EP_UDP_IN || ep->type == EP_UDP_BCAST) {
+            udp_receive(ep);
+            prev = &ep->next;
+            continue;
+        }
+
+        ssize_t n = read(ep->fd, buf, sizeof(buf));
+        if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+            forget(ep);
+            endpoint_close(ep);
+            if (ep->type == EP_TCP_CLIENT) {
+                *prev = next;
+                talloc_free(ep);
+                continue;
+            }
+        }
+        if (n > 0) {
+            endpoint_input(ep, buf, n);
+        }
+        prev = &ep->next;
+    }
+    pthread_mutex_unlock(&router_lock);
+}
+
+/*
+  write out everything queued for the endpoints
+ */
+void mavlink_router_flush(void)
+{
+    struct endpoint *ep;
+    pthread_mutex_lock(&router_lock);
+    for (ep=endpoints; ep; ep=ep->next) {
+        if (ep->type == EP_UDP_OUT || ep->type == EP_UDP_IN || ep->type == EP_UDP_BCAST) {
+            udp_flush(ep);
+        } else {
+            stream_flush(ep);
+        }
+    }
+    pthread_mutex_unlock(&router_lock);
+}
+
+/*
+  router state as json
+ */
+void mavlink_router_status_json(struct sock_buf *sock)
+{
+    struct endpoint *ep;
+    unsigned i;
+    bool first;
+
+    pthread_mutex_lock(&router_lock);
+    sock_printf(sock, "{ \"fc\" : { \"rx_frames\" : %llu, \"tx_frames\" : %llu, \"unroutable\" : %llu, \"routes\" : [",
+                (unsigned long long)fc_stats.rx_frames, (unsigned long long)fc_stats.tx_frames,
+                (unsigned long long)fc_stats.unroutable);
+    first = true;
+    for (i=0; i<num_routes; i++) {
+        if (routes[i].ep == NULL) {
+            sock_printf(sock, "%s[%u,%u]", first?"":",", routes[i].sysid, routes[i].compid);
+            first = false;
+        }
+    }
+    sock_printf(sock, "] }, \"endpoints\" : [");
+    for (ep=endpoints; ep; ep=ep->next) {
+        sock_printf(sock, "%s{ \"name\" : \"%s\", \"type\" : \"%s\", \"connected\" : %s, "
+                    "\"rx_frames\" : %llu, \"rx_bytes\" : %llu, \"rx_errors\" : %llu, "
+                    "\"tx_frames\" : %llu, \"tx_bytes\" : %llu, \"tx_dropped\" : %llu, \"routes\" : [",
+                    ep==endpoints?"":", ", ep->name, type_names[ep->type],
+                    (ep->fd != -1 && (ep->connected || ep->type < EP_TCP_OUT || ep->type == EP_TCP_LISTEN))?"true":"false",
+                    (unsigned long long)ep->stats.rx_frames, (unsigned long long)ep->stats.rx_bytes,
+                    (unsigned long long)ep->stats.rx_errors, (unsigned long long)ep->stats.tx_frames,
+                    (unsigned long long)ep->stats.tx_bytes, (unsigned long long)ep->stats.tx_dropped);
+        first = true;
+        for (i=0; i<num_routes; i++) {
+            if (routes[i].ep == ep) {
+                sock_printf(sock, "%s[%u,%u]", first?"":",", routes[i].sysid, routes[i].compid);
+                first = false;
+            }
+        }
+        sock_printf(sock, "] }");
+    }
+    sock_printf(sock, "] }");
+    pthread_mutex_unlock(&router_lock);
+}
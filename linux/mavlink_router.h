@@ -0,0 +1,24 @@
+#pragma once
+
+#include "../mavlink_core.h"
+#include <sys/select.h>
+
+struct sock_buf;
+
+/*
+  the bytes of the frame being parsed, kept so frames can be passed on
+  unchanged
+ */
+struct mavlink_raw_frame {
+    uint8_t buf[MAVLINK_MAX_PACKET_LEN];
+    uint16_t len;
+};
+
+void mavlink_raw_frame_byte(struct mavlink_raw_frame *raw, const mavlink_status_t *status, uint8_t c);
+void mavlink_raw_frame_finish(struct mavlink_raw_frame *raw, const mavlink_message_t *msg);
+bool mavlink_router_add(const char *spec);
+void mavlink_router_fdset(fd_set *fds, fd_set *wfds, int *numfd);
+void mavlink_router_poll(fd_set *fds, fd_set *wfds);
+void mavlink_router_flush(void);
+void mavlink_router_from_fc(const mavlink_message_t *msg, const uint8_t *frame, uint16_t len);
+void mavlink_router_status_json(struct sock_buf *sock);
@@ -0,0 +1,274 @@
+/*
+  telemetry log of every frame to and from the fc, including those
+  routed up from ground stations
+
+  The select loop copies each frame, with its length and timestamp,
+  into a single producer single consumer ring without taking any
+  lock. Only the select loop may add frames. A writer thread drains
+  the ring into a page aligned buffer and writes it out in large
+  blocks. Files are preallocated with fallocate() and a new
+  file is started when one fills.
+
+  If the disk stalls and the ring fills, frames are dropped and
+  counted rather than holding up the select loop.
+
+  Records in the files use the usual tlog format: a big endian unix
+  time in microseconds followed by the frame as sent on the wire. The
+  length kept ahead of each record in the ring is not written out.
+ */
+
+#define _GNU_SOURCE
+#include "../includes.h"
+#include "mavlink_tlog.h"
+
+// must be a power of two
+#define TLOG_RING_SIZE (4*1024*1024)
+#define TLOG_WRITE_SIZE (128*1024)
+#define TLOG_FILE_SIZE (64*1024*1024)
+// longest a record waits in the ring before being written
+#define TLOG_FLUSH_MS 1000
+#define TLOG_POLL_MS 20
+
+static char *tlog_dir;
+static uint8_t *tlog_ring;
+// head is only written by the select loop, tail by the writer thread
+static uint32_t tlog_head;
+static uint32_t tlog_tail;
+
+static struct {
+    uint64_t frames;
+    uint64_t dropped;
+    uint64_t bytes;
+    uint32_t files;
+    uint32_t write_errors;
+} tlog_stats;
+
+static pthread_mutex_t tlog_name_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *tlog_name;
+
+/*
+  copy into the ring at a free running position
+ */
+static void ring_put(uint32_t pos, const uint8_t *data, uint32_t len)
+{
+    uint32_t ofs = pos & (TLOG_RING_SIZE-1);
+    uint32_t n = TLOG_RING_SIZE - ofs;
+    if (n > len) {
+        n = len;
+    }
+    memcpy(&tlog_ring[ofs], data, n);
+    memcpy(tlog_ring, data+n, len-n);
+}
+
+/*
+  copy out of the ring at a free running position
+ */
+static void ring_get(uint32_t pos, uint8_t *data, uint32_t len)
+{
+    uint32_t ofs = pos & (TLOG_RING_SIZE-1);
+    uint32_t n = TLOG_RING_SIZE - ofs;
+    if (n > len) {
+        n = len;
+    }
+    memcpy(data, &tlog_ring[ofs], n);
+    memcpy(data+n, tlog_ring, len-n);
+}
+
+/*
+  add a frame to the log. Only called from the select loop
+ */
+void mavlink_tlog_add(const uint8_t *frame, uint16_t len)
+{
+    uint8_t stamp[8];
+    struct timespec ts;
+    if (tlog_ring == NULL || len > MAVLINK_MAX_PACKET_LEN) {
+        return;
+    }
+    uint32_t head = tlog_head;
+    uint32_t tail = __atomic_load_n(&tlog_tail, __ATOMIC_ACQUIRE);
+    uint16_t rlen = 8 + len;
+    if (TLOG_RING_SIZE - (head - tail) < sizeof(rlen) + rlen) {
+        __atomic_add_fetch(&tlog_stats.dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t usec = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+    uint8_t i;
+    for (i=0; i<8; i++) {
+        stamp[i] = usec >> (56 - 8*i);
+    }
+    ring_put(head, (const uint8_t *)&rlen, sizeof(rlen));
+    ring_put(head + sizeof(rlen), stamp, 8);
+    ring_put(head + sizeof(rlen) + 8, frame, len);
+    __atomic_store_n(&tlog_head, head + sizeof(rlen) + rlen, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&tlog_stats.frames, 1, __ATOMIC_RELAXED);
+}
+
+/*
+  length of the tlog record starting at a ring position, not counting
+  the length itself
+ */
+static uint16_t record_len(uint32_t pos)
+{
+    uint16_t len;
+    ring_get(pos, (uint8_t *)&len, sizeof(len));
+    return len;
+}
+
+/*
+  open the next log file, preallocated to its full size
+ */
+static int tlog_open(void)
+{
+    time_t t = time(NULL);
+    struct tm tm;
+    char stamp[32];
+    localtime_r(&t, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+    char *name = talloc_asprintf(NULL, "%s/%s-%u.tlog", tlog_dir, stamp, tlog_stats.files);
+    if (name == NULL) {
+        return -1;
+    }
+    int fd = open(name, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if (fd == -1) {
+        console_printf("Failed to create %s: %s\n", name, strerror(errno));
+        talloc_free(name);
+        return -1;
+    }
+    // keep the size at what we have written, so a partly filled file
+    // is still a valid tlog
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, TLOG_FILE_SIZE) != 0) {
+        console_printf("fallocate %s: %s\n", name, strerror(errno));
+    }
+    tlog_stats.files++;
+    pthread_mutex_lock(&tlog_name_lock);
+    talloc_free(tlog_name);
+    tlog_name = name;
+    pthread_mutex_unlock(&tlog_name_lock);
+    return fd;
+}
+
+/*
+  write a whole buffer, returning false on error
+ */
+static bool write_all(int fd, const uint8_t *buf, uint32_t len)
+{
+    while (len > 0) {
+        ssize_t ret = write(fd, buf, len);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+/*
+  writer thread: drain whole records from the ring into an aligned
+  buffer, and write it out a block at a time. A new file is started
+  when the next block would overflow the preallocated size, so every
+  file starts on a record
+ */
+static void *tlog_thread(void *arg)
+{
+    uint8_t *buf = NULL;
+    uint32_t buf_len = 0;
+    uint32_t file_len = 0;
+    uint32_t flush_ms = get_time_boot_ms();
+    int fd = -1;
+
+    if (posix_memalign((void **)&buf, 4096, TLOG_WRITE_SIZE) != 0) {
+        console_printf("tlog: no memory\n");
+        return NULL;
+    }
+    while (true) {
+        uint32_t tail = tlog_tail;
+        uint32_t head = __atomic_load_n(&tlog_head, __ATOMIC_ACQUIRE);
+        bool full = false;
+        while (tail != head) {
+            uint16_t len = record_len(tail);
+            if (buf_len + len > TLOG_WRITE_SIZE) {
+                full = true;
+                break;
+            }
+            ring_get(tail + sizeof(len), &buf[buf_len], len);
+            buf_len += len;
+            tail += sizeof(len) + len;
+        }
+        __atomic_store_n(&tlog_tail, tail, __ATOMIC_RELEASE);
+
+        if (!full && (buf_len == 0 || get_time_boot_ms() - flush_ms < TLOG_FLUSH_MS)) {
+            usleep(TLOG_POLL_MS*1000);
+            continue;
+        }
+        if (fd != -1 && file_len + buf_len > TLOG_FILE_SIZE) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd == -1) {
+            fd = tlog_open();
+            file_len = 0;
+        }
+        if (fd == -1 || !write_all(fd, buf, buf_len)) {
+            // throw the block away, and start a new file next time
+            tlog_stats.write_errors++;
+            if (fd != -1) {
+                close(fd);
+                fd = -1;
+            }
+            sleep(1);
+        } else {
+            tlog_stats.bytes += buf_len;
+            file_len += buf_len;
+        }
+        buf_len = 0;
+        flush_ms = get_time_boot_ms();
+    }
+    return NULL;
+}
+
+/*
+  start logging to a directory
+ */
+bool mavlink_tlog_init(const char *dir)
+{
+    pthread_t thread_id;
+    tlog_dir = talloc_strdup(NULL, dir);
+    tlog_ring = talloc_size(NULL, TLOG_RING_SIZE);
+    if (tlog_dir == NULL || tlog_ring == NULL) {
+        return false;
+    }
+    int perrno = pthread_create(&thread_id, NULL, tlog_thread, NULL);
+    if (perrno != 0) {
+        console_printf("pthread_create failed: %s\n", strerror(perrno));
+        talloc_free(tlog_ring);
+        tlog_ring = NULL;
+        return false;
+    }
+    pthread_detach(thread_id);
+    return true;
+}
+
+/*
+  logging state as json
+ */
+void mavlink_tlog_status_json(struct sock_buf *sock)
+{
+    pthread_mutex_lock(&tlog_name_lock);
+    char *name = talloc_strdup(sock, tlog_name?tlog_name:"");
+    pthread_mutex_unlock(&tlog_name_lock);
+    uint32_t used = __atomic_load_n(&tlog_head, __ATOMIC_RELAXED) - __atomic_load_n(&tlog_tail, __ATOMIC_RELAXED);
+    sock_printf(sock, "{ \"enabled\" : %s, \"file\" : \"%s\", \"files\" : %u, "
+                "\"frames\" : %llu, \"dropped\" : %llu, \"bytes\" : %llu, "
+                "\"write_errors\" : %u, \"buffered\" : %u }",
+                tlog_ring?"true":"false", name?name:"", tlog_stats.files,
+                (unsigned long long)__atomic_load_n(&tlog_stats.frames, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&tlog_stats.dropped, __ATOMIC_RELAXED),
+                (unsigned long long)tlog_stats.bytes,
+                tlog_stats.write_errors, used);
+    talloc_free(name);
+}
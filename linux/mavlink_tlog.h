@@ -0,0 +1,9 @@
+#pragma once
+
+#include "../mavlink_core.h"
+
+struct sock_buf;
+
+bool mavlink_tlog_init(const char *dir);
+void mavlink_tlog_add(const uint8_t *frame, uint16_t len);
+void mavlink_tlog_status_json(struct sock_buf *sock);
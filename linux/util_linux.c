@@ -57,6 +57,23 @@ void mdelay(uint32_t ms)
     }
 }
 
+/*
+  wait on a condition for up to ms, with the mutex held. Returns false
+  on timeout
+ */
+bool cond_wait_ms(pthread_cond_t *cond, pthread_mutex_t *mutex, uint32_t ms)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    return pthread_cond_timedwait(cond, mutex, &ts) == 0;
+}
+
 bool toggle_recording(void)
 {
     printf("toggle_recording not implemented\n");
@@ -6,6 +6,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 // get upload progress as a percentage
 uint8_t get_upload_progress(void);
@@ -19,6 +20,9 @@ uint32_t get_time_boot_ms();
 
 void mdelay(uint32_t ms);
 
+// wait on a condition for up to ms, with the mutex held. Returns false on timeout
+bool cond_wait_ms(pthread_cond_t *cond, pthread_mutex_t *mutex, uint32_t ms);
+
 bool toggle_recording(void);
 
 void __reboot(void); // __ so we don't call the os version of this by mistake.
@@ -54,6 +54,52 @@ static void print_one_field(struct sock_buf *sock, const mavlink_message_t *msg,
     }
 }
 
+/*
+  get the value of a scalar field as a double
+ */
+double mavlink_field_double(const mavlink_message_t *msg, const mavlink_field_info_t *f)
+{
+    switch (f->type) {
+    case MAVLINK_TYPE_CHAR:
+        return _MAV_RETURN_char(msg, f->wire_offset);
+    case MAVLINK_TYPE_UINT8_T:
+        return _MAV_RETURN_uint8_t(msg, f->wire_offset);
+    case MAVLINK_TYPE_INT8_T:
+        return _MAV_RETURN_int8_t(msg, f->wire_offset);
+    case MAVLINK_TYPE_UINT16_T:
+        return _MAV_RETURN_uint16_t(msg, f->wire_offset);
+    case MAVLINK_TYPE_INT16_T:
+        return _MAV_RETURN_int16_t(msg, f->wire_offset);
+    case MAVLINK_TYPE_UINT32_T:
+        return _MAV_RETURN_uint32_t(msg, f->wire_offset);
+    case MAVLINK_TYPE_INT32_T:
+        return _MAV_RETURN_int32_t(msg, f->wire_offset);
+    case MAVLINK_TYPE_UINT64_T:
+        return _MAV_RETURN_uint64_t(msg, f->wire_offset);
+    case MAVLINK_TYPE_INT64_T:
+        return _MAV_RETURN_int64_t(msg, f->wire_offset);
+    case MAVLINK_TYPE_FLOAT:
+        return _MAV_RETURN_float(msg, f->wire_offset);
+    case MAVLINK_TYPE_DOUBLE:
+        return _MAV_RETURN_double(msg, f->wire_offset);
+    }
+    return 0;
+}
+
+/*
+  find a field of a message by name
+ */
+const mavlink_field_info_t *mavlink_field_info_by_name(const mavlink_message_info_t *m, const char *name)
+{
+    unsigned i;
+    for (i=0; i<m->num_fields; i++) {
+        if (strcmp(m->fields[i].name, name) == 0) {
+            return &m->fields[i];
+        }
+    }
+    return NULL;
+}
+
 static void print_field(struct sock_buf *sock, const mavlink_message_t *msg, const mavlink_field_info_t *f)
 {
     sock_printf(sock, "\"%s\": ", f->name);
@@ -82,9 +128,11 @@ static void print_field(struct sock_buf *sock, const mavlink_message_t *msg, con
 }
 
 /*
-  print a JSON string for a message to the given socket
+  print the JSON string for a message up to but not including the
+  _age field. This part only depends on the message contents, so it
+  can be cached between requests
 */
-bool mavlink_json_message(struct sock_buf *sock, const mavlink_message_t *msg, uint32_t receive_ms)
+bool mavlink_json_message_body(struct sock_buf *sock, const mavlink_message_t *msg)
 {
     const mavlink_message_info_t *m = mavlink_get_message_info(msg);
     if (m == NULL) {
@@ -100,8 +148,27 @@ bool mavlink_json_message(struct sock_buf *sock, const mavlink_message_t *msg, u
     sock_printf(sock, "\"_seq\" : %u, ", msg->seq);
     sock_printf(sock, "\"_sysid\" : %u, ", msg->sysid);
     sock_printf(sock, "\"_compid\" : %u, ", msg->compid);
+    return true;
+}
+
+/*
+  print the trailing _age field of a JSON message
+*/
+void mavlink_json_message_age(struct sock_buf *sock, uint32_t receive_ms)
+{
     sock_printf(sock, "\"_age\" : %u", get_time_boot_ms() - receive_ms);
     sock_printf(sock, "}");
+}
+
+/*
+  print a JSON string for a message to the given socket
+*/
+bool mavlink_json_message(struct sock_buf *sock, const mavlink_message_t *msg, uint32_t receive_ms)
+{
+    if (!mavlink_json_message_body(sock, msg)) {
+        return false;
+    }
+    mavlink_json_message_age(sock, receive_ms);
     return true;
 }
 
@@ -117,6 +184,174 @@ const char *mavlink_message_name(const mavlink_message_t *msg)
     return NULL;
 }
 
+/*
+  get the message info for a message
+*/
+const mavlink_message_info_t *mavlink_message_info(const mavlink_message_t *msg)
+{
+    return mavlink_get_message_info(msg);
+}
+
+/*
+  perfect hash from message name to message info, built at startup so
+  name lookups in request handling are constant time. Uses hash and
+  displace: names are first grouped into buckets, then each bucket
+  gets a displacement that places all of its names in free slots
+ */
+struct message_entry {
+    const mavlink_message_info_t *info;
+    // maximum packed payload length, including extensions
+    uint8_t max_len;
+};
+
+extern const mavlink_msg_entry_t *mavlink_get_msg_entry(uint32_t msgid);
+
+static const mavlink_msg_entry_t message_crcs[] = MAVLINK_MESSAGE_CRCS;
+#define NUM_MESSAGES (sizeof(message_crcs)/sizeof(message_crcs[0]))
+
+static struct message_entry *name_table;
+static uint16_t *name_displacement;
+static uint16_t name_table_size;
+static uint16_t name_num_buckets;
+
+static uint32_t name_hash(const char *name, uint32_t seed)
+{
+    uint32_t h = 2166136261U ^ (seed * 0x9E3779B9U);
+    while (*name) {
+        h ^= (uint8_t)*name++;
+        h *= 16777619U;
+    }
+    h ^= h >> 15;
+    h *= 0x2c1b3c6dU;
+    h ^= h >> 12;
+    return h;
+}
+
+/*
+  build the name hash. Must be called before any http threads start
+ */
+void mavlink_message_info_init(void)
+{
+    uint16_t n = NUM_MESSAGES;
+    uint16_t i, b;
+
+    name_table_size = n + n/4 + 1;
+    name_num_buckets = n/4 + 1;
+    name_table = talloc_zero_array(NULL, struct message_entry, name_table_size);
+    name_displacement = talloc_zero_array(NULL, uint16_t, name_num_buckets);
+    uint16_t *bucket_of = talloc_array(NULL, uint16_t, n);
+    uint16_t *bucket_size = talloc_zero_array(NULL, uint16_t, name_num_buckets);
+    const mavlink_message_info_t **infos = talloc_zero_array(NULL, const mavlink_message_info_t *, n);
+    bool *used = talloc_zero_array(NULL, bool, name_table_size);
+    uint16_t *slots = talloc_array(NULL, uint16_t, n);
+    if (!name_table || !name_displacement || !bucket_of || !bucket_size || !infos || !used || !slots) {
+        goto failed;
+    }
+
+    for (i=0; i<n; i++) {
+        infos[i] = mavlink_get_message_info_by_id(message_crcs[i].msgid);
+        if (infos[i] == NULL) {
+            continue;
+        }
+        bucket_of[i] = name_hash(infos[i]->name, 0) % name_num_buckets;
+        bucket_size[bucket_of[i]]++;
+    }
+
+    // place the largest buckets first, while the table is emptiest
+    uint16_t size;
+    for (size=n; size>0; size--) {
+        for (b=0; b<name_num_buckets; b++) {
+            if (bucket_size[b] != size) {
+                continue;
+            }
+            uint32_t d;
+            for (d=1; d<0x10000; d++) {
+                uint16_t count = 0;
+                for (i=0; i<n; i++) {
+                    if (infos[i] == NULL || bucket_of[i] != b) {
+                        continue;
+                    }
+                    uint16_t slot = name_hash(infos[i]->name, d) % name_table_size;
+                    uint16_t j;
+                    if (used[slot]) {
+                        break;
+                    }
+                    for (j=0; j<count; j++) {
+                        if (slots[j] == slot) {
+                            break;
+                        }
+                    }
+                    if (j != count) {
+                        break;
+                    }
+                    slots[count++] = slot;
+                }
+                if (i == n) {
+                    break;
+                }
+            }
+            if (d == 0x10000) {
+                console_printf("Failed to build message name hash\n");
+                goto failed;
+            }
+            name_displacement[b] = d;
+            uint16_t count = 0;
+            for (i=0; i<n; i++) {
+                if (infos[i] == NULL || bucket_of[i] != b) {
+                    continue;
+                }
+                uint16_t slot = slots[count++];
+                used[slot] = true;
+                name_table[slot].info = infos[i];
+                name_table[slot].max_len = message_crcs[i].max_msg_len;
+            }
+        }
+    }
+    talloc_free(bucket_of);
+    talloc_free(bucket_size);
+    talloc_free(infos);
+    talloc_free(used);
+    talloc_free(slots);
+    return;
+
+failed:
+    talloc_free(name_table);
+    talloc_free(name_displacement);
+    name_table = NULL;
+    name_displacement = NULL;
+    talloc_free(bucket_of);
+    talloc_free(bucket_size);
+    talloc_free(infos);
+    talloc_free(used);
+    talloc_free(slots);
+}
+
+/*
+  find message info by name, also giving the maximum packed payload
+  length of the message
+ */
+const mavlink_message_info_t *mavlink_message_info_by_name(const char *name, uint8_t *max_len)
+{
+    if (name_table == NULL) {
+        // hash not built, fall back to the generated lookup
+        const mavlink_message_info_t *m = mavlink_get_message_info_by_name(name);
+        if (m && max_len) {
+            const mavlink_msg_entry_t *e = mavlink_get_msg_entry(m->msgid);
+            *max_len = e?e->max_msg_len:0;
+        }
+        return m;
+    }
+    uint16_t b = name_hash(name, 0) % name_num_buckets;
+    const struct message_entry *e = &name_table[name_hash(name, name_displacement[b]) % name_table_size];
+    if (e->info == NULL || strcmp(e->info->name, name) != 0) {
+        return NULL;
+    }
+    if (max_len) {
+        *max_len = e->max_len;
+    }
+    return e->info;
+}
+
 /*
   send a mavlink message using string arguments
  */
@@ -126,7 +361,8 @@ bool mavlink_message_send_args(int argc, char **argv)
         return false;
     }
     const char *msg_name = argv[0];
-    const mavlink_message_info_t *m = mavlink_get_message_info_by_name(msg_name);
+    uint8_t msglen = 0;
+    const mavlink_message_info_t *m = mavlink_message_info_by_name(msg_name, &msglen);
     if (m == NULL) {
         console_printf("Invalid message '%s'\n", msg_name);
         return false;
@@ -221,49 +457,6 @@ bool mavlink_message_send_args(int argc, char **argv)
         }
     }
 
-    uint8_t msglen = 0;
-    for (i=0; i<m->num_fields; i++) {
-        const mavlink_field_info_t *f = &m->fields[i];
-        uint8_t len = 0;
-        switch (f->type) {
-        case MAVLINK_TYPE_CHAR:
-        case MAVLINK_TYPE_UINT8_T:
-        case MAVLINK_TYPE_INT8_T:
-            if (f->array_length > 0) {
-                len = f->array_length;
-            } else {
-                len = 1;
-            }
-            break;
-
-        case MAVLINK_TYPE_INT16_T:
-        case MAVLINK_TYPE_UINT16_T:
-            len = 2;
-            break;
-
-        case MAVLINK_TYPE_INT32_T:
-        case MAVLINK_TYPE_UINT32_T:
-            len = 4;
-            break;
-
-        case MAVLINK_TYPE_INT64_T:
-        case MAVLINK_TYPE_UINT64_T:
-            len = 8;
-            break;
-
-        case MAVLINK_TYPE_FLOAT:
-            len = 4;
-            break;
-
-        case MAVLINK_TYPE_DOUBLE:
-            len = 8;
-            break;
-        }
-        if (len + f->wire_offset > msglen) {
-            msglen = len + f->wire_offset;
-        }
-    }
-
     // send as MAVLink2
     extern void mavlink_set_proto_version(uint8_t chan, unsigned int version);
     extern uint8_t mavlink_get_crc_extra(const mavlink_message_t *msg);
@@ -4,5 +4,12 @@
   print a JSON string for a message to the given socket
 */
 bool mavlink_json_message(struct sock_buf *sock, const mavlink_message_t *msg, uint32_t receive_ms);
+bool mavlink_json_message_body(struct sock_buf *sock, const mavlink_message_t *msg);
+void mavlink_json_message_age(struct sock_buf *sock, uint32_t receive_ms);
 const char *mavlink_message_name(const mavlink_message_t *msg);
+const mavlink_message_info_t *mavlink_message_info(const mavlink_message_t *msg);
 bool mavlink_message_send_args(int argc, char **argv);
+void mavlink_message_info_init(void);
+const mavlink_message_info_t *mavlink_message_info_by_name(const char *name, uint8_t *max_len);
+double mavlink_field_double(const mavlink_message_t *msg, const mavlink_field_info_t *f);
+const mavlink_field_info_t *mavlink_field_info_by_name(const mavlink_message_info_t *m, const char *name);
@@ -0,0 +1,267 @@
+/*
+  single-flight coalescing of identical dynamic requests
+
+  When many clients poll the same ajax json with the same read-only
+  commands, only one of them runs the template engine. Requests that
+  arrive while that render is in progress wait for it and share the
+  result, as do requests arriving within a small freshness window
+  after it completes.
+
+  Only requests whose variables are all commandN calls to functions
+  listed in readonly_functions[] are coalesced, so anything with side
+  effects always runs on its own.
+ */
+
+#include "../includes.h"
+#include "coalesce.h"
+
+struct coalesce_entry {
+    struct coalesce_entry *next;
+    char *key;
+    bool done;
+    bool unlinked;
+    uint32_t done_ms;
+    // rendered response body, NULL if empty
+    char *body;
+    // number of requests waiting on this render
+    unsigned waiters;
+};
+
+static pthread_mutex_t coalesce_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t coalesce_cond = PTHREAD_COND_INITIALIZER;
+static struct coalesce_entry *coalesce_entries;
+static uint32_t coalesce_window_ms = 20;
+
+/*
+  template functions which have no side effects
+ */
+static const char *readonly_functions[] = {
+    "mavlink_message",
+    "mavlink_message_list",
+    "mavlink_system_message",
+    "mavlink_system_list",
+    "mavlink_history",
+    "mavlink_rollup",
+    "get_param",
+    "get_param_list",
+    "get_param_changes",
+    "mission_get",
+    "tlog_status",
+    "router_status",
+    "uptime",
+    "mem_free",
+    "fc_mavlink_count",
+    "fc_mavlink_baudrate",
+    "upload_progress",
+    "upload_message",
+    "disk_info",
+    "file_listdir",
+    NULL
+};
+
+/*
+  set the freshness window in milliseconds. A window of zero still
+  shares the result between concurrent requests
+ */
+void coalesce_set_window(uint32_t window_ms)
+{
+    coalesce_window_ms = window_ms;
+}
+
+/*
+  check if a command is a call to a read-only function
+ */
+static bool command_readonly(const char *command)
+{
+    size_t len = strcspn(command, "(");
+    uint8_t i;
+    if (command[len] != '(') {
+        return false;
+    }
+    for (i=0; readonly_functions[i]; i++) {
+        if (strlen(readonly_functions[i]) == len &&
+            strncmp(readonly_functions[i], command, len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+  append a command to a key as process_c_call() will see it: the name,
+  then each argument trimmed at both ends but with any whitespace
+  inside it kept. Each
+  argument is given with its length so different argument lists can't
+  give the same text
+ */
+static char *coalesce_key_command(char *key, const char *command)
+{
+    const char *p = strchr(command, '(');
+    char *args, *tok, *save;
+
+    key = talloc_asprintf_append(key, "\n%.*s(", (int)(p - command), command);
+    if (key == NULL) {
+        return NULL;
+    }
+    args = talloc_strndup(key, p+1, strcspn(p+1, ")"));
+    if (args == NULL) {
+        talloc_free(key);
+        return NULL;
+    }
+    for (tok = strtok_r(args, ",", &save); tok && key; tok = strtok_r(NULL, ",", &save)) {
+        while (isspace(*tok)) tok++;
+        trim_tail(tok, " \t\r\n");
+        key = talloc_asprintf_append(key, "%u:%s;", (unsigned)strlen(tok), tok);
+    }
+    talloc_free(args);
+    return key;
+}
+
+/*
+  build the coalescing key for a request, or NULL if the request can't
+  be coalesced. The key is the path plus each command as it will be
+  parsed
+ */
+static char *coalesce_key(struct cgi_state *cgi, const char *path)
+{
+    struct cgi_var *var;
+    char cmd[] = "commandN";
+    uint8_t i;
+
+    if (strncmp(path, "ajax/", 5) != 0 || !cgi->sock->add_content_length) {
+        return NULL;
+    }
+
+    // any variable other than a command may change the result
+    for (var=cgi->variables; var; var=var->next) {
+        if (strncmp(var->name, "command", 7) != 0 ||
+            var->name[7] < '1' || var->name[7] > '9' || var->name[8] != 0 ||
+            var->content != NULL ||
+            !command_readonly(var->value)) {
+            return NULL;
+        }
+    }
+
+    char *key = talloc_strdup(cgi, path);
+    for (i=1; i<10 && key; i++) {
+        cmd[strlen(cmd)-1] = '0' + i;
+        const char *command = cgi->get(cgi, cmd);
+        if (!command) {
+            break;
+        }
+        key = coalesce_key_command(key, command);
+    }
+    return key;
+}
+
+/*
+  find an entry by key
+ */
+static struct coalesce_entry *coalesce_find(const char *key)
+{
+    struct coalesce_entry *e;
+    for (e=coalesce_entries; e; e=e->next) {
+        if (strcmp(e->key, key) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/*
+  remove an entry from the list, freeing it if nobody is waiting on it
+ */
+static void coalesce_unlink(struct coalesce_entry *e)
+{
+    struct coalesce_entry **ep;
+    for (ep=&coalesce_entries; *ep; ep=&(*ep)->next) {
+        if (*ep == e) {
+            *ep = e->next;
+            break;
+        }
+    }
+    e->unlinked = true;
+    if (e->waiters == 0) {
+        talloc_free(e);
+    }
+}
+
+/*
+  drop completed entries that are past the freshness window
+ */
+static void coalesce_expire(uint32_t now)
+{
+    struct coalesce_entry *e, *next;
+    for (e=coalesce_entries; e; e=next) {
+        next = e->next;
+        if (e->done && now - e->done_ms > coalesce_window_ms) {
+            coalesce_unlink(e);
+        }
+    }
+}
+
+/*
+  process a dynamic request, sharing the result with identical
+  requests. Returns false if the request can't be coalesced, in which
+  case the caller should process it normally
+ */
+bool coalesce_process(struct cgi_state *cgi, const char *path)
+{
+    char *key = coalesce_key(cgi, path);
+    if (key == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&coalesce_lock);
+    coalesce_expire(get_time_boot_ms());
+
+    struct coalesce_entry *e = coalesce_find(key);
+    if (e != NULL) {
+        // another request is rendering, or has just rendered, this
+        e->waiters++;
+        while (!e->done) {
+            pthread_cond_wait(&coalesce_cond, &coalesce_lock);
+        }
+        if (e->body) {
+            sock_write(cgi->sock, e->body, talloc_get_size(e->body));
+        }
+        e->waiters--;
+        if (e->unlinked && e->waiters == 0) {
+            talloc_free(e);
+        }
+        pthread_mutex_unlock(&coalesce_lock);
+        talloc_free(key);
+        web_debug(3, "coalesced: %s\n", path);
+        return true;
+    }
+
+    e = talloc_zero(NULL, struct coalesce_entry);
+    if (e == NULL) {
+        pthread_mutex_unlock(&coalesce_lock);
+        talloc_free(key);
+        return false;
+    }
+    e->key = talloc_steal(e, key);
+    e->next = coalesce_entries;
+    coalesce_entries = e;
+    pthread_mutex_unlock(&coalesce_lock);
+
+    struct sock_buf *sock = cgi->sock;
+    uint32_t start = sock->buf?talloc_get_size(sock->buf):0;
+
+    cgi->tmpl->process(cgi->tmpl, path, 1);
+
+    pthread_mutex_lock(&coalesce_lock);
+    uint32_t size = sock->buf?talloc_get_size(sock->buf):0;
+    if (size > start) {
+        e->body = talloc_memdup(e, sock->buf + start, size - start);
+    }
+    e->done = true;
+    e->done_ms = get_time_boot_ms();
+    if (coalesce_window_ms == 0 && e->waiters == 0) {
+        coalesce_unlink(e);
+    }
+    pthread_cond_broadcast(&coalesce_cond);
+    pthread_mutex_unlock(&coalesce_lock);
+    return true;
+}
@@ -0,0 +1,10 @@
+/*
+  coalescing of identical concurrent dynamic requests
+ */
+
+#pragma once
+
+#include "../includes.h"
+
+void coalesce_set_window(uint32_t window_ms);
+bool coalesce_process(struct cgi_state *cgi, const char *path);
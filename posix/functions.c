@@ -1,6 +1,13 @@
 #include "../includes.h"
 #include "../template.h"
+#include "../cgi.h"
 #include "functions.h"
+#include "../linux/mavlink_rollup.h"
+#include "../linux/mavlink_mission.h"
+#include "../linux/mavlink_ftp.h"
+#include "../linux/mavlink_log.h"
+#include "../linux/mavlink_tlog.h"
+#include "../linux/mavlink_router.h"
 
 #include <dirent.h>
 #include <errno.h>
@@ -109,6 +116,129 @@ static void file_listdir(struct template_state *tmpl, const char *name, const ch
     closedir(dh);
 }
 
+/*
+  long term rollups as JSON. Arguments are the resolution in seconds
+  (1, 10 or 60), the unix time to start from, then the MSG.field series
+  wanted
+ */
+static void mavlink_rollup(struct template_state *tmpl, const char *name, const char *value, int argc, char **argv)
+{
+    if (argc < 2 ||
+        !mavlink_rollup_json(tmpl->sock, atoi(argv[0]), strtoll(argv[1], NULL, 10), argc-2, &argv[2])) {
+        sock_printf(tmpl->sock, "{}");
+    }
+}
+
+/*
+  parameters changed since a version, as json. Arguments are the
+  "EPOCH:N" version from the previous call (0 for all parameters), then
+  an optional time in ms to wait for a change, then optional name
+  prefixes. Waiting turns polling into a push of each change
+ */
+static void get_param_changes(struct template_state *tmpl, const char *name, const char *value, int argc, char **argv)
+{
+    uint32_t since = 0;
+    uint32_t wait_ms = argc>1?strtoul(argv[1], NULL, 10):0;
+    uint32_t epoch = mavlink_param_epoch();
+    bool first = true;
+    if (argc > 0) {
+        char *end = NULL;
+        uint32_t since_epoch = strtoul(argv[0], &end, 10);
+        if (*end == ':' && since_epoch == epoch) {
+            since = strtoul(end+1, NULL, 10);
+        }
+        // otherwise the version is from before a restart, send everything
+    }
+    if (wait_ms > 30000) {
+        wait_ms = 30000;
+    }
+    uint32_t version = mavlink_param_version();
+    if (version == since && wait_ms > 0) {
+        version = mavlink_param_wait(since, wait_ms);
+    }
+    sock_printf(tmpl->sock, "{ \"version\" : \"%u:%u\", \"params\" : [", epoch, version);
+    if (version != since) {
+        mavlink_param_changes_json(tmpl->sock, since, argc>2?argc-2:0, &argv[2], &first);
+    }
+    sock_printf(tmpl->sock, "] }");
+}
+
+/*
+  set the parameters in an uploaded parameter file. The argument is
+  the name of the form variable holding the file, default "file"
+ */
+static void param_set_bulk(struct template_state *tmpl, const char *name, const char *value, int argc, char **argv)
+{
+    struct cgi_state *cgi = talloc_find_parent_byname(tmpl, "struct cgi_state");
+    const char *var = argc>0?argv[0]:"file";
+    uint32_t size = 0;
+    if (!cgi) {
+        console_printf("Unable to get cgi state\n");
+        return;
+    }
+    const char *data = cgi->get_content(cgi, var, &size);
+    if (data == NULL) {
+        data = cgi->get(cgi, var);
+        size = data?strlen(data):0;
+    }
+    if (data == NULL) {
+        sock_printf(tmpl->sock, "[]");
+        return;
+    }
+    mavlink_param_set_bulk(tmpl->sock, data, size);
+}
+
+/*
+  the current mission as json. Items are arrays of command, frame,
+  current, autocontinue, param1-4, x, y and z, with x and y as
+  latitude and longitude * 1e7 in global frames
+ */
+static void mission_get(struct template_state *tmpl, const char *name, const char *value, int argc, char **argv)
+{
+    mavlink_mission_json(tmpl->sock);
+}
+
+/*
+  download the mission from the fc, waiting up to the optional
+  timeout in ms. Gives the MAV_MISSION_RESULT, or -1 for no reply and
+  -2 if an upload is running, followed by the mission
+ */
+static void mission_download(struct template_state *tmpl, const char *name, const char *value, int argc, char **argv)
+{
+    uint32_t timeout_ms = argc>0?strtoul(argv[0], NULL, 10):30000;
+    int result = mavlink_mission_download(timeout_ms);
+    sock_printf(tmpl->sock, "{ \"result\" : %d, \"mission\" : ", result);
+    mavlink_mission_json(tmpl->sock);
+    sock_printf(tmpl->sock, " }");
+}
+
+/*
+  upload a QGC WPL mission file to the fc. The argument is the name of
+  the form variable holding the file, default "file". Gives the
+  MAV_MISSION_RESULT, or -1 for no reply, -2 if another transfer is
+  running and -3 for a bad file
+ */
+static void mission_upload(struct template_state *tmpl, const char *name, const char *value, int argc, char **argv)
+{
+    struct cgi_state *cgi = talloc_find_parent_byname(tmpl, "struct cgi_state");
+    const char *var = argc>0?argv[0]:"file";
+    uint32_t size = 0;
+    int result = -3;
+    if (!cgi) {
+        console_printf("Unable to get cgi state\n");
+        return;
+    }
+    const char *data = cgi->get_content(cgi, var, &size);
+    if (data == NULL) {
+        data = cgi->get(cgi, var);
+        size = data?strlen(data):0;
+    }
+    if (data != NULL) {
+        result = mavlink_mission_upload(data, size, 30000);
+    }
+    sock_printf(tmpl->sock, "{ \"result\" : %d }", result);
+}
+
 void download_filesystem(struct cgi_state *cgi, const char *fs_path)
 {
     const char *path = fs_path+2;
@@ -155,8 +285,185 @@ void download_filesystem(struct cgi_state *cgi, const char *fs_path)
     close(fd);
 }
 
+/*
+  mavlink messages from one system as JSON. First two arguments are
+  the sysid and compid, a compid of 0 matches any component
+ */
+static void mavlink_system_message(struct template_state *tmpl, const char *name, const char *value, int argc, char **argv)
+{
+    uint16_t i;
+    bool first = true;
+    if (argc < 2) {
+        return;
+    }
+    uint8_t sysid = atoi(argv[0]);
+    uint8_t compid = atoi(argv[1]);
+    sock_printf(tmpl->sock, "{\n");
+    if (sysid != 0) {
+        for (i=2; i<argc; i++) {
+            mavlink_message_json(tmpl->sock, argv[i], sysid, compid, &first);
+        }
+    }
+    sock_printf(tmpl->sock, "}");
+}
+
+/*
+  list of systems seen on the mavlink link
+ */
+static void mavlink_system_list(struct template_state *tmpl, const char *name, const char *value, int argc, char **argv)
+{
+    mavlink_system_list_json(tmpl->sock);
+}
+
+/*
+  recent samples of a mavlink message as JSON. Arguments are the
+  message name, the sample sequence or "<time>ms" to start from, then
+  the fields wanted. With no fields all scalar fields are given
+ */
+static void mavlink_history(struct template_state *tmpl, const char *name, const char *value, int argc, char **argv)
+{
+    bool first = true;
+    sock_printf(tmpl->sock, "{\n");
+    if (argc >= 2) {
+        mavlink_message_history_json(tmpl->sock, argv[0], 0, 0, argv[1], argc-2, &argv[2], &first);
+    }
+    sock_printf(tmpl->sock, "}");
+}
+
+/*
+  stream a file from the fc over MAVLink FTP. Paths under mavftp/ are
+  absolute on the fc, except for virtual files like @PARAM/param.pck
+ */
+void download_mavftp(struct cgi_state *cgi, const char *path)
+{
+    const char *fc_path = path+6;
+    uint32_t size = 0;
+    int error = 0;
+    if (fc_path[1] == '@') {
+        fc_path++;
+    }
+    struct mavlink_ftp_job *job = mavlink_ftp_open(fc_path, &size, &error);
+    if (job == NULL) {
+        if (error == MAVLINK_FTP_ERR_FILE_NOT_FOUND ||
+            error == MAVLINK_FTP_ERR_ERRNO(ENOENT)) {
+            cgi->http_error(cgi, "404 Bad File", "", "file not found");
+        } else if (error == MAVLINK_FTP_ERR_BUSY) {
+            cgi->http_error(cgi, "503 Busy", "", "another transfer is running");
+        } else {
+            cgi->http_error(cgi, "500 Transfer failed", "", "ftp transfer failed");
+        }
+        return;
+    }
+    cgi->content_length = size;
+    cgi->http_header(cgi, path);
+    uint8_t buf[4096];
+    int32_t n;
+    while ((n = mavlink_ftp_read(job, buf, sizeof(buf))) > 0) {
+        if (sock_write(cgi->sock, (const char *)buf, n) != n) {
+            break;
+        }
+    }
+    mavlink_ftp_close(job);
+}
+
+/*
+  stream a dataflash log from the fc. Paths are mavlog/ID.bin. With
+  save=1 in the query the log is also written to the log directory,
+  and the download carries on if the http client goes away
+ */
+void download_mavlog(struct cgi_state *cgi, const char *path)
+{
+    char *end = NULL;
+    unsigned long id = strtoul(path+7, &end, 10);
+    uint32_t size = 0;
+    int error = 0;
+    int fd = -1;
+    if (end == path+7 || strcmp(end, ".bin") != 0 || id > UINT16_MAX) {
+        cgi->http_error(cgi, "404 Bad File", "", "file not found");
+        return;
+    }
+    struct mavlink_log_job *job = mavlink_log_open(id, &size, &error);
+    if (job == NULL) {
+        if (error == MAVLINK_LOG_ERR_NOT_FOUND) {
+            cgi->http_error(cgi, "404 Bad File", "", "log not found");
+        } else if (error == MAVLINK_LOG_ERR_BUSY) {
+            cgi->http_error(cgi, "503 Busy", "", "another log download is running");
+        } else {
+            cgi->http_error(cgi, "500 Transfer failed", "", "log download failed");
+        }
+        return;
+    }
+    const char *save = cgi->get(cgi, "save");
+    if (save && strcmp(save, "1") == 0 && mavlink_log_dir()) {
+        char *fname = talloc_asprintf(cgi, "%s/%lu.bin", mavlink_log_dir(), id);
+        fd = fname?open(fname, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644):-1;
+        if (fd == -1) {
+            console_printf("Failed to create %s\n", fname);
+        }
+        talloc_free(fname);
+    }
+    cgi->content_length = size;
+    cgi->http_header(cgi, path);
+    uint8_t buf[4096];
+    int32_t n;
+    bool sock_ok = true;
+    while ((n = mavlink_log_read(job, buf, sizeof(buf))) > 0) {
+        if (fd != -1 && write(fd, buf, n) != n) {
+            console_printf("Error saving log: %s\n", strerror(errno));
+            close(fd);
+            fd = -1;
+        }
+        if (sock_ok && sock_write(cgi->sock, (const char *)buf, n) != n) {
+            sock_ok = false;
+        }
+        if (!sock_ok && fd == -1) {
+            break;
+        }
+    }
+    mavlink_log_close(job);
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+/*
+  list of dataflash logs on the fc
+ */
+static void mavlink_log_list(struct template_state *tmpl, const char *name, const char *value, int argc, char **argv)
+{
+    mavlink_log_list_json(tmpl->sock);
+}
+
+/*
+  telemetry log state
+ */
+static void tlog_status(struct template_state *tmpl, const char *name, const char *value, int argc, char **argv)
+{
+    mavlink_tlog_status_json(tmpl->sock);
+}
+
+/*
+  router endpoints, routes and statistics
+ */
+static void router_status(struct template_state *tmpl, const char *name, const char *value, int argc, char **argv)
+{
+    mavlink_router_status_json(tmpl->sock);
+}
+
 void posix_functions_init(struct template_state *tmpl)
 {
     tmpl->put(tmpl, "file_listdir", "", file_listdir);
     tmpl->put(tmpl, "disk_info", "", disk_info);
+    tmpl->put(tmpl, "mavlink_system_message", "", mavlink_system_message);
+    tmpl->put(tmpl, "mavlink_system_list", "", mavlink_system_list);
+    tmpl->put(tmpl, "mavlink_history", "", mavlink_history);
+    tmpl->put(tmpl, "mavlink_rollup", "", mavlink_rollup);
+    tmpl->put(tmpl, "get_param_changes", "", get_param_changes);
+    tmpl->put(tmpl, "param_set_bulk", "", param_set_bulk);
+    tmpl->put(tmpl, "mission_get", "", mission_get);
+    tmpl->put(tmpl, "mission_download", "", mission_download);
+    tmpl->put(tmpl, "mission_upload", "", mission_upload);
+    tmpl->put(tmpl, "mavlink_log_list", "", mavlink_log_list);
+    tmpl->put(tmpl, "tlog_status", "", tlog_status);
+    tmpl->put(tmpl, "router_status", "", router_status);
 }
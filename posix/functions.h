@@ -7,3 +7,5 @@
 
 void posix_functions_init(struct template_state *tmpl);
 void download_filesystem(struct cgi_state *cgi, const char *fs_path);
+void download_mavftp(struct cgi_state *cgi, const char *path);
+void download_mavlog(struct cgi_state *cgi, const char *path);
@@ -5,9 +5,21 @@
 
   https://github.com/tridge/junkcode/tree/master/tserver
 */
+#define _GNU_SOURCE
 #include "web_server.h"
 #include "includes.h"
 #include "web_files.h"
+#include "mavlink_json.h"
+#ifdef _POSIX_VERSION
+#include "posix/coalesce.h"
+#include "linux/mavlink_history.h"
+#include "linux/mavlink_rollup.h"
+#include "linux/mavlink_cache.h"
+#include "linux/mavlink_log.h"
+#include "linux/mavlink_tlog.h"
+#include "linux/mavlink_replay.h"
+#include "linux/mavlink_router.h"
+#endif
 #ifdef SYSTEM_FREERTOS
 #include <libmid_nvram/snx_mid_nvram.h>
 #else
@@ -19,16 +31,18 @@
 static pthread_mutex_t lock;
 static int serial_port_fd = -1;
 static int fc_udp_in_fd = -1;
-static int udp_out_fd = -1;
 
 struct sockaddr_in fc_addr;
 socklen_t fc_addrlen;
 
-struct sockaddr_in udp_out_addr;
-socklen_t udp_out_addrlen;
-
 unsigned baudrate = 57600;
 
+// datagrams read from the flight controller per recvmmsg() call
+#define FC_UDP_BATCH 16
+
+// bytes of the frame being parsed from the flight controller
+static struct mavlink_raw_frame fc_raw;
+
 struct {
     uint64_t packet_count_from_fc;
 } stats;
@@ -217,41 +231,8 @@ void mavlink_fc_send(mavlink_message_t *msg)
     }
 }
 
-/*
-  send a mavlink msg over WiFi
- */
-static void mavlink_broadcast(int fd, mavlink_message_t *msg)
-{
-    uint8_t buf[300];
-    uint16_t len = mavlink_msg_to_send_buffer(buf, msg);
-    if (len > 0) {
-        struct sockaddr_in addr;
-        memset(&addr, 0x0, sizeof(addr));
-
-        addr.sin_family = AF_INET;
-        addr.sin_addr.s_addr = htonl(INADDR_BROADCAST);
-        addr.sin_port = htons(14550);
-        
-        sendto(fd, buf, len, 0, (struct sockaddr*)&addr, sizeof(addr));
-    }
-}
 #endif
 
-/*
-  send a mavlink msg over WiFi to a single target
- */
-static void mavlink_send_udp_out(mavlink_message_t *msg)
-{
-    if (udp_out_fd == -1) {
-        return;
-    }
-    uint8_t buf[300];
-    uint16_t len = mavlink_msg_to_send_buffer(buf, msg);
-    if (len > 0) {
-        sendto(udp_out_fd, buf, len, 0, (struct sockaddr*)&udp_out_addr, sizeof(udp_out_addr));
-    }
-}
-
 /*
   process input on a connection
 */
@@ -532,26 +513,24 @@ unsigned mavlink_fc_pkt_count()
 /*
   main select loop
  */
-static void select_loop(int http_socket_fd, int udp_socket_fd)
+static void select_loop(int http_socket_fd)
 {    
     while (1) {
-        fd_set fds;
+        fd_set fds, wfds;
         struct timeval tv;
         int numfd = 0;
 
+        // send what was routed last time round
+        mavlink_router_flush();
+
         FD_ZERO(&fds);
+        FD_ZERO(&wfds);
         if (http_socket_fd != -1) {
             FD_SET(http_socket_fd, &fds);
             if (http_socket_fd >= numfd) {
                 numfd = http_socket_fd+1;
             }
         }
-        if (udp_socket_fd != -1) {
-            FD_SET(udp_socket_fd, &fds);
-            if (udp_socket_fd >= numfd) {
-                numfd = udp_socket_fd+1;
-            }
-        }
         if (serial_port_fd != -1) {
             FD_SET(serial_port_fd, &fds);
             if (serial_port_fd >= numfd) {
@@ -566,17 +545,13 @@ static void select_loop(int http_socket_fd, int udp_socket_fd)
             }
         }
 
-        if (udp_out_fd != -1) {
-            FD_SET(udp_out_fd, &fds);
-            if (udp_out_fd >= numfd) {
-                numfd = udp_out_fd+1;
-            }
-        }
+        mavlink_router_fdset(&fds, &wfds, &numfd);
 
-        tv.tv_sec = 1;
-        tv.tv_usec = 0;
+        tv.tv_sec = 0;
+        tv.tv_usec = 100000;
 
-        int res = select(numfd, &fds, NULL, NULL, &tv);
+        int res = select(numfd, &fds, &wfds, NULL, &tv);
+        mavlink_update();
         if (res <= 0) {
             continue;
         }
@@ -587,52 +562,41 @@ static void select_loop(int http_socket_fd, int udp_socket_fd)
             do_http_accept(http_socket_fd);
         }
 
-        // check for incoming UDP packet (broadcast)
-        if (udp_socket_fd != -1 &&
-            FD_ISSET(udp_socket_fd, &fds)) {
-            // we have data pending
-            uint8_t buf[300];
-            ssize_t nread = read(udp_socket_fd, buf, sizeof(buf));
-            if (nread > 0) {
-                // send the data straight to the flight controller
-                mavlink_fc_write(buf, nread);
-            }
-        }
-
-        // check for incoming UDP packet from udp-out connection:
-        if (udp_out_fd != -1 &&
-            FD_ISSET(udp_out_fd, &fds)) {
-            // we have data pending
-            uint8_t buf[1024];
-            fc_addrlen = sizeof(fc_addr);
-            ssize_t nread = recvfrom(udp_out_fd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr*)&udp_out_addr, &udp_out_addrlen);
-            if (nread <= 0) {
-                /* printf("Read error from udp out connection\n"); */
-            } else {
-                // send to flight controller
-                mavlink_fc_write(buf, nread);
-            }
-        }
+        // input from GCS endpoints, and output they can now take
+        mavlink_router_poll(&fds, &wfds);
 
         if (fc_udp_in_fd != -1 &&
             FD_ISSET(fc_udp_in_fd, &fds)) {
-            // we have data pending
-            uint8_t buf[3000];
-            fc_addrlen = sizeof(fc_addr);
-            ssize_t nread = recvfrom(fc_udp_in_fd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr*)&fc_addr, &fc_addrlen);
-            if (nread > 0) {
+            // we have data pending, take as many datagrams as we can
+            static uint8_t bufs[FC_UDP_BATCH][3000];
+            static struct sockaddr_in from[FC_UDP_BATCH];
+            struct mmsghdr msgs[FC_UDP_BATCH];
+            struct iovec iov[FC_UDP_BATCH];
+            memset(msgs, 0, sizeof(msgs));
+            for (uint8_t i=0; i<FC_UDP_BATCH; i++) {
+                iov[i].iov_base = bufs[i];
+                iov[i].iov_len = sizeof(bufs[i]);
+                msgs[i].msg_hdr.msg_name = &from[i];
+                msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+                msgs[i].msg_hdr.msg_iov = &iov[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            int n = recvmmsg(fc_udp_in_fd, msgs, FC_UDP_BATCH, MSG_DONTWAIT, NULL);
+            for (int m=0; m<n; m++) {
                 mavlink_message_t msg;
                 mavlink_status_t status;
-                for (uint16_t i=0; i<nread; i++) {
-                    if (mavlink_parse_char(MAVLINK_COMM_FC, buf[i], &msg, &status)) {
+                fc_addr = from[m];
+                fc_addrlen = msgs[m].msg_hdr.msg_namelen;
+                for (uint16_t i=0; i<msgs[m].msg_len; i++) {
+                    uint8_t res = mavlink_parse_char(MAVLINK_COMM_FC, bufs[m][i], &msg, &status);
+                    mavlink_raw_frame_byte(&fc_raw, mavlink_get_channel_status(MAVLINK_COMM_FC), bufs[m][i]);
+                    if (res) {
                         stats.packet_count_from_fc++;
+                        mavlink_raw_frame_finish(&fc_raw, &msg);
+                        mavlink_tlog_add(fc_raw.buf, fc_raw.len);
                         if (!mavlink_handle_msg(&msg)) {
-                            // forward to network connection as a udp broadcast packet
-                            if (udp_socket_fd != -1) {
-                                mavlink_broadcast(udp_socket_fd, &msg);
-                            }
-                            // send to udp-out connection
-                            mavlink_send_udp_out(&msg);
+                            // forward the frame as received to the GCS endpoints
+                            mavlink_router_from_fc(&msg, fc_raw.buf, fc_raw.len);
                         }
                     }
                 }
@@ -652,15 +616,15 @@ static void select_loop(int http_socket_fd, int udp_socket_fd)
                 mavlink_message_t msg;
                 mavlink_status_t status;
                 for (uint16_t i=0; i<nread; i++) {
-                    if (mavlink_parse_char(MAVLINK_COMM_FC, buf[i], &msg, &status)) {
+                    uint8_t res = mavlink_parse_char(MAVLINK_COMM_FC, buf[i], &msg, &status);
+                    mavlink_raw_frame_byte(&fc_raw, mavlink_get_channel_status(MAVLINK_COMM_FC), buf[i]);
+                    if (res) {
                         stats.packet_count_from_fc++;
+                        mavlink_raw_frame_finish(&fc_raw, &msg);
+                        mavlink_tlog_add(fc_raw.buf, fc_raw.len);
                         if (!mavlink_handle_msg(&msg)) {
-                            // forward to network connection as a udp broadcast packet
-                            if (udp_socket_fd != -1) {
-                                mavlink_broadcast(udp_socket_fd, &msg);
-                            }
-                            // send to udp-out connection
-                            mavlink_send_udp_out(&msg);
+                            // forward the frame as received to the GCS endpoints
+                            mavlink_router_from_fc(&msg, fc_raw.buf, fc_raw.len);
                         }
                     }
                 }
@@ -672,7 +636,7 @@ static void select_loop(int http_socket_fd, int udp_socket_fd)
 /*
   open MAVLink serial port
  */
-static int mavlink_serial_open(const char *path, unsigned baudrate)
+int mavlink_serial_open(const char *path, unsigned baudrate)
 {
     int fd = open(path, O_RDWR);
     if (fd == -1) {
@@ -734,38 +698,6 @@ static int tcp_open(const char *ip, const unsigned port)
 }
 
 
-/*
-  open a UDP socket for broadcasting on port 14550
-
-  We will listen on a emphemeral port, and send to the broadcast
-  address
- */
-static int udp_open(void)
-{
-    struct sockaddr_in sock;
-    int res;
-    int one=1;
-    
-    memset(&sock,0,sizeof(sock));
-
-    sock.sin_port = 0;
-    sock.sin_family = AF_INET;
-
-    res = socket(AF_INET, SOCK_DGRAM, 0);
-    if (res == -1) { 
-        return -1;
-    }
-
-    setsockopt(res,SOL_SOCKET,SO_REUSEADDR,(char *)&one,sizeof(one));
-    setsockopt(res,SOL_SOCKET,SO_BROADCAST,(char *)&one,sizeof(one));
-
-    if (bind(res, (struct sockaddr *)&sock, sizeof(sock)) < 0) { 
-        return(-1); 
-    }
-
-    return res;
-}
-
 /*
   open a UDP socket for taking messages from the flight controller
  */
@@ -795,59 +727,28 @@ static int udp_in_open(int port)
     return res;
 }
 
-static int udp_out_open(const char *ip, const int port)
-{
-    int one=1;
-
-    // prepare sending socket
-    struct sockaddr_in send_addr;
-
-    memset(&send_addr,0,sizeof(send_addr));
-
-    send_addr.sin_port = 0;
-    send_addr.sin_family = AF_INET;
-
-    int res = socket(AF_INET, SOCK_DGRAM, 0);
-    if (res == -1) {
-        return -1;
-    }
-
-    setsockopt(res,SOL_SOCKET,SO_REUSEADDR,(char *)&one,sizeof(one));
-
-    if (bind(res, (struct sockaddr *)&send_addr, sizeof(send_addr)) < 0) {
-        return(-1);
-    }
-
-    // prepare destination address
-    memset(&udp_out_addr,0x0,sizeof(udp_out_addr));
-    udp_out_addr.sin_family = AF_INET;
-    if (inet_pton(AF_INET, ip, &udp_out_addr.sin_addr.s_addr) != 1) {
-        printf("Failed to convert IP address\n");
-        exit(1);
-    }
-    udp_out_addr.sin_family = AF_INET;
-    udp_out_addr.sin_port = htons(port);
-
-    return res;
-}
-
-
 /* main program, start listening and answering queries */
 int main(int argc, char *argv[])
 {
     extern char *optarg;
     int opt;
     const char *serial_port = NULL;
-    const char *usage = "Usage: web_server -p http_port -b baudrate -s serial_port -d debug_level -u -f fc_udp_in -O udp-out-address:port";
-    bool do_udp_broadcast = 0;
+    const char *usage = "Usage: web_server -p http_port -b baudrate -s serial_port -d debug_level -u -f fc_udp_in -O udp-out-address:port -E endpoint -c coalesce_ms -H history_depth -R rollup_file -W cache_dir -L log_dir -T tlog_dir -r replay_tlog -x replay_speed -l";
     int fc_udp_in_port = -1;
-    const char *udp_out_arg = NULL; // e.g. 1.2.3.4:6543
+    const char *endpoint_args[32]; // e.g. udp:1.2.3.4:6543 or tcpin:5760
+    unsigned num_endpoints = 0;
+    const unsigned max_endpoints = sizeof(endpoint_args)/sizeof(endpoint_args[0]);
     const char *http_port_arg = NULL; // e.g. 1.2.3.4:6543 or 6543
+    const char *rollup_file = NULL;
+    const char *tlog_dir = NULL;
+    const char *replay_file = NULL;
+    float replay_speed = 1;
+    bool replay_loop = false;
 
     // setup default allowed origin
     setup_origin(public_origin);
 
-    while ((opt=getopt(argc, argv, "p:s:b:hd:uf:O:")) != -1) {
+    while ((opt=getopt(argc, argv, "p:s:b:hd:uf:O:E:c:H:R:W:L:T:r:x:l")) != -1) {
         switch (opt) {
         case 'p':
             http_port_arg = optarg;
@@ -862,13 +763,64 @@ int main(int argc, char *argv[])
             web_server_set_debug(atoi(optarg));
             break;
         case 'u':
-            do_udp_broadcast = 1;
+            // old style broadcast to port 14550
+            if (num_endpoints == max_endpoints) {
+                printf("Too many endpoints\n");
+                exit(1);
+            }
+            endpoint_args[num_endpoints++] = "bcast:14550";
             break;
         case 'f':
             fc_udp_in_port = atoi(optarg);
             break;
         case 'O':
-            udp_out_arg = optarg;
+            if (strchr(optarg, ':') == NULL) {
+                printf("udp-out address should be e.g. 1.2.3.4:6543\n");
+                exit(1);
+            }
+            if (num_endpoints == max_endpoints) {
+                printf("Too many endpoints\n");
+                exit(1);
+            }
+            endpoint_args[num_endpoints++] = talloc_asprintf(NULL, "udp:%s", optarg);
+            break;
+        case 'E':
+            if (num_endpoints == max_endpoints) {
+                printf("Too many endpoints\n");
+                exit(1);
+            }
+            endpoint_args[num_endpoints++] = optarg;
+            break;
+        case 'c':
+            coalesce_set_window(atoi(optarg));
+            break;
+        case 'H':
+            if (!mavlink_history_set_depth(optarg)) {
+                printf("Bad history depth %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'R':
+            rollup_file = optarg;
+            break;
+        case 'W':
+            mavlink_cache_set_dir(optarg);
+            break;
+        case 'L':
+            mavlink_log_set_dir(optarg);
+            break;
+        case 'T':
+            tlog_dir = optarg;
+            break;
+        case 'r':
+            replay_file = optarg;
+            break;
+        case 'x':
+            // 0 means as fast as possible
+            replay_speed = atof(optarg);
+            break;
+        case 'l':
+            replay_loop = true;
             break;
         case 'h':
         default:
@@ -884,6 +836,11 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    if (replay_file != NULL && (serial_port != NULL || fc_udp_in_port != -1)) {
+        console_printf("A replay file (-r) replaces the serial port and udp-in-port");
+        exit(1);
+    }
+
     // summarily ignore SIGPIPE; without this, if a download is
     // interrupted sock_write's write() call will kill the process
     // with SIGPIPE
@@ -893,6 +850,17 @@ int main(int argc, char *argv[])
     }
 
     pthread_mutex_init(&lock, NULL);
+
+    mavlink_message_info_init();
+
+    if (rollup_file && !mavlink_rollup_init(rollup_file)) {
+        exit(1);
+    }
+
+    if (tlog_dir && !mavlink_tlog_init(tlog_dir)) {
+        printf("Failed to start telemetry log in %s\n", tlog_dir);
+        exit(1);
+    }
     
     if (serial_port) {
         serial_port_fd = mavlink_serial_open(serial_port, baudrate);
@@ -902,11 +870,17 @@ int main(int argc, char *argv[])
         }
     }
 
-    int udp_socket_fd = -1;
-    if (do_udp_broadcast) {
-        udp_socket_fd = udp_open();
-        if (udp_socket_fd == -1) {
-            printf("Failed to open UDP socket\n");
+    if (replay_file) {
+        // replayed frames come in through the serial port path
+        serial_port_fd = mavlink_replay_open(replay_file, replay_speed, replay_loop);
+        if (serial_port_fd == -1) {
+            printf("Failed to replay %s\n", replay_file);
+            exit(1);
+        }
+    }
+
+    for (unsigned i=0; i<num_endpoints; i++) {
+        if (!mavlink_router_add(endpoint_args[i])) {
             exit(1);
         }
     }
@@ -936,21 +910,7 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (udp_out_arg != NULL) {
-        char *colon = strchr(udp_out_arg, ':');
-        if (colon == NULL) {
-            printf("udp-out address should be e.g. 1.2.3.4:6543\n");
-            exit(1);
-        }
-        *colon = '\0';
-        udp_out_fd = udp_out_open(udp_out_arg, atoi(colon+1));
-        if (udp_out_fd == -1) {
-            printf("Failed to open UDP-out (%s:%u)\n", udp_out_arg, atoi(colon+1));
-            exit(1);
-        }
-    }
-
-    select_loop(http_socket_fd, udp_socket_fd);
+    select_loop(http_socket_fd);
 
     return 0;
 }
@@ -78,6 +78,9 @@ void sock_printf(struct sock_buf *sock, const char *fmt, ...) FMT_PRINTF(2,3);
 void web_server_set_debug(int debug);
 void web_debug(int level, const char *fmt, ...);
 void mavlink_fc_write(const uint8_t *buf, size_t len);
+#ifndef SYSTEM_FREERTOS
+int mavlink_serial_open(const char *path, unsigned baudrate);
+#endif
 #ifdef SYSTEM_FREERTOS
 void mavlink_rc_write(const uint8_t *buf, uint32_t len);
 #endif